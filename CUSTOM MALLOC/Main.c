@@ -16,411 +16,10998 @@
  * - Custom implementation of 'calloc()' that allocates and zero-initalizes memory before returning of the requested size.
  * - Custom implementation of 'realloc()' that resizes an existing allocation block or reallocate the memory elsewhere.
  * - Prints memory usage statistics. 
+ * - Small requests are served from slab runs of pages, with slot occupancy tracked in a bitmap instead of Block headers.
+ * - Analyzes heap fragmentation: largest free block, free block size histogram, metadata overhead and page occupancy.
+ * - Draws the heap layout as an ASCII strip or a PPM image, also as frames during trace replay.
+ * - Records a histogram of requested sizes and derives a size class table tuned to it.
+ * - Verifies the heap invariants on request, and periodically in debug builds.
+ * - Fuzzes the allocator against glibc's malloc as a shadow model, with libFuzzer or AFL.
+ * - Thread safe: threads are spread over several Block list arenas, slab classes have their own locks, and fork() is handled with pthread_atfork().
+ * - Locks spin adaptively before sleeping in futex(), and count their contention for the stats.
+ * - Small slots are cached per thread and move to and from the size classes in batches through a transfer cache.
+ * - Thread cache limits follow each thread's miss rate, under a global cap on the bytes all thread caches hold.
+ * - Exiting threads flush their cache and give up their arena, which is then handed to the next new thread.
+ * - Optionally counts live bytes per allocating callsite, named with dladdr() when dumped.
+ * - Handle API (halloc/hlock/hunlock/hfree) whose blocks incremental compaction may move, trimming arenas afterwards.
+ * - USDT probes on the allocation, growth, purge and lock contention paths for perf and bpftrace.
+ * - Benchmarks report perf_event_open() hardware counters per operation for every allocation engine.
+ * - Epoch-based deferred reclamation (my_retire with my_epoch_enter/my_epoch_exit) for lock-free data structures.
+ * - Heap limit from MY_MALLOC_LIMIT or the cgroup's memory.max: purge and trim, then a pressure callback, then NULL.
+ * - Stream buffers that commit pages of a reserved range as they grow and are sealed into a my_free()-able pointer.
+ * - Optional per-callsite lifetime prediction that puts short-lived allocations in chunks reset as a whole.
+ * - Optional per-tag accounting, with tags arranged in a hierarchy and per-tag limits.
+ * - Block links can be built as 32-bit offsets with -DMY_MALLOC_COMPRESSED_LINKS, shrinking the header to 24 bytes.
+ * - Optional guarded sampling: one allocation in N sits before a PROT_NONE page, overflows and uses after free are reported with stack traces.
+ * - Heap snapshots of every live allocation, and a snapshot-diff command that ranks size classes and callsites by growth.
+ * - glibc's mallinfo2(), malloc_info(), mallopt() and malloc_trim(), also under their glibc names with -DMY_MALLOC_GLIBC_NAMES.
  * 
- * Compile: gcc -o my_malloc Main.c
+ * Compile: gcc -pthread -o my_malloc Main.c   (add -mavx2 to use the AVX2 free-slot search)
  * Run: ./my_malloc
  * 
  */
 
+#define _GNU_SOURCE//dladdr() and Dl_info
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <linux/futex.h>
+#include <linux/perf_event.h>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+//USDT probes for perf and bpftrace, each one is a single nop until a tracer attaches to it
+#if defined(__has_include) && !defined(MY_MALLOC_NO_PROBES)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#endif
+#endif
+
+#ifdef DTRACE_PROBE1
+#define MALLOC_PROBE1(name, a) DTRACE_PROBE1(my_malloc, name, a)
+#define MALLOC_PROBE2(name, a, b) DTRACE_PROBE2(my_malloc, name, a, b)
+#define MALLOC_PROBE3(name, a, b, c) DTRACE_PROBE3(my_malloc, name, a, b, c)
+#else
+#define MALLOC_PROBE1(name, a) ((void)0)
+#define MALLOC_PROBE2(name, a, b) ((void)0)
+#define MALLOC_PROBE3(name, a, b, c) ((void)0)
+#endif
 
 #define ALIGNMENT 8//A constant used to ensure memory alignment of 8-byte
 
 #define ALIGN(size) (((size) + (ALIGNMENT - 1)) & ~(ALIGNMENT -1))//round a size to the nearest multiple of 8 byte
 
+//with -DMY_MALLOC_COMPRESSED_LINKS the list links are 32-bit offsets from the block instead of pointers
+#ifdef MY_MALLOC_COMPRESSED_LINKS
+typedef int32_t BlockLink;//distance from the block to the linked block in ALIGNMENT units, 0 for none
+#else
+typedef struct block_type *BlockLink;//the linked block, NULL for none
+#endif
+
 typedef struct block_type{
     size_t size;//size of the block
 
-    unsigned int free;//if the block is free or not
+    unsigned short free;//if the block is free or not
 
-    struct block_type *next;//The next block when connecting in the linked list
+    unsigned short tag;//tag the block is charged to, only kept with MY_MALLOC_TAGS set
 
-    struct block_type *prev;//The previous block when connecting in the linked list so it can be a doubly linked list
+    unsigned short arena;//index of the arena whose linked list holds the block
+
+    unsigned short site;//callsite the block was allocated from, only kept with MY_MALLOC_CALLSITES set
+
+    BlockLink next;//The next block when connecting in the linked list, read and written with block_next() and block_set_next()
+
+    BlockLink prev;//The previous block when connecting in the linked list so it can be a doubly linked list, see block_prev()
 
 }Block;
 
-Block *head = NULL;//Setting the head of the doubly linked list to NULL
+/*
+ * ---------------------------------------------------------------------------------------------
+ * Locks
+ * ---------------------------------------------------------------------------------------------
+ * Every lock of the allocator is an AllocLock. Most critical sections are a short list walk or a bitmap update, so a
+ * thread that finds the lock taken first spins with a pause instruction, on the chance that the owner is about to
+ * release it, and only sleeps in futex() when spinning does not pay off. How long to spin adapts per lock to how many
+ * spins recent contended acquisitions needed. The state word follows the three state futex mutex: 0 unlocked, 1 locked,
+ * 2 locked with sleepers, so an unlock only makes a system call when somebody is actually asleep.
+ */
+
+#define LOCK_SPIN_MIN 16//spins always allowed before sleeping
+
+#define LOCK_SPIN_MAX 1024//spins never exceeded before sleeping
+
+typedef struct alloc_lock_type{
+    int state;//0 unlocked, 1 locked, 2 locked with threads sleeping in futex()
+
+    int spin_limit;//running average of the spins contended acquisitions needed
+
+    size_t acquisitions;//times the lock was taken
+
+    size_t contended;//times the lock was already held when asked for
+
+    size_t spins;//pause loops spent waiting for the lock
 
-Block *last = NULL;//Setting the end of the doubly linked list to NULL
+    size_t sleeps;//times a waiter went to sleep in futex()
+
+}AllocLock;
+
+#define ALLOC_LOCK_INITIALIZER {0, LOCK_SPIN_MIN, 0, 0, 0, 0}
 
 
 
 /**
- * my_malloc() - allocates and return a pointer to a memory block of requested size
+ * cpu_relax() - tells the CPU the thread is spinning
  * 
- * size_t size: requested size in bytes from user
- * -----------------------------------------------------------------------------------  
+ * ------------------------------------------------------------------------------------  
  * 
- * Description: Custom implementation of malloc that allocates a block that is ensured to
- * have 8-byte alignment after aligning the requested size. It first searches for a suitable free block
- * using first-fit strategy. If none is found, then the function request more space directly from the OS to
- * expand the heap using sbrk(). It also manages metadata for managing a doubly linked list to track
- * all the allocated and free blocks. If any errors occur during this process, NULL is returned to the user.
+ * Description: Issues a pause instruction on x86 so the spinning core slows down and yields pipeline resources to its
+ * hyperthread sibling, elsewhere it only stops the compiler from folding the spin loop.
  * 
  *           
  */
-void *my_malloc(size_t size){
+static inline void cpu_relax(void){
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#else
+    __asm__ __volatile__("" ::: "memory");
+#endif
+}
 
-    size_t aligned_size = ALIGN(size);//align size to ensure it is rounded to nearest 8-byte for correct memory alignment
 
 
-    
-    Block *current = head;//Set current as the head block in the linked list
+/**
+ * lock_acquire() - takes an AllocLock
+ * 
+ * AllocLock *lock: lock to take
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Takes the lock with a single compare and swap when it is free. Otherwise spins for up to twice the
+ * lock's spin limit, retrying whenever the lock looks free, and then marks the lock as having sleepers and waits in
+ * futex() until it is handed over. The spin limit is moved an eighth of the way towards the spins this acquisition used,
+ * so locks whose owners hold them briefly keep spinning and the others go to sleep sooner. The counters are updated
+ * once the lock is held, and contended acquisitions fire the lock_contended probe with the spins and sleeps they took.
+ * 
+ *           
+ */
+static void lock_acquire(AllocLock *lock){
 
+    int expected = 0;
+    if (__atomic_compare_exchange_n(&lock->state, &expected, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)){
+        lock->acquisitions++;
+        return;
+    }
 
-    //Continue looping through the linked list until the end of the list has been reached
-    while (current != NULL){
+    int limit = __atomic_load_n(&lock->spin_limit, __ATOMIC_RELAXED) * 2;
+    if (limit < LOCK_SPIN_MIN){
+        limit = LOCK_SPIN_MIN;
+    }
+    if (limit > LOCK_SPIN_MAX){
+        limit = LOCK_SPIN_MAX;
+    }
 
-        //check if the block is free to use
-        if (current->free == 1 && current->size >= aligned_size){
-            current->free = 0;
+    //spin while the owner may be about to release it
+    int spins = 0, acquired = 0;
+    while (spins < limit && !acquired){
+        spins++;
+        cpu_relax();
+        expected = 0;
+        if (__atomic_load_n(&lock->state, __ATOMIC_RELAXED) == 0){
+            acquired = __atomic_compare_exchange_n(&lock->state, &expected, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+        }
+    }
 
-            //After checking if the block is free, check if the block can split with a new block being made from the extra space with atleast 8 bytes 
-            if (current->size >= aligned_size + sizeof(Block) + ALIGNMENT){
-                Block *new_block = (Block *)((char *)(current + 1) + aligned_size);//ensuring that the new_block takes up space in the heap that does not effect the current block
-                
-                new_block->size = current->size - aligned_size - sizeof(Block);
-                new_block->prev = current;
-                new_block ->next = current ->next;
-                current->next = new_block;
+    //sleep, the lock stays marked as having sleepers until the unlock that wakes us
+    size_t sleeps = 0;
+    if (!acquired){
+        while (__atomic_exchange_n(&lock->state, 2, __ATOMIC_ACQUIRE) != 0){
+            syscall(SYS_futex, &lock->state, FUTEX_WAIT_PRIVATE, 2, NULL, NULL, 0);
+            sleeps++;
+        }
+    }
 
-                if (new_block->next != NULL){
-                    new_block ->next->prev = new_block;
-                }
-                
+    int spin_limit = __atomic_load_n(&lock->spin_limit, __ATOMIC_RELAXED);
+    __atomic_store_n(&lock->spin_limit, spin_limit + (spins - spin_limit) / 8, __ATOMIC_RELAXED);
 
-            }
-            //return the block with the correct size to the user
-            return (void *)(current + 1);
+    MALLOC_PROBE3(lock_contended, lock, spins, sleeps);
+
+    lock->acquisitions++;
+    lock->contended++;
+    lock->spins += (size_t)spins;
+    lock->sleeps += sleeps;
+
+    return;
+
+}
+
+
+
+/**
+ * lock_release() - releases an AllocLock
+ * 
+ * AllocLock *lock: lock held by the calling thread
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Marks the lock as free and wakes one sleeper if the lock said there were any.
+ * 
+ *           
+ */
+static void lock_release(AllocLock *lock){
+
+    if (__atomic_exchange_n(&lock->state, 0, __ATOMIC_RELEASE) == 2){
+        syscall(SYS_futex, &lock->state, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    }
+
+    return;
+
+}
+
+
+
+/**
+ * lock_reset() - puts an AllocLock back in the unlocked state
+ * 
+ * AllocLock *lock: lock to reset
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Used in the child after fork(), where the lock may be marked as held by a thread that no longer exists.
+ * The counters are kept so the child's stats continue from the parent's.
+ * 
+ *           
+ */
+static void lock_reset(AllocLock *lock){
+
+    lock->state = 0;
+
+    return;
+
+}
+
+/*
+ * ---------------------------------------------------------------------------------------------
+ * Memory limit
+ * ---------------------------------------------------------------------------------------------
+ * Every byte the arenas and slab runs take from the OS is charged to limit_footprint before it is taken, and a growth
+ * that would go past limit_bytes is refused. heap_malloc() then hands free memory back to the OS, calls the pressure
+ * callback the program registered, and only returns NULL if the allocation still does not fit. Growing past the soft
+ * limit, 1/8 below the limit, hands memory back early. The limit comes from MY_MALLOC_LIMIT, my_malloc_set_limit(), or
+ * the memory.max of the process's cgroup v2 and its parents. Metadata mapped outside the heap is not counted.
+ */
+
+#define LIMIT_SOFT_SHIFT 3//the soft limit is limit_bytes minus limit_bytes >> LIMIT_SOFT_SHIFT
+
+#define LIMIT_NONE 0//no limit
+
+#define LIMIT_CGROUP 1//memory.max of the process's cgroup
+
+#define LIMIT_ENV 2//MY_MALLOC_LIMIT
+
+#define LIMIT_API 3//my_malloc_set_limit()
+
+static const char *limit_source_names[] = {"none", "cgroup memory.max", "MY_MALLOC_LIMIT", "my_malloc_set_limit"};
+
+static size_t limit_bytes = 0;//largest footprint allowed, 0 for no limit
+
+static int limit_source = LIMIT_NONE;//where limit_bytes came from
+
+static size_t limit_footprint = 0;//bytes the arenas and slab runs currently hold from the OS
+
+static size_t limit_refusals = 0;//growths refused because they would have gone past the limit
+
+static size_t limit_soft_releases = 0;//times memory was handed back after growing past the soft limit
+
+static size_t limit_callbacks = 0;//calls to the pressure callback
+
+static size_t limit_failures = 0;//allocations that returned NULL because of the limit
+
+static __thread int limit_refused = 0;//set when a growth of the calling thread was refused
+
+static __thread int limit_soft_crossed = 0;//set when a growth of the calling thread went past the soft limit
+
+
+
+/**
+ * limit_charge() - charges memory about to be taken from the OS to the footprint
+ * 
+ * size_t bytes: bytes the arena or slab region is about to take
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Returns 0 if the bytes fit under the limit. Otherwise nothing is charged, limit_refused is set for
+ * heap_malloc() and -1 is returned. Marks the thread when this growth takes the footprint past the soft limit.
+ * 
+ *           
+ */
+static int limit_charge(size_t bytes){
+
+    size_t limit = __atomic_load_n(&limit_bytes, __ATOMIC_RELAXED);
+    size_t footprint = __atomic_add_fetch(&limit_footprint, bytes, __ATOMIC_RELAXED);
+
+    if (limit != 0 && footprint > limit){
+        __atomic_sub_fetch(&limit_footprint, bytes, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&limit_refusals, 1, __ATOMIC_RELAXED);
+        limit_refused = 1;
+        return -1;
+    }
+
+    //only the growth that crosses the soft limit hands memory back, not every growth above it
+    size_t soft = limit - (limit >> LIMIT_SOFT_SHIFT);
+    if (limit != 0 && footprint > soft && footprint - bytes <= soft){
+        limit_soft_crossed = 1;
+    }
+
+    return 0;
+
+}
+
+
+
+/**
+ * limit_uncharge() - takes memory given back to the OS off the footprint
+ * 
+ * size_t bytes: bytes handed back, or charged but never taken
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: The other half of limit_charge().
+ * 
+ *           
+ */
+static void limit_uncharge(size_t bytes){
+
+    __atomic_sub_fetch(&limit_footprint, bytes, __ATOMIC_RELAXED);
+
+    return;
+
+}
+
+
+
+/**
+ * limit_parse() - reads a byte count with an optional K, M or G suffix
+ * 
+ * const char *text: text to parse, such as "512M"
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Only white space, such as the newline at the end of a memory.max file, may follow. Returns the byte
+ * count, or 0 after printing why if the text is not such a count or the count does not fit in a size_t.
+ * 
+ *           
+ */
+static size_t limit_parse(const char *text){
+
+    char *end;
+    errno = 0;
+    unsigned long long value = strtoull(text, &end, 10);
+    if (end == text || errno == ERANGE || strchr(text, '-') != NULL || value > SIZE_MAX){
+        fprintf(stderr,"invalid byte count %s\n", text);
+        return 0;
+    }
+
+    unsigned int shift = 0;
+    switch (*end){
+        case 'G': case 'g': shift = 30; end++; break;
+        case 'M': case 'm': shift = 20; end++; break;
+        case 'K': case 'k': shift = 10; end++; break;
+        default: break;
+    }
+    while (isspace((unsigned char)*end)){
+        end++;
+    }
+
+    if (*end != '\0' || value > (SIZE_MAX >> shift)){
+        fprintf(stderr,"invalid byte count %s\n", text);
+        return 0;
+    }
+
+    return (size_t)value << shift;
+
+}
+
+
+
+/**
+ * limit_read_file() - reads a small file without allocating
+ * 
+ * const char *path: file to read
+ * 
+ * char *buffer: receives the contents, NUL terminated
+ * 
+ * size_t size: size of buffer
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Uses open() and read() since it runs from inside the first allocation. Returns the number of bytes read,
+ * or -1 if the file cannot be read.
+ * 
+ *           
+ */
+static ssize_t limit_read_file(const char *path, char *buffer, size_t size){
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0){
+        return -1;
+    }
+
+    ssize_t length = read(fd, buffer, size - 1);
+    close(fd);
+    if (length < 0){
+        return -1;
+    }
+    buffer[length] = '\0';
+
+    return length;
+
+}
+
+
+
+/**
+ * limit_take_smaller() - lowers a limit to the one in a memory.max file
+ * 
+ * const char *path: memory.max file to read
+ * size_t limit: smallest limit found so far, 0 for none
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Returns limit unchanged if the file is missing or says "max".
+ * 
+ *           
+ */
+static size_t limit_take_smaller(const char *path, size_t limit){
+
+    char value[64];
+    if (limit_read_file(path, value, sizeof(value)) > 0 && strncmp(value, "max", 3) != 0){
+        size_t bytes = limit_parse(value);
+        if (bytes != 0 && (limit == 0 || bytes < limit)){
+            limit = bytes;
+        }
+    }
+
+    return limit;
+
+}
+
+
+
+/**
+ * limit_from_cgroup() - finds the memory.max that applies to the process
+ * 
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Takes the process's cgroup v2 path from the "0::" line of /proc/self/cgroup, then reads memory.max in that
+ * cgroup and in every parent below the root, since the limit of a parent applies to its children too. Inside a cgroup
+ * namespace, as in most containers, the path is "/" and the container's own limit is the memory.max at the top of
+ * /sys/fs/cgroup, so that file is read as well. At the real root it does not exist. Returns the smallest limit found, or 0
+ * if there is none, "max" meaning no limit.
+ * 
+ *           
+ */
+static size_t limit_from_cgroup(void){
+
+    char buffer[4096];
+    if (limit_read_file("/proc/self/cgroup", buffer, sizeof(buffer)) < 0){
+        return 0;
+    }
+
+    char *line = strstr(buffer, "0::");
+    if (line == NULL || (line != buffer && line[-1] != '\n')){
+        return 0;
+    }
+
+    char cgroup[1024];
+    snprintf(cgroup, sizeof(cgroup), "%s", line + 3);
+    cgroup[strcspn(cgroup, "\n")] = '\0';
+
+    size_t limit = 0;
+    char *slash;
+    while ((slash = strrchr(cgroup, '/')) != NULL && cgroup[1] != '\0'){
+
+        char path[1200];
+        snprintf(path, sizeof(path), "/sys/fs/cgroup%s/memory.max", cgroup);
+        limit = limit_take_smaller(path, limit);
+
+        *slash = '\0';
+        if (slash == cgroup){
+            break;
+        }
+
+    }
+
+    return limit_take_smaller("/sys/fs/cgroup/memory.max", limit);
+
+}
+
+
+
+/**
+ * limit_setup() - picks the heap limit when the allocator starts
+ * 
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: MY_MALLOC_LIMIT wins when it is set, "0" turning the limit off. Otherwise the cgroup's memory.max is used
+ * if there is one.
+ * 
+ *           
+ */
+static void limit_setup(void){
+
+    const char *env = getenv("MY_MALLOC_LIMIT");
+    if (env != NULL){
+        limit_bytes = limit_parse(env);
+        limit_source = (limit_bytes != 0) ? LIMIT_ENV : LIMIT_NONE;
+        return;
+    }
+
+    limit_bytes = limit_from_cgroup();
+    limit_source = (limit_bytes != 0) ? LIMIT_CGROUP : LIMIT_NONE;
+
+    return;
+
+}
+
+
+
+/*
+ * ---------------------------------------------------------------------------------------------
+ * Arenas
+ * ---------------------------------------------------------------------------------------------
+ * The Block list is split into ARENA_COUNT arenas, each with its own doubly linked list and lock, and every thread is
+ * given one arena to allocate from so threads rarely wait for each other. A freed block goes back to the arena recorded
+ * in its header, whichever thread frees it. Arena 0 grows the heap with sbrk() like a single threaded program would, the
+ * other arenas carve their blocks out of an address range reserved with mmap() so they never race on the program break.
+ * 
+ * Since every block of an arena lies within a few GiB of the others, a build with -DMY_MALLOC_COMPRESSED_LINKS stores the
+ * next and prev links of a Block as signed 32-bit distances from the block itself in ALIGNMENT units. The header shrinks
+ * from 32 to 24 bytes, which packs more headers into each cache line the list walks touch, and following a link costs one
+ * add more than following a pointer. A block never links to itself, so a distance of 0 stands for no block. Arena 0 can
+ * only grow to ARENA_LINK_RANGE bytes past its first block.
+ */
+
+#define ARENA_COUNT 4//number of Block list arenas
+
+#define ARENA_REGION_SIZE ((size_t)1 << 32)//address space reserved by each arena after the first, pages are only backed once touched
+
+#define ARENA_LINK_RANGE ((size_t)INT32_MAX * ALIGNMENT)//farthest apart two blocks of an arena may be with compressed links
+
+#define ARENA_MAPPED 0xFFFF//arena recorded in the header of a sealed stream buffer, which has a mapping of its own
+
+#define ARENA_CHUNK 0xFFFE//arena recorded in the header of an object bump-allocated from a lifetime chunk
+
+#define ARENA_GUARDED 0xFFFD//arena recorded in the header of a sampled allocation placed before a guard page
+
+typedef struct arena_type{
+    AllocLock lock;//held while the arena's linked list is searched or changed
+
+    Block *head;//first block of the arena's doubly linked list, NULL while the arena is empty
+
+    Block *last;//last block of the arena's doubly linked list, NULL while the arena is empty
+
+    size_t os_bytes;//bytes the arena has received from the OS, headers included
+
+    char *region_next;//next unused byte of the arena's reserved region, NULL until the region is reserved
+
+    char *region_end;//end of the arena's reserved region
+
+    unsigned int owners;//live threads that allocate from the arena
+
+    size_t os_peak;//highest os_bytes so far
+
+    char *base;//first byte the arena received from the OS, NULL until it grows
+
+}Arena;
+
+static Arena arenas[ARENA_COUNT] = {[0 ... ARENA_COUNT - 1] = {.lock = ALLOC_LOCK_INITIALIZER}};
+
+
+
+/**
+ * block_next() - returns the block after a block in its arena's list
+ * 
+ * const Block *block: block in the linked list
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Returns NULL at the end of the list. Blocks outside the arenas, such as stream buffers and chunk objects,
+ * have no links and always return NULL.
+ * 
+ *           
+ */
+static inline Block *block_next(const Block *block){
+
+#ifdef MY_MALLOC_COMPRESSED_LINKS
+    return (block->next == 0) ? NULL : (Block *)((char *)block + (ptrdiff_t)block->next * ALIGNMENT);
+#else
+    return block->next;
+#endif
+
+}
+
+
+
+/**
+ * block_prev() - returns the block before a block in its arena's list
+ * 
+ * const Block *block: block in the linked list
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Returns NULL at the start of the list, see block_next().
+ * 
+ *           
+ */
+static inline Block *block_prev(const Block *block){
+
+#ifdef MY_MALLOC_COMPRESSED_LINKS
+    return (block->prev == 0) ? NULL : (Block *)((char *)block + (ptrdiff_t)block->prev * ALIGNMENT);
+#else
+    return block->prev;
+#endif
+
+}
+
+
+
+/**
+ * block_link() - turns a block into a link stored in another block's header
+ * 
+ * const Block *owner: block whose header stores the link
+ * 
+ * Block *target: block linked to, in the same arena, or NULL
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Returns the pointer itself, or with compressed links the distance from the owner.
+ * 
+ *           
+ */
+static inline BlockLink block_link(const Block *owner, Block *target){
+
+#ifdef MY_MALLOC_COMPRESSED_LINKS
+    return (target == NULL) ? 0 : (BlockLink)(((char *)target - (const char *)owner) / ALIGNMENT);
+#else
+    (void)owner;
+    return target;
+#endif
+
+}
+
+
+
+/**
+ * block_set_next() - sets the block after a block
+ * 
+ * Block *block: block whose link changes
+ * 
+ * Block *next: new next block, NULL at the end of the list
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: The counterpart of block_next().
+ * 
+ *           
+ */
+static inline void block_set_next(Block *block, Block *next){
+
+    block->next = block_link(block, next);
+
+}
+
+
+
+/**
+ * block_set_prev() - sets the block before a block
+ * 
+ * Block *block: block whose link changes
+ * 
+ * Block *prev: new previous block, NULL at the start of the list
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: The counterpart of block_prev().
+ * 
+ *           
+ */
+static inline void block_set_prev(Block *block, Block *prev){
+
+    block->prev = block_link(block, prev);
+
+}
+
+static __thread Arena *thread_arena = NULL;//arena the calling thread allocates from, picked on its first allocation
+
+static unsigned int arena_next = 0;//round robin counter used to hand out arenas to new threads
+
+static pthread_key_t thread_exit_key;//its destructor, thread_exit(), runs when a thread that used the allocator exits
+
+static __thread int thread_exit_registered = 0;//1 once the calling thread has set its thread_exit_key value
+
+//settings changed with my_mallopt() or glibc's MALLOC_*_ environment variables
+
+static size_t trim_threshold = SIZE_MAX;//an arena whose free tail reaches this many bytes is trimmed by my_free(), SIZE_MAX for never
+
+static size_t trim_top_pad = 0;//bytes of the free tail left in place by my_free() and my_malloc_trim()
+
+static unsigned int arena_max = ARENA_COUNT;//arenas handed out to new threads, at most ARENA_COUNT
+
+static int perturb_byte = 0;//new memory is filled with perturb_byte ^ 0xFF and freed memory with perturb_byte, 0 for neither
+
+typedef struct mallopt_env_type{
+    const char *name;//environment variable glibc reads the setting from
+
+    int param;//mallopt() parameter it sets
+
+}MalloptEnv;
+
+static const MalloptEnv mallopt_env[] = {
+    {"MALLOC_TRIM_THRESHOLD_", M_TRIM_THRESHOLD}, {"MALLOC_TOP_PAD_", M_TOP_PAD}, {"MALLOC_MMAP_THRESHOLD_", M_MMAP_THRESHOLD},
+    {"MALLOC_MMAP_MAX_", M_MMAP_MAX}, {"MALLOC_ARENA_MAX", M_ARENA_MAX}, {"MALLOC_ARENA_TEST", M_ARENA_TEST},
+    {"MALLOC_PERTURB_", M_PERTURB},
+};
+
+
+
+/**
+ * mallopt_set() - changes one allocator setting
+ * 
+ * int param: glibc mallopt() parameter
+ * 
+ * int value: new value
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: M_TRIM_THRESHOLD, M_TOP_PAD, M_ARENA_MAX and M_PERTURB change how the allocator behaves, a negative trim
+ * threshold turns trimming in my_free() off. M_MXFAST, M_MMAP_THRESHOLD, M_MMAP_MAX, M_CHECK_ACTION and M_ARENA_TEST have
+ * nothing to act on here, since small sizes always come from slab runs and large ones from the arenas, and are accepted so
+ * tuning code written for glibc keeps working. Returns 1 like mallopt() does, or 0 for an unknown parameter or a value
+ * out of range.
+ * 
+ *           
+ */
+static int mallopt_set(int param, int value){
+
+    switch (param){
+
+        case M_TRIM_THRESHOLD:
+            __atomic_store_n(&trim_threshold, (value < 0) ? SIZE_MAX : (size_t)value, __ATOMIC_RELAXED);
+            return 1;
+
+        case M_TOP_PAD:
+            if (value < 0){
+                return 0;
+            }
+            __atomic_store_n(&trim_top_pad, (size_t)value, __ATOMIC_RELAXED);
+            return 1;
+
+        case M_ARENA_MAX:
+            if (value <= 0){
+                return 0;
+            }
+            __atomic_store_n(&arena_max, (value < ARENA_COUNT) ? (unsigned int)value : ARENA_COUNT, __ATOMIC_RELAXED);
+            return 1;
+
+        case M_PERTURB:
+            __atomic_store_n(&perturb_byte, value & 0xFF, __ATOMIC_RELAXED);
+            return 1;
+
+        case M_MXFAST:
+            return (value >= 0 && value <= 80 * (int)sizeof(size_t) / 4);
+
+        case M_MMAP_THRESHOLD:
+        case M_MMAP_MAX:
+        case M_CHECK_ACTION:
+        case M_ARENA_TEST:
+            return 1;
+
+        default:
+            return 0;
+
+    }
+
+}
+
+
+
+/**
+ * mallopt_setup() - applies the glibc MALLOC_*_ environment variables
+ * 
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Part of allocator_setup(), so scripts that tune glibc through the environment tune this allocator the same
+ * way. Values that are not numbers are ignored.
+ * 
+ *           
+ */
+static void mallopt_setup(void){
+
+    for (size_t i = 0; i < sizeof(mallopt_env) / sizeof(mallopt_env[0]); i++){
+
+        const char *env = getenv(mallopt_env[i].name);
+        char *end;
+        if (env == NULL || *env == '\0'){
+            continue;
+        }
+
+        long value = strtol(env, &end, 10);
+        if (*end == '\0'){
+            mallopt_set(mallopt_env[i].param, (int)value);
+        }
+
+    }
+
+    return;
+
+}
+
+
+
+/**
+ * block_touches_next() - checks if a block ends exactly where the next block of the list starts
+ * 
+ * Block *block: block in the linked list
+ * 
+ * Block *next: the block after it in the linked list
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Returns 1 if the two blocks are neighbours in memory and can be merged, 0 if something else was placed
+ * between them by sbrk() and they must stay separate.
+ * 
+ *           
+ */
+static inline int block_touches_next(Block *block, Block *next){
+    return (char *)(block + 1) + block->size == (char *)next;
+}
+
+
+
+/**
+ * thread_exit_register() - makes sure thread_exit() runs when the calling thread exits
+ * 
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Gives the thread a non NULL value for thread_exit_key, which is what makes pthreads call the destructor.
+ * The key is created by allocator_setup() before any thread gets an arena or a cache.
+ * 
+ *           
+ */
+static inline void thread_exit_register(void){
+
+    if (!thread_exit_registered){
+        thread_exit_registered = 1;
+        pthread_setspecific(thread_exit_key, &thread_exit_registered);
+    }
+
+    return;
+
+}
+
+
+
+/**
+ * arena_of_thread() - returns the arena the calling thread allocates from
+ * 
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: The first call from a thread picks an arena that no live thread owns, looking in round robin order so the
+ * main thread of a program gets arena 0, and the arena with the fewest owners when every arena is owned. Arenas left
+ * behind by exited threads are handed out again this way before any arena gets a second owner. Only the first arena_max
+ * arenas are handed out, threads that already have an arena keep it when my_mallopt() lowers it.
+ * 
+ *           
+ */
+static inline Arena *arena_of_thread(void){
+
+    if (thread_arena == NULL){
+
+        unsigned int count = __atomic_load_n(&arena_max, __ATOMIC_RELAXED);
+        unsigned int start = __atomic_fetch_add(&arena_next, 1, __ATOMIC_RELAXED);
+        unsigned int best = start % count;
+        for (unsigned int n = 0; n < count; n++){
+            unsigned int index = (start + n) % count;
+            if (__atomic_load_n(&arenas[index].owners, __ATOMIC_RELAXED) < __atomic_load_n(&arenas[best].owners, __ATOMIC_RELAXED)){
+                best = index;
+            }
+        }
+
+        thread_arena = &arenas[best];
+        __atomic_add_fetch(&thread_arena->owners, 1, __ATOMIC_RELAXED);
+        thread_exit_register();
+
+    }
+
+    return thread_arena;
+
+}
+
+
+
+/**
+ * arena_grow() - gets more memory from the OS for an arena
+ * 
+ * Arena *arena: arena to grow, its lock must be held
+ * 
+ * size_t bytes: number of bytes needed, headers included
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Arena 0 extends the program break with sbrk(). The other arenas reserve ARENA_REGION_SIZE bytes with mmap()
+ * on their first call and hand out the next bytes of that range, so their blocks are always next to each other in memory.
+ * The bytes are charged to the heap limit first, and the first memory an arena receives becomes its base. Fires the
+ * grow_sbrk or grow_mmap probe. Returns the start of the new memory, or NULL if the OS has none left, the limit does not allow it,
+ * or with compressed links arena 0 would outgrow ARENA_LINK_RANGE.
+ * 
+ *           
+ */
+static void *arena_grow(Arena *arena, size_t bytes){
+
+    if (limit_charge(bytes) != 0){
+        return NULL;
+    }
+
+    if (arena == &arenas[0]){
+#ifdef MY_MALLOC_COMPRESSED_LINKS
+        if (arena->base != NULL && (size_t)((char *)sbrk(0) + bytes - arena->base) > ARENA_LINK_RANGE){
+            fprintf(stderr,"arena 0 is out of link range\n");
+            limit_uncharge(bytes);
+            return NULL;
+        }
+#endif
+        void *memory = sbrk(bytes);
+        if (memory == (void *)-1){
+            perror("sbrk error");
+            limit_uncharge(bytes);
+            return NULL;
+        }
+        if (arena->base == NULL){
+            arena->base = memory;
+        }
+        arena->os_bytes += bytes;
+        arena->os_peak = (arena->os_bytes > arena->os_peak) ? arena->os_bytes : arena->os_peak;
+        MALLOC_PROBE2(grow_sbrk, memory, bytes);
+        return memory;
+    }
+
+    if (arena->region_next == NULL){
+        void *region = mmap(NULL, ARENA_REGION_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (region == MAP_FAILED){
+            perror("mmap error");
+            limit_uncharge(bytes);
+            return NULL;
+        }
+        arena->region_next = region;
+        arena->region_end = (char *)region + ARENA_REGION_SIZE;
+        arena->base = region;
+    }
+
+    if (bytes > (size_t)(arena->region_end - arena->region_next)){
+        fprintf(stderr,"arena %ld is out of address space\n", (long)(arena - arenas));
+        limit_uncharge(bytes);
+        return NULL;
+    }
+
+    void *memory = arena->region_next;
+    arena->region_next += bytes;
+    arena->os_bytes += bytes;
+    arena->os_peak = (arena->os_bytes > arena->os_peak) ? arena->os_bytes : arena->os_peak;
+
+    MALLOC_PROBE3(grow_mmap, (int)(arena - arenas), memory, bytes);
+
+    return memory;
+
+}
+
+
+
+/*
+ * ---------------------------------------------------------------------------------------------
+ * Slab runs for small size classes
+ * ---------------------------------------------------------------------------------------------
+ * Requests up to SLAB_MAX_SIZE bytes are rounded up to a size class and served from a run: a RUN_SIZE
+ * aligned group of pages carved out of one reserved slab region. Each run holds slots of a single size and
+ * a bitmap where a set bit marks a free slot, so small objects carry no Block header and finding a free
+ * slot is a bit scan instead of walking the linked list. Because runs are aligned, the run that owns any
+ * slab pointer is found by masking off the low bits of the address.
+ * 
+ * Runs with free slots are kept in fullness buckets per class and new slots come from the fullest run first,
+ * so the emptier runs drain, become empty, and have their pages handed back to the OS with madvise().
+ * 
+ * Every class has its own lock, so threads allocating different sizes never wait for each other. Runs move between
+ * classes through the free run list, which is protected by slab_region_lock, always taken after a class lock.
+ */
+
+#define SLAB_MAX_SIZE 512//largest request served from slab runs, anything bigger uses the Block list
+
+#define SLAB_MAX_CLASSES 32//upper bound on the number of size classes in the class table
+
+#define RUN_SIZE (64 * 1024)//size of one run, 16 pages of 4 KiB, runs are aligned to this size
+
+#define RUN_BITMAP_WORDS (RUN_SIZE / ALIGNMENT / 64)//enough 64-bit bitmap words for the smallest possible slot
+
+#define RUN_SLOT_ALIGN 64//first slot of every run starts on a cache line
+
+#define SLAB_REGION_SIZE ((size_t)1 << 30)//virtual space reserved for runs, pages are only backed once touched
+
+#define SLAB_FULLNESS_BUCKETS 4//partially full runs are grouped by quarters of used slots
+
+#define RUN_NOT_LINKED SLAB_FULLNESS_BUCKETS//bucket value of a run that is full and not on any bucket list
+
+#define SLAB_RETAINED_RUNS 4//empty runs kept backed for reuse before further empty runs are purged
+
+#define SLAB_POLICY_FULLEST 0//allocate from the fullest partially full run, the default
+
+#define SLAB_POLICY_NAIVE 1//allocate from the most recently touched run with room, kept for comparison
+
+typedef struct run_type{
+    unsigned int size_class;//index of the size class this run serves
+
+    unsigned int slot_size;//size in bytes of every slot in the run
+
+    unsigned int total_slots;//number of slots that fit in the run
+
+    unsigned int free_slots;//number of slots that are currently free, kept so runs can be picked without scanning
+
+    unsigned int hint;//first bitmap word that may still contain a free slot
+
+    unsigned int bucket;//fullness bucket the run is linked into, RUN_NOT_LINKED when it is full
+
+    unsigned int purged;//1 if the run's slot pages were handed back to the OS while it sat on the free run list
+
+    char *slots;//address of the first slot
+
+    struct run_type *next;//next run in the same fullness bucket, or in the free run list
+
+    struct run_type *prev;//previous run in the same fullness bucket
+
+    uint64_t bitmap[RUN_BITMAP_WORDS];//one bit per slot, 1 means the slot is free
+
+}Run;
+
+typedef struct slab_class_type{
+    AllocLock lock;//held while the class's runs and counters are read or changed
+
+    Run *buckets[SLAB_FULLNESS_BUCKETS];//runs with free slots, bucket i holds runs that are i quarters used
+
+    size_t runs;//number of runs owned by this class
+
+    size_t used_slots;//slots taken from the runs, handed out to the user or waiting in a thread or transfer cache
+
+    size_t total_slots;//slots across all runs of this class
+
+}SlabClass;
+
+//size classes in bytes, every class is a multiple of ALIGNMENT and the last one is SLAB_MAX_SIZE
+//a table made by "my_malloc tune-classes" can replace it at build time with -DSLAB_CLASS_TABLE="<table>"
+#ifndef SLAB_CLASS_TABLE
+#define SLAB_CLASS_TABLE 8, 16, 24, 32, 48, 64, 80, 96, 128, 160, 192, 256, 320, 384, 512
+#endif
+
+static const size_t slab_builtin_classes[] = {SLAB_CLASS_TABLE};
+
+static size_t slab_class_size[SLAB_MAX_CLASSES] = {SLAB_CLASS_TABLE};
+
+static unsigned int slab_class_count = sizeof(slab_builtin_classes) / sizeof(slab_builtin_classes[0]);//number of entries used in slab_class_size
+
+static unsigned char slab_size_to_class[SLAB_MAX_SIZE / ALIGNMENT + 1];//maps ALIGN(size) / ALIGNMENT to a size class
+
+static SlabClass slab_classes[SLAB_MAX_CLASSES] = {[0 ... SLAB_MAX_CLASSES - 1] = {.lock = ALLOC_LOCK_INITIALIZER}};
+
+static AllocLock slab_region_lock = ALLOC_LOCK_INITIALIZER;//protects the free run list, the next unused run and the purge counters
+
+static char *slab_base = NULL;//start of the reserved slab region
+
+static char *slab_end = NULL;//end of the reserved slab region
+
+static char *slab_next_run = NULL;//next unused run in the slab region
+
+static Run *slab_free_runs = NULL;//runs that became completely empty and can be handed to any class
+
+static size_t slab_free_run_count = 0;//number of runs on the free run list
+
+static size_t slab_purged_bytes = 0;//total bytes handed back to the OS from empty runs
+
+static int slab_policy = SLAB_POLICY_FULLEST;//how slab_alloc_batch() picks a run among the partially full ones
+
+
+
+/**
+ * slab_parse_classes() - reads a size class table from text
+ * 
+ * const char *text: class sizes separated by commas or whitespace
+ * 
+ * size_t *classes: receives the parsed table, room for SLAB_MAX_CLASSES entries
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Parses the sizes and checks that they are strictly increasing multiples of ALIGNMENT and that the last one
+ * is SLAB_MAX_SIZE, so every small request has a class. Returns the number of classes, or 0 if the table is not valid.
+ * 
+ *           
+ */
+static unsigned int slab_parse_classes(const char *text, size_t *classes){
+
+    unsigned int count = 0;
+    const char *cursor = text;
+
+    while (*cursor != '\0'){
+
+        if (*cursor < '0' || *cursor > '9'){
+            cursor++;
+            continue;
+        }
+
+        size_t size = 0;
+        while (*cursor >= '0' && *cursor <= '9'){
+            size = size * 10 + (size_t)(*cursor - '0');
+            cursor++;
+        }
+
+        if (count == SLAB_MAX_CLASSES || size == 0 || size % ALIGNMENT != 0 || size > SLAB_MAX_SIZE
+                || (count > 0 && size <= classes[count - 1])){
+            return 0;
+        }
+        classes[count++] = size;
+
+    }
+
+    if (count == 0 || classes[count - 1] != SLAB_MAX_SIZE){
+        return 0;
+    }
+
+    return count;
+
+}
+
+
+
+/**
+ * slab_load_classes() - replaces the size class table with one read from a file
+ * 
+ * const char *path: file holding a table written by "my_malloc tune-classes"
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Reads the file with plain read() since the allocator may not be usable yet, and installs the table if it is
+ * valid. Only takes effect before the first slab allocation, once runs exist their slot sizes are fixed. Returns 0 if the
+ * table was installed and -1 otherwise.
+ * 
+ *           
+ */
+static int slab_load_classes(const char *path){
+
+    char text[1024];
+    size_t classes[SLAB_MAX_CLASSES];
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0){
+        perror("size class table error");
+        return -1;
+    }
+
+    ssize_t length = read(fd, text, sizeof(text) - 1);
+    close(fd);
+    if (length <= 0){
+        fprintf(stderr,"size class table error: %s is empty\n", path);
+        return -1;
+    }
+    text[length] = '\0';
+
+    unsigned int count = slab_parse_classes(text, classes);
+    if (count == 0){
+        fprintf(stderr,"size class table error: %s is not a valid table\n", path);
+        return -1;
+    }
+
+    memcpy(slab_class_size, classes, count * sizeof(size_t));
+    slab_class_count = count;
+
+    return 0;
+
+}
+
+
+
+/**
+ * slab_init() - reserves the slab region and builds the size to class lookup table
+ * 
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Reserves SLAB_REGION_SIZE bytes of address space with mmap() and aligns the start of it to RUN_SIZE so
+ * every run header can be found by masking a slot address. The pages are reserved with MAP_NORESERVE so memory is only
+ * used once a run is touched. If MY_MALLOC_CLASSES names a size class table file, that table is loaded first. Returns 0 on
+ * success and -1 if the region could not be reserved.
+ * 
+ *           
+ */
+static int slab_init(void){
+
+    //a tuned class table given at start time replaces the built in one
+    const char *class_table = getenv("MY_MALLOC_CLASSES");
+    if (class_table != NULL){
+        slab_load_classes(class_table);
+    }
+
+    void *region = mmap(NULL, SLAB_REGION_SIZE + RUN_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (region == MAP_FAILED){
+        perror("mmap error");
+        return -1;
+    }
+
+    //round the start of the region up to a RUN_SIZE boundary, the extra RUN_SIZE bytes mapped above cover the slack
+    slab_base = (char *)(((uintptr_t)region + RUN_SIZE - 1) & ~(uintptr_t)(RUN_SIZE - 1));
+    slab_end = slab_base + SLAB_REGION_SIZE;
+    slab_next_run = slab_base;
+
+    //every aligned size up to SLAB_MAX_SIZE maps to the smallest class that fits it
+    unsigned int size_class = 0;
+    for (size_t i = 0; i <= SLAB_MAX_SIZE / ALIGNMENT; i++){
+        while (slab_class_size[size_class] < i * ALIGNMENT){
+            size_class++;
+        }
+        slab_size_to_class[i] = (unsigned char)size_class;
+    }
+
+    return 0;
+
+}
+
+
+
+/**
+ * slab_owns() - checks if a pointer was handed out from a slab run
+ * 
+ * void *ptr: pointer received from the user
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Returns 1 if the pointer lies inside the reserved slab region and 0 otherwise.
+ * 
+ *           
+ */
+static inline int slab_owns(void *ptr){
+    return (char *)ptr >= slab_base && (char *)ptr < slab_end;
+}
+
+
+
+/**
+ * slab_run_of() - finds the run that a slab pointer belongs to
+ * 
+ * void *ptr: pointer inside the slab region
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Runs are aligned to RUN_SIZE, so clearing the low bits of the address gives the run header.
+ * 
+ *           
+ */
+static inline Run *slab_run_of(void *ptr){
+    return (Run *)((uintptr_t)ptr & ~(uintptr_t)(RUN_SIZE - 1));
+}
+
+
+
+/**
+ * run_find_free_word() - finds the first bitmap word of a run that has a free slot
+ * 
+ * Run *run: run to search, must have at least one free slot
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Scans the bitmap starting at the run's hint. When compiled with AVX2, four words are tested at once
+ * with a single vptest so long stretches of full words are skipped quickly, otherwise the words are checked one at a time.
+ * 
+ *           
+ */
+static inline unsigned int run_find_free_word(Run *run){
+
+    unsigned int w = run->hint;
+
+#ifdef __AVX2__
+    unsigned int words = (run->total_slots + 63) / 64;
+
+    //test four words at a time until a group with any free bit is found
+    while (w + 4 <= words){
+        __m256i group = _mm256_loadu_si256((const __m256i *)&run->bitmap[w]);
+        if (!_mm256_testz_si256(group, group)){
+            break;
+        }
+        w += 4;
+    }
+#endif
+
+    while (run->bitmap[w] == 0){
+        w++;
+    }
+
+    return w;
+
+}
+
+
+
+/**
+ * run_create() - creates a new run for a size class
+ * 
+ * unsigned int size_class: size class the run will serve
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Takes an empty run from the free run list or carves the next run out of the slab region, then
+ * fills in the header and marks every slot free in the bitmap. The caller holds the class lock. Returns NULL if the
+ * slab region is exhausted or the heap limit does not allow another run.
+ * 
+ *           
+ */
+static Run *run_create(unsigned int size_class){
+
+    Run *run = NULL;
+
+    lock_acquire(&slab_region_lock);
+
+    //a purged run gets its pages backed again as soon as it is used, so it is charged to the limit like a new one
+    if (slab_free_runs != NULL){
+        if (!slab_free_runs->purged || limit_charge(RUN_SIZE - (size_t)sysconf(_SC_PAGESIZE)) == 0){
+            run = slab_free_runs;
+            slab_free_runs = run->next;
+            slab_free_run_count--;
+        }
+    }
+
+    else if (slab_next_run + RUN_SIZE <= slab_end && limit_charge(RUN_SIZE) == 0){
+        run = (Run *)slab_next_run;
+        slab_next_run += RUN_SIZE;
+        MALLOC_PROBE2(grow_slab, run, size_class);
+    }
+
+    lock_release(&slab_region_lock);
+
+    if (run == NULL){
+        return NULL;
+    }
+
+    size_t header = (sizeof(Run) + RUN_SLOT_ALIGN - 1) & ~(size_t)(RUN_SLOT_ALIGN - 1);
+
+    run->size_class = size_class;
+    run->slot_size = (unsigned int)slab_class_size[size_class];
+    run->total_slots = (unsigned int)((RUN_SIZE - header) / run->slot_size);
+    run->free_slots = run->total_slots;
+    run->hint = 0;
+    run->bucket = RUN_NOT_LINKED;
+    run->purged = 0;
+    run->slots = (char *)run + header;
+    run->next = NULL;
+    run->prev = NULL;
+
+    //set one bit per slot, the unused tail of the last word stays 0 so it is never handed out
+    memset(run->bitmap, 0, sizeof(run->bitmap));
+    unsigned int full_words = run->total_slots / 64;
+    for (unsigned int i = 0; i < full_words; i++){
+        run->bitmap[i] = ~(uint64_t)0;
+    }
+    if (run->total_slots % 64 != 0){
+        run->bitmap[full_words] = ((uint64_t)1 << (run->total_slots % 64)) - 1;
+    }
+
+    slab_classes[size_class].runs++;
+    slab_classes[size_class].total_slots += run->total_slots;
+
+    return run;
+
+}
+
+
+
+/**
+ * run_bucket() - picks the fullness bucket a run with free slots belongs in
+ * 
+ * Run *run: run with at least one free slot
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Returns how many quarters of the run's slots are in use. Under the naive policy every run goes in
+ * bucket 0, which makes the bucket a plain most recently touched first list.
+ * 
+ * 
+ */
+static inline unsigned int run_bucket(Run *run){
+
+    if (slab_policy == SLAB_POLICY_NAIVE){
+        return 0;
+    }
+
+    unsigned int used = run->total_slots - run->free_slots;
+    return (unsigned int)((size_t)used * SLAB_FULLNESS_BUCKETS / run->total_slots);
+
+}
+
+
+
+/**
+ * run_unlink() - removes a run from its fullness bucket
+ * 
+ * SlabClass *cls: size class that owns the run
+ * 
+ * Run *run: run that is linked into one of the class's buckets
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Unlinks the run from the doubly linked bucket list and marks it as not linked.
+ * 
+ * 
+ */
+static void run_unlink(SlabClass *cls, Run *run){
+
+    if (run->prev != NULL){
+        run->prev->next = run->next;
+    }
+    else{
+        cls->buckets[run->bucket] = run->next;
+    }
+
+    if (run->next != NULL){
+        run->next->prev = run->prev;
+    }
+
+    run->next = NULL;
+    run->prev = NULL;
+    run->bucket = RUN_NOT_LINKED;
+
+    return;
+
+}
+
+
+
+/**
+ * run_update_bucket() - moves a run to the bucket that matches its current fullness
+ * 
+ * SlabClass *cls: size class that owns the run
+ * 
+ * Run *run: run whose free slot count just changed
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Full runs are taken off every bucket so they are never looked at by slab_alloc_batch(). Runs with free slots
+ * are pushed onto the front of their bucket whenever they cross into a different quarter, otherwise nothing changes.
+ * 
+ * 
+ */
+static void run_update_bucket(SlabClass *cls, Run *run){
+
+    unsigned int target = (run->free_slots == 0) ? RUN_NOT_LINKED : run_bucket(run);
+    if (target == run->bucket){
+        return;
+    }
+
+    if (run->bucket != RUN_NOT_LINKED){
+        run_unlink(cls, run);
+    }
+
+    if (target != RUN_NOT_LINKED){
+        run->prev = NULL;
+        run->next = cls->buckets[target];
+        if (run->next != NULL){
+            run->next->prev = run;
+        }
+        cls->buckets[target] = run;
+        run->bucket = target;
+    }
+
+    return;
+
+}
+
+
+
+/**
+ * run_purge() - hands the slot pages of an empty run back to the OS
+ * 
+ * Run *run: run on the free run list
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Calls madvise(MADV_DONTNEED) on every page of the run after the first one, the first page holds the
+ * header and free run list link so it stays backed. The pages read back as zero and are backed again on first touch.
+ * The purged bytes come off the heap limit's footprint. Fires the purge probe. The caller holds slab_region_lock.
+ * 
+ * 
+ */
+static void run_purge(Run *run){
+
+    if (run->purged){
+        return;
+    }
+
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    if (page < RUN_SIZE && madvise((char *)run + page, RUN_SIZE - page, MADV_DONTNEED) == 0){
+        slab_purged_bytes += RUN_SIZE - page;
+        limit_uncharge(RUN_SIZE - page);
+        run->purged = 1;
+        MALLOC_PROBE2(purge, run, RUN_SIZE - page);
+    }
+
+    return;
+
+}
+
+
+
+/**
+ * slab_alloc_batch() - takes several slots of one size class from its runs
+ * 
+ * unsigned int size_class: index of the size class
+ * 
+ * unsigned int count: number of slots wanted
+ * 
+ * void **list: receives the slots, linked through their first word
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Takes the class lock once for the whole batch. Runs are taken from the fullest non-empty bucket of the
+ * class, and a new run is created only when every run of the class is full. The first set bit of the bitmap is found
+ * with a trailing zero count, cleared, and turned into a slot address, and each run is moved to the bucket that matches
+ * its new fullness once the batch has taken what it needs from it. Returns the number of slots taken, fewer than count
+ * only if no run could be created.
+ * 
+ * 
+ */
+static unsigned int slab_alloc_batch(unsigned int size_class, unsigned int count, void **list){
+
+    //the region is reserved by allocator_init(), it is only missing if mmap() failed
+    if (slab_base == NULL){
+        return 0;
+    }
+
+    SlabClass *cls = &slab_classes[size_class];
+    unsigned int taken = 0;
+
+    lock_acquire(&cls->lock);
+
+    while (taken < count){
+
+        //search from the fullest bucket down so emptier runs are left to drain
+        Run *run = NULL;
+        for (int b = SLAB_FULLNESS_BUCKETS - 1; b >= 0 && run == NULL; b--){
+            run = cls->buckets[b];
+        }
+
+        if (run == NULL){
+            run = run_create(size_class);
+            if (run == NULL){
+                break;
+            }
+        }
+
+        //find the free slots, tzcnt on the first non-zero word gives the index of each
+        while (taken < count && run->free_slots > 0){
+            unsigned int w = run_find_free_word(run);
+            unsigned int bit = (unsigned int)__builtin_ctzll(run->bitmap[w]);
+            run->bitmap[w] &= run->bitmap[w] - 1;
+            run->hint = w;
+            run->free_slots--;
+            cls->used_slots++;
+
+            void *slot = run->slots + ((size_t)w * 64 + bit) * run->slot_size;
+            *(void **)slot = *list;
+            *list = slot;
+            taken++;
+        }
+
+        run_update_bucket(cls, run);
+
+    }
+
+    lock_release(&cls->lock);
+
+    return taken;
+
+}
+
+
+
+/**
+ * slab_free_batch() - returns a list of slots of one size class to their runs
+ * 
+ * void *list: slots linked through their first word, all of the same size class
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Takes the class lock once for the whole list. For every slot it finds the run and slot index and sets its
+ * bit in the bitmap again, rejecting slots that are already free. The run is moved to the bucket matching its new fullness,
+ * and a run that becomes completely empty goes on the free run list so any class can reuse it. Once more than
+ * SLAB_RETAINED_RUNS empty runs are waiting there, the newly emptied run's pages are handed back to the OS.
+ * 
+ * 
+ */
+static void slab_free_batch(void *list){
+
+    if (list == NULL){
+        return;
+    }
+
+    //a run in use never changes class, so its class can be read before taking the class lock
+    SlabClass *cls = &slab_classes[slab_run_of(list)->size_class];
+
+    lock_acquire(&cls->lock);
+
+    while (list != NULL){
+
+        void *ptr = list;
+        list = *(void **)ptr;
+
+        Run *run = slab_run_of(ptr);
+        size_t slot = (size_t)((char *)ptr - run->slots) / run->slot_size;
+
+        //the slot was checked when it was freed, only a second free of it can be caught here
+        if ((run->bitmap[slot / 64] >> (slot % 64)) & 1){
+            fprintf(stderr,"invalid memory block\n");
+            continue;
+        }
+
+        run->bitmap[slot / 64] |= (uint64_t)1 << (slot % 64);
+        if (slot / 64 < run->hint){
+            run->hint = (unsigned int)(slot / 64);
+        }
+        run->free_slots++;
+        cls->used_slots--;
+
+        //an empty run leaves its class and is kept for whichever class needs a run next
+        if (run->free_slots == run->total_slots){
+            if (run->bucket != RUN_NOT_LINKED){
+                run_unlink(cls, run);
+            }
+
+            cls->runs--;
+            cls->total_slots -= run->total_slots;
+
+            lock_acquire(&slab_region_lock);
+            run->next = slab_free_runs;
+            slab_free_runs = run;
+            slab_free_run_count++;
+
+            if (slab_free_run_count > SLAB_RETAINED_RUNS){
+                run_purge(run);
+            }
+            lock_release(&slab_region_lock);
+
+            continue;
+        }
+
+        run_update_bucket(cls, run);
+
+    }
+
+    lock_release(&cls->lock);
+
+    return;
+
+}
+
+
+
+/*
+ * ---------------------------------------------------------------------------------------------
+ * Thread caches and transfer caches
+ * ---------------------------------------------------------------------------------------------
+ * Every thread keeps a small list of free slots per size class, so most small allocations and frees take no lock at
+ * all. Slots only move between a thread cache and the runs in batches: when a thread cache runs dry it takes a whole
+ * batch, and when it holds too many it gives a whole batch back. Batches first go through the class's transfer cache,
+ * a short stack of ready made batches that another thread can pick up with one lock acquisition, and only reach the
+ * runs, under the class lock, when the transfer cache is empty or full. How many slots make up a batch adapts per class
+ * to how often the transfer cache can serve the moves by itself.
+ */
+
+#define TRANSFER_SLOTS 16//batches a transfer cache can hold
+
+#define TRANSFER_BATCH_MIN 8//smallest batch a class can move
+
+#define TRANSFER_BATCH_START 32//batch size every class starts with
+
+#define TRANSFER_BATCH_MAX 64//largest batch a class can move
+
+#define TRANSFER_ADAPT_MOVES 64//batch moves between two batch size adjustments
+
+typedef struct transfer_cache_type{
+    AllocLock lock;//held while batches are pushed or popped
+
+    void *batches[TRANSFER_SLOTS];//each batch is a list of slots linked through their first word
+
+    unsigned int counts[TRANSFER_SLOTS];//number of slots in each batch
+
+    unsigned int used;//batches currently held
+
+    unsigned int batch_size;//slots moved per batch between a thread cache and the class
+
+    unsigned int moves;//batch moves since batch_size was last adjusted
+
+    unsigned int misses;//of those, moves the transfer cache could not serve and that went to the runs
+
+}TransferCache;
+
+typedef struct thread_cache_bin_type{
+    void *head;//free slots of one class linked through their first word
+
+    unsigned int count;//slots in the list
+
+    unsigned int limit;//slots the list may hold before a batch is flushed, grows on misses and shrinks when unused
+
+    unsigned int low_water;//fewest slots the list held since the last idle scan
+
+    unsigned int misses;//refills since the last idle scan
+
+    unsigned int overflows;//flushes since the limit last changed
+
+}ThreadCacheBin;
+
+typedef struct thread_cache_type{
+    ThreadCacheBin bins[SLAB_MAX_CLASSES];//free slots per size class
+
+    size_t bytes;//bytes of all the slots in the bins
+
+    size_t *budget;//bytes the bins may hold, points into thread_budgets[] or at own_budget, NULL until first use
+
+    size_t own_budget;//budget of a thread that found every slot of thread_budgets[] taken
+
+    int slot;//index of the thread's entry in thread_budgets[], -1 when own_budget is used
+
+    unsigned int ops;//allocations and frees since the last idle scan
+
+}ThreadCache;
+
+static TransferCache transfer_caches[SLAB_MAX_CLASSES] = {[0 ... SLAB_MAX_CLASSES - 1] = {.lock = ALLOC_LOCK_INITIALIZER, .batch_size = TRANSFER_BATCH_START}};
+
+static __thread ThreadCache thread_cache = {.slot = -1};//the calling thread's cache
+
+static uintptr_t thread_cache_key = 0;//written to the second word of cached slots to catch double frees, set by allocator_setup()
+
+
+
+/**
+ * transfer_note() - records one batch move and adapts the batch size of the class
+ * 
+ * TransferCache *tc: transfer cache of the class, its lock must be held
+ * 
+ * int missed: 1 if the move had to go to the runs, 0 if the transfer cache served it
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Every TRANSFER_ADAPT_MOVES moves the batch size is doubled when more than half of the moves missed, since
+ * the class then takes its lock often and bigger batches take it less, and halved when fewer than one in eight missed,
+ * since smaller batches then keep fewer slots idle in caches.
+ * 
+ *           
+ */
+static void transfer_note(TransferCache *tc, int missed){
+
+    tc->moves++;
+    tc->misses += (unsigned int)missed;
+
+    if (tc->moves < TRANSFER_ADAPT_MOVES){
+        return;
+    }
+
+    unsigned int batch_size = tc->batch_size;
+    if (tc->misses * 2 > tc->moves && batch_size < TRANSFER_BATCH_MAX){
+        batch_size *= 2;
+    }
+    else if (tc->misses * 8 < tc->moves && batch_size > TRANSFER_BATCH_MIN){
+        batch_size /= 2;
+    }
+    __atomic_store_n(&tc->batch_size, batch_size, __ATOMIC_RELAXED);
+
+    tc->moves = 0;
+    tc->misses = 0;
+
+    return;
+
+}
+
+
+
+/**
+ * transfer_insert() - gives a batch of free slots back to its class
+ * 
+ * unsigned int size_class: index of the size class
+ * 
+ * void *list: slots linked through their first word
+ * 
+ * unsigned int count: number of slots in the list
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Pushes the whole list onto the class's transfer cache in one step, or returns it to the runs with
+ * slab_free_batch() when the transfer cache is full.
+ * 
+ *           
+ */
+static void transfer_insert(unsigned int size_class, void *list, unsigned int count){
+
+    TransferCache *tc = &transfer_caches[size_class];
+
+    lock_acquire(&tc->lock);
+    int missed = (tc->used == TRANSFER_SLOTS);
+    if (!missed){
+        tc->batches[tc->used] = list;
+        tc->counts[tc->used] = count;
+        tc->used++;
+    }
+    transfer_note(tc, missed);
+    lock_release(&tc->lock);
+
+    if (missed){
+        slab_free_batch(list);
+    }
+
+    return;
+
+}
+
+
+
+/**
+ * transfer_remove() - takes a batch of free slots from its class
+ * 
+ * unsigned int size_class: index of the size class
+ * 
+ * void **list: receives the slots, linked through their first word
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Pops a whole batch from the class's transfer cache in one step, or takes a batch of the current batch size
+ * from the runs with slab_alloc_batch() when the transfer cache is empty. Returns the number of slots taken, 0 if the runs
+ * could not grow.
+ * 
+ *           
+ */
+static unsigned int transfer_remove(unsigned int size_class, void **list){
+
+    TransferCache *tc = &transfer_caches[size_class];
+    unsigned int count = 0;
+
+    lock_acquire(&tc->lock);
+    int missed = (tc->used == 0);
+    if (!missed){
+        tc->used--;
+        *list = tc->batches[tc->used];
+        count = tc->counts[tc->used];
+    }
+    transfer_note(tc, missed);
+    unsigned int batch_size = tc->batch_size;
+    lock_release(&tc->lock);
+
+    if (missed){
+        *list = NULL;
+        count = slab_alloc_batch(size_class, batch_size, list);
+
+        //fresh slots get the double free mark too, so every slot in a thread cache carries it
+        if (slab_class_size[size_class] >= 2 * sizeof(void *)){
+            for (void *slot = *list; slot != NULL; slot = *(void **)slot){
+                ((uintptr_t *)slot)[1] = thread_cache_key;
+            }
+        }
+    }
+
+    return count;
+
+}
+
+
+
+/*
+ * ---------------------------------------------------------------------------------------------
+ * Thread cache sizing
+ * ---------------------------------------------------------------------------------------------
+ * Each bin of a thread cache has a limit, in slots, that grows by a batch every time the bin runs dry and shrinks by a
+ * batch when the bin keeps overflowing or goes a whole idle scan without a miss. Every THREAD_CACHE_SCAVENGE_OPS calls
+ * a thread also gives back half of the slots that sat unused in each bin since the previous scan.
+ * 
+ * On top of that the bytes held by all thread caches together are capped at THREAD_CACHE_TOTAL_MAX. The cap is handed
+ * out as per-thread budgets: a thread starts with THREAD_CACHE_MIN_BYTES, and when its cache outgrows its budget it
+ * takes more from the unclaimed part of the cap, or failing that steals it from other threads' budgets round robin,
+ * never taking a thread below THREAD_CACHE_MIN_BYTES. A thread that cannot get more budget shrinks its cache instead,
+ * and a thread whose budget was stolen shrinks its cache on its next call. Threads that use little of their budget give
+ * the surplus back at their idle scan, so the budget ends up with the threads that allocate and free the most.
+ */
+
+#define THREAD_CACHE_TOTAL_MAX ((size_t)32 << 20)//bytes all thread caches together may hold
+
+#define THREAD_CACHE_MIN_BYTES ((size_t)64 << 10)//budget every thread starts with and is never stolen below
+
+#define THREAD_CACHE_STEAL_BYTES ((size_t)64 << 10)//budget a thread takes at a time when its cache outgrows it
+
+#define THREAD_CACHE_SLOTS 256//threads whose budget other threads can steal from
+
+#define THREAD_CACHE_MAX_BATCHES 8//most batches a bin's limit can grow to
+
+#define THREAD_CACHE_SCAVENGE_OPS 8192//allocations and frees between two idle scans of a thread cache
+
+static size_t thread_budgets[THREAD_CACHE_SLOTS];//budget in bytes of the thread owning each slot
+
+static int thread_budget_owned[THREAD_CACHE_SLOTS];//1 while a thread owns the slot
+
+static size_t thread_budget_unclaimed = THREAD_CACHE_TOTAL_MAX;//part of the cap no thread holds
+
+static unsigned int thread_budget_victim = 0;//next slot budget is stolen from
+
+
+
+/**
+ * budget_take() - takes budget from the unclaimed part of the cap
+ * 
+ * size_t wanted: bytes of budget wanted
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Returns how many bytes were taken, less than wanted when the unclaimed budget runs out.
+ * 
+ *           
+ */
+static size_t budget_take(size_t wanted){
+
+    size_t unclaimed = __atomic_load_n(&thread_budget_unclaimed, __ATOMIC_RELAXED);
+    size_t taken;
+
+    do{
+        taken = (unclaimed < wanted) ? unclaimed : wanted;
+    }while (taken > 0 && !__atomic_compare_exchange_n(&thread_budget_unclaimed, &unclaimed, unclaimed - taken, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+    return taken;
+
+}
+
+
+
+/**
+ * budget_steal() - takes budget from other threads
+ * 
+ * size_t wanted: bytes of budget wanted
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Visits the budget slots round robin, starting after the last victim, and takes from every other thread
+ * whatever it holds above THREAD_CACHE_MIN_BYTES until enough was found or every slot was visited once. Returns how many
+ * bytes were taken.
+ * 
+ *           
+ */
+static size_t budget_steal(size_t wanted){
+
+    size_t stolen = 0;
+
+    for (int n = 0; n < THREAD_CACHE_SLOTS && stolen < wanted; n++){
+
+        int victim = (int)(__atomic_fetch_add(&thread_budget_victim, 1, __ATOMIC_RELAXED) % THREAD_CACHE_SLOTS);
+        if (victim == thread_cache.slot || !__atomic_load_n(&thread_budget_owned[victim], __ATOMIC_RELAXED)){
+            continue;
+        }
+
+        size_t budget = __atomic_load_n(&thread_budgets[victim], __ATOMIC_RELAXED);
+        size_t take;
+        do{
+            if (budget <= THREAD_CACHE_MIN_BYTES){
+                take = 0;
+                break;
+            }
+            take = budget - THREAD_CACHE_MIN_BYTES;
+            if (take > wanted - stolen){
+                take = wanted - stolen;
+            }
+        }while (!__atomic_compare_exchange_n(&thread_budgets[victim], &budget, budget - take, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+        stolen += take;
+
+    }
+
+    return stolen;
+
+}
+
+
+
+/**
+ * thread_cache_attach() - gives the calling thread a budget on its first use of the cache
+ * 
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Claims a free entry of thread_budgets[] so other threads can steal from the thread later, falling back on
+ * a budget of its own when every entry is taken, and fills it with THREAD_CACHE_MIN_BYTES of unclaimed or stolen budget.
+ * The thread is registered so thread_exit() hands the cache and the budget back when it exits.
+ * 
+ *           
+ */
+static void thread_cache_attach(void){
+
+    ThreadCache *tc = &thread_cache;
+
+    tc->budget = &tc->own_budget;
+    tc->slot = -1;
+    for (int i = 0; i < THREAD_CACHE_SLOTS; i++){
+        int expected = 0;
+        if (__atomic_compare_exchange_n(&thread_budget_owned[i], &expected, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)){
+            tc->budget = &thread_budgets[i];
+            tc->slot = i;
+            break;
+        }
+    }
+
+    size_t budget = budget_take(THREAD_CACHE_MIN_BYTES);
+    if (budget < THREAD_CACHE_MIN_BYTES){
+        budget += budget_steal(THREAD_CACHE_MIN_BYTES - budget);
+    }
+    __atomic_store_n(tc->budget, budget, __ATOMIC_RELAXED);
+
+    thread_exit_register();
+
+    return;
+
+}
+
+
+
+/**
+ * thread_cache_release() - gives slots of one bin back to the size class
+ * 
+ * unsigned int size_class: index of the size class
+ * 
+ * unsigned int count: number of slots to give back, at most the bin's count
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: The newest slots stay in the thread, so the list is cut count slots from its end and the cut off part is
+ * handed to transfer_insert() in one piece.
+ * 
+ *           
+ */
+static void thread_cache_release(unsigned int size_class, unsigned int count){
+
+    ThreadCacheBin *bin = &thread_cache.bins[size_class];
+    if (count == 0 || count > bin->count){
+        return;
+    }
+
+    void *list;
+    if (count == bin->count){
+        list = bin->head;
+        bin->head = NULL;
+    }
+    else{
+        void *last = bin->head;
+        for (unsigned int i = 1; i < bin->count - count; i++){
+            last = *(void **)last;
+        }
+        list = *(void **)last;
+        *(void **)last = NULL;
+    }
+
+    bin->count -= count;
+    if (bin->low_water > bin->count){
+        bin->low_water = bin->count;
+    }
+    thread_cache.bytes -= (size_t)count * slab_class_size[size_class];
+
+    transfer_insert(size_class, list, count);
+
+    return;
+
+}
+
+
+
+/**
+ * thread_cache_balance() - brings the calling thread's cache back within its budget
+ * 
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Asks for the missing budget, rounded up to THREAD_CACHE_STEAL_BYTES, first from the unclaimed part of the
+ * cap and then from other threads. Whatever is still over budget after that is given back by halving the bins, largest
+ * class first, until the cache fits.
+ * 
+ *           
+ */
+static void thread_cache_balance(void){
+
+    ThreadCache *tc = &thread_cache;
+    size_t budget = __atomic_load_n(tc->budget, __ATOMIC_RELAXED);
+
+    if (tc->bytes <= budget){
+        return;
+    }
+
+    size_t wanted = (tc->bytes - budget + THREAD_CACHE_STEAL_BYTES - 1) / THREAD_CACHE_STEAL_BYTES * THREAD_CACHE_STEAL_BYTES;
+    size_t got = budget_take(wanted);
+    if (got < wanted){
+        got += budget_steal(wanted - got);
+    }
+    budget = __atomic_add_fetch(tc->budget, got, __ATOMIC_RELAXED);
+
+    while (tc->bytes > budget){
+        for (int i = (int)slab_class_count - 1; i >= 0 && tc->bytes > budget; i--){
+            ThreadCacheBin *bin = &tc->bins[i];
+            thread_cache_release((unsigned int)i, (bin->count + 1) / 2);
+        }
+    }
+
+    return;
+
+}
+
+
+
+/**
+ * thread_cache_scan() - the idle scan of the calling thread's cache
+ * 
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Gives back half of the slots each bin held on to for the whole period since the last scan, lowers the
+ * limit of every bin that had no miss in that period by one batch, and returns the budget the thread is not using to the
+ * unclaimed part of the cap, keeping twice what the cache now holds and at least THREAD_CACHE_MIN_BYTES.
+ * 
+ *           
+ */
+static void thread_cache_scan(void){
+
+    ThreadCache *tc = &thread_cache;
+    tc->ops = 0;
+
+    for (unsigned int i = 0; i < slab_class_count; i++){
+
+        ThreadCacheBin *bin = &tc->bins[i];
+        unsigned int batch_size = __atomic_load_n(&transfer_caches[i].batch_size, __ATOMIC_RELAXED);
+
+        thread_cache_release(i, bin->low_water / 2);
+
+        if (bin->misses == 0 && bin->limit > batch_size){
+            bin->limit -= batch_size;
+        }
+
+        bin->low_water = bin->count;
+        bin->misses = 0;
+
+    }
+
+    size_t keep = 2 * tc->bytes;
+    if (keep < THREAD_CACHE_MIN_BYTES){
+        keep = THREAD_CACHE_MIN_BYTES;
+    }
+
+    size_t budget = __atomic_load_n(tc->budget, __ATOMIC_RELAXED);
+    while (budget > keep){
+        if (__atomic_compare_exchange_n(tc->budget, &budget, keep, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)){
+            __atomic_add_fetch(&thread_budget_unclaimed, budget - keep, __ATOMIC_RELAXED);
+            break;
+        }
+    }
+
+    return;
+
+}
+
+
+
+/**
+ * thread_cache_alloc() - allocates a slot from the calling thread's cache
+ * 
+ * size_t aligned_size: request already rounded with ALIGN(), at most SLAB_MAX_SIZE
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Pops the first slot of the thread's list for the size class. An empty list is refilled with one batch from
+ * transfer_remove() and the bin's limit grows by a batch, since the thread would have missed less with more slots kept.
+ * The double free mark is cleared before the slot is handed out, and the cache is brought back within its budget and
+ * scanned for idle slots when it is due. Returns NULL if no slot could be found.
+ * 
+ *           
+ */
+static void *thread_cache_alloc(size_t aligned_size){
+
+    ThreadCache *tc = &thread_cache;
+    if (tc->budget == NULL){
+        thread_cache_attach();
+    }
+
+    unsigned int size_class = slab_size_to_class[aligned_size / ALIGNMENT];
+    ThreadCacheBin *bin = &tc->bins[size_class];
+    size_t slot_size = slab_class_size[size_class];
+
+    if (bin->head == NULL){
+        bin->count = transfer_remove(size_class, &bin->head);
+        if (bin->count == 0){
+            return NULL;
+        }
+        tc->bytes += (size_t)bin->count * slot_size;
+
+        unsigned int batch_size = __atomic_load_n(&transfer_caches[size_class].batch_size, __ATOMIC_RELAXED);
+        if (bin->limit < THREAD_CACHE_MAX_BATCHES * batch_size){
+            bin->limit += batch_size;
+        }
+        bin->misses++;
+    }
+
+    void *slot = bin->head;
+    bin->head = *(void **)slot;
+    bin->count--;
+    tc->bytes -= slot_size;
+    if (bin->low_water > bin->count){
+        bin->low_water = bin->count;
+    }
+
+    if (slot_size >= 2 * sizeof(void *)){
+        ((uintptr_t *)slot)[1] = 0;
+    }
+
+    if (tc->bytes > __atomic_load_n(tc->budget, __ATOMIC_RELAXED)){
+        thread_cache_balance();
+    }
+    if (++tc->ops >= THREAD_CACHE_SCAVENGE_OPS){
+        thread_cache_scan();
+    }
+
+    return slot;
+
+}
+
+
+
+/**
+ * thread_cache_free() - puts a slot in the calling thread's cache
+ * 
+ * void *ptr: pointer inside the slab region
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Rejects pointers that are not the start of a slot, and slots that carry the double free mark and are
+ * found in the thread's own list. The slot is then pushed onto the list of its class. Once the list holds more than its
+ * limit a batch is handed to transfer_insert(), and a bin that overflows again and again has its limit lowered by a
+ * batch. The cache is then brought back within its budget and scanned for idle slots when it is due.
+ * 
+ *           
+ */
+static void thread_cache_free(void *ptr){
+
+    //a run in use never changes class, so its header can be read without a lock
+    Run *run = slab_run_of(ptr);
+    size_t offset = (size_t)((char *)ptr - run->slots);
+    if ((char *)ptr < run->slots || offset % run->slot_size != 0 || offset / run->slot_size >= run->total_slots){
+        fprintf(stderr,"invalid memory block\n");
+        return;
+    }
+
+    ThreadCache *tc = &thread_cache;
+    if (tc->budget == NULL){
+        thread_cache_attach();
+    }
+
+    unsigned int size_class = run->size_class;
+    ThreadCacheBin *bin = &tc->bins[size_class];
+
+    //the mark only says the slot may be cached, the list says whether it is
+    int marked = run->slot_size >= 2 * sizeof(void *);
+    if (marked && ((uintptr_t *)ptr)[1] == thread_cache_key){
+        for (void *cached = bin->head; cached != NULL; cached = *(void **)cached){
+            if (cached == ptr){
+                fprintf(stderr,"invalid memory block\n");
+                return;
+            }
+        }
+    }
+
+    if (perturb_byte != 0){
+        memset(ptr, perturb_byte, run->slot_size);
+    }
+
+    *(void **)ptr = bin->head;
+    if (marked){
+        ((uintptr_t *)ptr)[1] = thread_cache_key;
+    }
+    bin->head = ptr;
+    bin->count++;
+    tc->bytes += run->slot_size;
+
+    unsigned int batch_size = __atomic_load_n(&transfer_caches[size_class].batch_size, __ATOMIC_RELAXED);
+    unsigned int limit = (bin->limit > batch_size) ? bin->limit : batch_size;
+    if (bin->count > limit){
+        thread_cache_release(size_class, batch_size);
+        if (++bin->overflows > 3){
+            if (bin->limit > batch_size){
+                bin->limit -= batch_size;
+            }
+            bin->overflows = 0;
+        }
+    }
+
+    if (tc->bytes > __atomic_load_n(tc->budget, __ATOMIC_RELAXED)){
+        thread_cache_balance();
+    }
+    if (++tc->ops >= THREAD_CACHE_SCAVENGE_OPS){
+        thread_cache_scan();
+    }
+
+    return;
+
+}
+
+
+
+/*
+ * ---------------------------------------------------------------------------------------------
+ * Per-callsite accounting
+ * ---------------------------------------------------------------------------------------------
+ * When the MY_MALLOC_CALLSITES environment variable is set, my_malloc(), my_calloc() and my_realloc() record their
+ * return address as the callsite of every allocation. A small hashed table gives every callsite an index, which is kept
+ * with the allocation itself, in the Block header or in a shadow array beside the slab region, so my_free() can take the
+ * bytes off the right callsite again without looking anything up. Each thread counts into its own array of counters,
+ * so the common path takes no lock, and my_malloc_dump_callsites() adds the arrays of every thread together. Callsites
+ * are named with dladdr(), which is enough to tell which function owns the growth of the heap without unwinding any
+ * stack. Link with -rdynamic so functions of the program itself can be named.
+ */
+
+#define CALLSITE_SITES 1024//entries of the callsite table, a power of two
+
+#define CALLSITE_UNTRACKED 0//site of an allocation that is not counted against any callsite
+
+#define CALLSITE_OTHER 1//entry for the callsites that found the table full
+
+#define CALLSITE_FIRST 2//first entry handed to a callsite
+
+#define CALLSITE_NAME_BYTES 256//longest callsite name printed, the terminating zero included
+
+typedef struct callsite_counts_type{
+    size_t live_bytes;//usable bytes of the callsite's allocations that are not freed yet
+
+    size_t live_count;//callsite's allocations that are not freed yet
+
+    size_t total_bytes;//usable bytes of every allocation made by the callsite
+
+    size_t total_count;//every allocation made by the callsite
+
+}CallsiteCounts;
+
+typedef struct callsite_thread_type{
+    struct callsite_thread_type *next;//next thread on callsite_threads or callsite_spare
+
+    CallsiteCounts counts[CALLSITE_SITES];//what the thread allocated and freed, per callsite
+
+}CallsiteThread;
+
+typedef struct callsite_type{
+    void *address;//return address of the allocating call, NULL for CALLSITE_OTHER
+
+    CallsiteCounts counts;//counts of every thread added together
+
+}Callsite;
+
+static int callsite_enabled = 0;//set by allocator_setup() when MY_MALLOC_CALLSITES is in the environment
+
+static AllocLock callsite_lock = ALLOC_LOCK_INITIALIZER;//protects adding callsites and the lists of counter arrays
+
+static void *callsite_addresses[CALLSITE_SITES];//open addressing table of callsites, written once per entry
+
+static unsigned short *callsite_shadow = NULL;//site of the slab slot starting at each ALIGNMENT bytes of the slab region
+
+static __thread CallsiteThread *callsite_thread = NULL;//counters of the calling thread
+
+static CallsiteThread *callsite_threads = NULL;//counters of every thread that has recorded an allocation
+
+static CallsiteThread *callsite_spare = NULL;//counters left by exited threads, already added to callsite_exited
+
+static CallsiteCounts callsite_exited[CALLSITE_SITES];//counts of the threads that have exited
+
+
+
+/**
+ * callsite_hash() - spreads a return address over the callsite table
+ * 
+ * const void *address: return address to hash
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Fibonacci hashing, the top bits of the product are the best mixed ones.
+ * 
+ *           
+ */
+static inline unsigned int callsite_hash(const void *address){
+    return (unsigned int)(((uint64_t)(uintptr_t)address * 0x9E3779B97F4A7C15ULL) >> 54) & (CALLSITE_SITES - 1);
+}
+
+
+
+/**
+ * callsite_add() - gives a new callsite an entry of the table
+ * 
+ * void *address: return address that was not found in the table
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Probes again under callsite_lock, since another thread may have added the callsite in the meantime, and
+ * claims the first unused entry. Returns CALLSITE_OTHER when the table is full.
+ * 
+ *           
+ */
+static unsigned int callsite_add(void *address){
+
+    unsigned int site = CALLSITE_OTHER;
+    unsigned int i = callsite_hash(address);
+
+    lock_acquire(&callsite_lock);
+    for (unsigned int n = 0; n < CALLSITE_SITES; n++, i = (i + 1) & (CALLSITE_SITES - 1)){
+        if (i < CALLSITE_FIRST){
+            continue;
+        }
+        if (callsite_addresses[i] == address){
+            site = i;
+            break;
+        }
+        if (callsite_addresses[i] == NULL){
+            __atomic_store_n(&callsite_addresses[i], address, __ATOMIC_RELEASE);
+            site = i;
+            break;
+        }
+    }
+    lock_release(&callsite_lock);
+
+    return site;
+
+}
+
+
+
+/**
+ * callsite_index() - finds the entry of a callsite
+ * 
+ * void *address: return address of the allocating call
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Probes linearly from the hashed entry without a lock, entries are only ever written once from NULL to their
+ * address. A callsite seen for the first time is added by callsite_add().
+ * 
+ *           
+ */
+static inline unsigned int callsite_index(void *address){
+
+    unsigned int i = callsite_hash(address);
+
+    for (unsigned int n = 0; n < CALLSITE_SITES; n++, i = (i + 1) & (CALLSITE_SITES - 1)){
+        void *seen = __atomic_load_n(&callsite_addresses[i], __ATOMIC_ACQUIRE);
+        if (seen == address && i >= CALLSITE_FIRST){
+            return i;
+        }
+        if (seen == NULL && i >= CALLSITE_FIRST){
+            return callsite_add(address);
+        }
+    }
+
+    return CALLSITE_OTHER;
+
+}
+
+
+
+/**
+ * callsite_attach() - gives the calling thread its array of counters
+ * 
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Reuses an array left by an exited thread or maps a new one with mmap(), so the accounting never allocates
+ * from the heap it accounts for, and puts it on callsite_threads. Returns NULL if no array could be mapped.
+ * 
+ *           
+ */
+static CallsiteThread *callsite_attach(void){
+
+    lock_acquire(&callsite_lock);
+    CallsiteThread *counters = callsite_spare;
+    if (counters != NULL){
+        callsite_spare = counters->next;
+    }
+    lock_release(&callsite_lock);
+
+    if (counters == NULL){
+        counters = mmap(NULL, sizeof(CallsiteThread), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (counters == MAP_FAILED){
+            return NULL;
+        }
+    }
+
+    lock_acquire(&callsite_lock);
+    counters->next = callsite_threads;
+    callsite_threads = counters;
+    lock_release(&callsite_lock);
+
+    callsite_thread = counters;
+    thread_exit_register();
+
+    return counters;
+
+}
+
+
+
+/**
+ * callsite_detach() - folds an exiting thread's counters into callsite_exited
+ * 
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Called from thread_exit(). The counters are added to the totals of the exited threads, cleared and kept
+ * on callsite_spare for the next thread.
+ * 
+ *           
+ */
+static void callsite_detach(void){
+
+    CallsiteThread *counters = callsite_thread;
+    if (counters == NULL){
+        return;
+    }
+
+    lock_acquire(&callsite_lock);
+
+    CallsiteThread **link = &callsite_threads;
+    while (*link != counters){
+        link = &(*link)->next;
+    }
+    *link = counters->next;
+
+    for (unsigned int i = 0; i < CALLSITE_SITES; i++){
+        callsite_exited[i].live_bytes += counters->counts[i].live_bytes;
+        callsite_exited[i].live_count += counters->counts[i].live_count;
+        callsite_exited[i].total_bytes += counters->counts[i].total_bytes;
+        callsite_exited[i].total_count += counters->counts[i].total_count;
+    }
+    memset(counters->counts, 0, sizeof(counters->counts));
+
+    counters->next = callsite_spare;
+    callsite_spare = counters;
+
+    lock_release(&callsite_lock);
+
+    callsite_thread = NULL;
+
+    return;
+
+}
+
+
+
+/**
+ * callsite_site_of() - finds where the callsite of an allocation is kept
+ * 
+ * void *ptr: allocation handed out by the allocator
+ * 
+ * size_t *bytes: set to the usable size of the allocation
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Slab slots keep their site in callsite_shadow and are as large as their slot, blocks keep it in their
+ * header next to their size.
+ * 
+ *           
+ */
+static inline unsigned short *callsite_site_of(void *ptr, size_t *bytes){
+
+    if (slab_owns(ptr)){
+        *bytes = slab_run_of(ptr)->slot_size;
+        return &callsite_shadow[((char *)ptr - slab_base) / ALIGNMENT];
+    }
+
+    Block *block = (Block *)ptr - 1;
+    *bytes = block->size;
+
+    return &block->site;
+
+}
+
+
+
+/**
+ * callsite_record() - counts a new allocation against its callsite
+ * 
+ * void *ptr: allocation just handed out
+ * 
+ * void *caller: return address of the allocating call
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Stores the callsite's index with the allocation and adds its usable size to the calling thread's counters
+ * of that callsite. The counters are only written by their thread, the relaxed stores let my_malloc_dump_callsites()
+ * read them at any time.
+ * 
+ *           
+ */
+static void callsite_record(void *ptr, void *caller){
+
+    size_t bytes;
+    unsigned short *stored = callsite_site_of(ptr, &bytes);
+
+    //without counters the allocation stays untracked, so my_free() leaves the counters alone too
+    CallsiteThread *counters = callsite_thread;
+    if (counters == NULL && (counters = callsite_attach()) == NULL){
+        *stored = CALLSITE_UNTRACKED;
+        return;
+    }
+
+    unsigned int site = callsite_index(caller);
+    *stored = (unsigned short)site;
+
+    CallsiteCounts *c = &counters->counts[site];
+    __atomic_store_n(&c->live_bytes, c->live_bytes + bytes, __ATOMIC_RELAXED);
+    __atomic_store_n(&c->live_count, c->live_count + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&c->total_bytes, c->total_bytes + bytes, __ATOMIC_RELAXED);
+    __atomic_store_n(&c->total_count, c->total_count + 1, __ATOMIC_RELAXED);
+
+    return;
+
+}
+
+
+
+/**
+ * callsite_forget() - takes an allocation off its callsite
+ * 
+ * void *ptr: allocation about to be freed or resized
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Must run before the memory is actually freed, while the site stored with it is still its own. The bytes
+ * are taken off the calling thread's counters, which go below zero when another thread made the allocation, the sum over
+ * all threads is still right. The site is cleared, so forgetting the same allocation twice changes nothing.
+ * 
+ *           
+ */
+static void callsite_forget(void *ptr){
+
+    size_t bytes;
+    unsigned short *stored = callsite_site_of(ptr, &bytes);
+    unsigned int site = *stored;
+    if (site == CALLSITE_UNTRACKED){
+        return;
+    }
+
+    CallsiteThread *counters = callsite_thread;
+    if (counters == NULL && (counters = callsite_attach()) == NULL){
+        return;
+    }
+
+    *stored = CALLSITE_UNTRACKED;
+
+    CallsiteCounts *c = &counters->counts[site];
+    __atomic_store_n(&c->live_bytes, c->live_bytes - bytes, __ATOMIC_RELAXED);
+    __atomic_store_n(&c->live_count, c->live_count - 1, __ATOMIC_RELAXED);
+
+    return;
+
+}
+
+
+
+/**
+ * callsite_move() - hands the callsite of an allocation over to its new copy
+ * 
+ * void *from: allocation being moved, still allocated
+ * 
+ * void *to: allocation it was copied to
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Used when compaction relocates a handle's block. The new block keeps the old site, and the live bytes
+ * of that site change by the difference of the two usable sizes. Totals stay as they were, since the program did not
+ * allocate anything.
+ * 
+ *           
+ */
+static void callsite_move(void *from, void *to){
+
+    size_t from_bytes, to_bytes;
+    unsigned short *from_site = callsite_site_of(from, &from_bytes);
+    unsigned short *to_site = callsite_site_of(to, &to_bytes);
+    unsigned int site = *from_site;
+
+    *to_site = (unsigned short)site;
+    *from_site = CALLSITE_UNTRACKED;
+
+    CallsiteThread *counters = callsite_thread;
+    if (site == CALLSITE_UNTRACKED || (counters == NULL && (counters = callsite_attach()) == NULL)){
+        return;
+    }
+
+    CallsiteCounts *c = &counters->counts[site];
+    __atomic_store_n(&c->live_bytes, c->live_bytes + to_bytes - from_bytes, __ATOMIC_RELAXED);
+
+    return;
+
+}
+
+
+
+/**
+ * callsite_compare() - orders callsites by live bytes, largest first
+ * 
+ * const void *a: first Callsite
+ * 
+ * const void *b: second Callsite
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: qsort() comparison, ties are broken by the total bytes allocated.
+ * 
+ *           
+ */
+static int callsite_compare(const void *a, const void *b){
+
+    const Callsite *x = (const Callsite *)a, *y = (const Callsite *)b;
+
+    if (x->counts.live_bytes != y->counts.live_bytes){
+        return (x->counts.live_bytes < y->counts.live_bytes) ? 1 : -1;
+    }
+    if (x->counts.total_bytes != y->counts.total_bytes){
+        return (x->counts.total_bytes < y->counts.total_bytes) ? 1 : -1;
+    }
+
+    return 0;
+
+}
+
+
+
+/**
+ * callsite_name() - names a callsite for printing
+ * 
+ * void *address: return address of the callsite, NULL for CALLSITE_OTHER
+ * 
+ * char *name: filled in with the name
+ * 
+ * size_t size: bytes available at name
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Uses dladdr() to write function+offset and the object it belongs to, object+offset when no exported symbol
+ * covers it, or the bare address when dladdr() finds nothing. Only the last does not stay the same between runs.
+ * 
+ *           
+ */
+static void callsite_name(void *address, char *name, size_t size){
+
+    Dl_info info;
+    if (address == NULL){
+        snprintf(name, size, "(table full)");
+    }
+    else if (dladdr(address, &info) != 0 && info.dli_sname != NULL){
+        const char *object = strrchr(info.dli_fname, '/');
+        snprintf(name, size, "%s+0x%zx (%s)", info.dli_sname, (size_t)((char *)address - (char *)info.dli_saddr),
+                object != NULL ? object + 1 : info.dli_fname);
+    }
+    else if (dladdr(address, &info) != 0 && info.dli_fname != NULL){
+        const char *object = strrchr(info.dli_fname, '/');
+        snprintf(name, size, "%s+0x%zx", object != NULL ? object + 1 : info.dli_fname,
+                (size_t)((char *)address - (char *)info.dli_fbase));
+    }
+    else{
+        snprintf(name, size, "%p", address);
+    }
+
+    return;
+
+}
+
+
+
+/**
+ * my_malloc_dump_callsites() - prints the live bytes of every callsite
+ * 
+ * FILE *out: stream to print to
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Adds up the counters of the exited threads and of every live thread under the lock, sorts the callsites by
+ * live bytes and prints one line per callsite with its live bytes, live allocations and totals. Threads keep allocating
+ * while their counters are read, so the numbers of a busy program are only close to one moment. Each callsite is named
+ * with dladdr() as function+offset and the object it belongs to, or printed as a bare address when no symbol covers it.
+ * Prints nothing useful unless the program ran with MY_MALLOC_CALLSITES set.
+ * 
+ *           
+ */
+void my_malloc_dump_callsites(FILE *out){
+
+    static Callsite sum[CALLSITE_SITES];
+    size_t count = 0;
+
+    lock_acquire(&callsite_lock);
+    for (unsigned int i = CALLSITE_OTHER; i < CALLSITE_SITES; i++){
+
+        Callsite site = {callsite_addresses[i], callsite_exited[i]};
+        for (CallsiteThread *t = callsite_threads; t != NULL; t = t->next){
+            site.counts.live_bytes += __atomic_load_n(&t->counts[i].live_bytes, __ATOMIC_RELAXED);
+            site.counts.live_count += __atomic_load_n(&t->counts[i].live_count, __ATOMIC_RELAXED);
+            site.counts.total_bytes += __atomic_load_n(&t->counts[i].total_bytes, __ATOMIC_RELAXED);
+            site.counts.total_count += __atomic_load_n(&t->counts[i].total_count, __ATOMIC_RELAXED);
+        }
+
+        if (site.counts.total_count > 0){
+            sum[count++] = site;
+        }
+
+    }
+    lock_release(&callsite_lock);
+
+    qsort(sum, count, sizeof(Callsite), callsite_compare);
+
+    fprintf(out, "\n============Callsites=================\n");
+    if (!callsite_enabled){
+        fprintf(out, "Set MY_MALLOC_CALLSITES to record callsites\n");
+    }
+    fprintf(out, "Live (B)     Live     Total (B)    Total    Callsite\n");
+
+    for (size_t i = 0; i < count; i++){
+
+        const CallsiteCounts *c = &sum[i].counts;
+        char name[CALLSITE_NAME_BYTES];
+        callsite_name(sum[i].address, name, sizeof(name));
+        fprintf(out, "%-12zu %-8zu %-12zu %-8zu %s\n", c->live_bytes, c->live_count, c->total_bytes, c->total_count, name);
+
+    }
+
+    fprintf(out, "=====================================\n\n");
+
+    return;
+
+}
+
+
+
+/*
+ * ---------------------------------------------------------------------------------------------
+ * Allocation tags
+ * ---------------------------------------------------------------------------------------------
+ * When the MY_MALLOC_TAGS environment variable is set, every allocation is charged to the calling thread's current tag,
+ * chosen with my_malloc_set_tag(), and credited back to the same tag when it is freed, from whichever thread frees it.
+ * The tag is kept with the allocation the same way as its callsite, in the Block header or in a shadow array beside the
+ * slab region. Tags can be given a parent, which makes a hierarchy such as one tag per tenant and one per subsystem
+ * inside it: the live bytes of a tag include those of every tag below it, and a limit set on a tag caps the whole
+ * subtree. An allocation that would take a tag or one of its parents past its limit fails with NULL. The counters are
+ * shared by every thread, but a thread keeps what it allocates and frees under its current tag in thread-local counters
+ * and only adds them to the shared ones every TAG_FLUSH_BYTES, so the common path costs a few plain additions. Limits
+ * are exact for a single thread, threads allocating under the same tag together may go past it by up to TAG_FLUSH_BYTES
+ * each.
+ */
+
+#define TAG_COUNT 1024//number of tags, tag 0 is the one of threads that never chose a tag
+
+#define TAG_UNTRACKED 0xFFFF//tag stored with an allocation that is not charged to any tag
+
+#define TAG_FLUSH_BYTES (64 * 1024)//bytes a thread charges to its current tag before adding them to the shared counters
+
+typedef struct tag_counts_type{
+    size_t tree_bytes;//usable bytes of the live allocations of the tag and of every tag below it
+
+    size_t live_count;//live allocations of the tag itself
+
+    size_t total_bytes;//usable bytes of every allocation made under the tag itself
+
+    size_t limit;//most bytes tree_bytes may reach, 0 for no limit
+
+    size_t refused;//allocations made under the tag that a limit refused
+
+    unsigned int parent;//tag above this one, 0 for a tag at the top
+
+}__attribute__((aligned(64))) TagCounts;
+
+static int tag_enabled = 0;//set by allocator_setup() when MY_MALLOC_TAGS is in the environment
+
+static TagCounts tag_counts[TAG_COUNT];//counters of every tag, one cache line each so tags used by different threads do not share one
+
+static unsigned short *tag_shadow = NULL;//tag of the slab slot starting at each ALIGNMENT bytes of the slab region
+
+static __thread unsigned short tag_current = 0;//tag the calling thread's allocations are charged to
+
+static __thread size_t tag_pending_bytes = 0;//live bytes the calling thread added to tag_current and not yet to tree_bytes, may be negative
+
+static __thread size_t tag_pending_count = 0;//same for live_count, may be negative
+
+static __thread size_t tag_pending_total = 0;//same for total_bytes
+
+static size_t tag_limits = 0;//number of tags with a limit, admission checks are skipped while there are none
+
+
+
+/**
+ * tag_of() - finds where the tag of an allocation is kept
+ * 
+ * void *ptr: allocation handed out by the allocator
+ * 
+ * size_t *bytes: set to the usable size of the allocation
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Slab slots keep their tag in tag_shadow, blocks keep it in their header next to their arena.
+ * 
+ *           
+ */
+static inline unsigned short *tag_of(void *ptr, size_t *bytes){
+
+    if (slab_owns(ptr)){
+        *bytes = slab_run_of(ptr)->slot_size;
+        return &tag_shadow[((char *)ptr - slab_base) / ALIGNMENT];
+    }
+
+    Block *block = (Block *)ptr - 1;
+    *bytes = block->size;
+
+    return &block->tag;
+
+}
+
+
+
+/**
+ * tag_charge() - adds bytes to the live bytes of a tag and of every tag above it
+ * 
+ * unsigned int tag: tag the bytes belong to
+ * 
+ * size_t bytes: bytes to add, a negative number cast to size_t to take bytes off
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: The parents of a tag with live bytes never change, so the walk taking bytes off goes through the same
+ * tags as the one that added them.
+ * 
+ *           
+ */
+static inline void tag_charge(unsigned int tag, size_t bytes){
+
+    for (;;){
+        __atomic_add_fetch(&tag_counts[tag].tree_bytes, bytes, __ATOMIC_RELAXED);
+        tag = __atomic_load_n(&tag_counts[tag].parent, __ATOMIC_RELAXED);
+        if (tag == 0){
+            break;
+        }
+    }
+
+    return;
+
+}
+
+
+
+/**
+ * tag_flush() - adds the calling thread's pending counts to the shared counters of its tag
+ * 
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Called every TAG_FLUSH_BYTES, whenever the thread changes tags, before counters are read and when the
+ * thread exits.
+ * 
+ *           
+ */
+static void tag_flush(void){
+
+    unsigned int tag = tag_current;
+
+    if (tag_pending_bytes != 0){
+        tag_charge(tag, tag_pending_bytes);
+    }
+    if (tag_pending_count != 0){
+        __atomic_add_fetch(&tag_counts[tag].live_count, tag_pending_count, __ATOMIC_RELAXED);
+    }
+    if (tag_pending_total != 0){
+        __atomic_add_fetch(&tag_counts[tag].total_bytes, tag_pending_total, __ATOMIC_RELAXED);
+    }
+
+    tag_pending_bytes = 0;
+    tag_pending_count = 0;
+    tag_pending_total = 0;
+
+    return;
+
+}
+
+
+
+/**
+ * tag_detach() - adds an exiting thread's pending counts to its tag
+ * 
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Called from thread_exit().
+ * 
+ *           
+ */
+static void tag_detach(void){
+
+    if (tag_enabled){
+        tag_flush();
+    }
+
+    return;
+
+}
+
+
+
+/**
+ * tag_admit() - checks the limits of the calling thread's tag before an allocation
+ * 
+ * size_t size: requested size in bytes
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Walks from the current tag up to the top and refuses the allocation if it would take any tag with a limit
+ * past it, counting the thread's pending bytes which belong to every tag of the walk. Free while no tag has a limit.
+ * Returns 0 if the allocation may go ahead and -1 if it must fail.
+ * 
+ *           
+ */
+static inline int tag_admit(size_t size){
+
+    if (!tag_enabled || __atomic_load_n(&tag_limits, __ATOMIC_RELAXED) == 0){
+        return 0;
+    }
+
+    unsigned int tag = tag_current;
+    for (;;){
+
+        TagCounts *c = &tag_counts[tag];
+        size_t limit = __atomic_load_n(&c->limit, __ATOMIC_RELAXED);
+        if (limit != 0 && __atomic_load_n(&c->tree_bytes, __ATOMIC_RELAXED) + tag_pending_bytes + ALIGN(size) > limit){
+            __atomic_add_fetch(&tag_counts[tag_current].refused, 1, __ATOMIC_RELAXED);
+            fprintf(stderr,"tag %u limit of %zu bytes reached\n", tag, limit);
+            return -1;
+        }
+
+        tag = __atomic_load_n(&c->parent, __ATOMIC_RELAXED);
+        if (tag == 0){
+            break;
+        }
+
+    }
+
+    return 0;
+
+}
+
+
+
+/**
+ * tag_record() - charges a new allocation to the calling thread's tag
+ * 
+ * void *ptr: allocation just handed out
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Stores the tag with the allocation and adds its usable size to the thread's pending counts of the tag.
+ * 
+ *           
+ */
+static void tag_record(void *ptr){
+
+    size_t bytes;
+    unsigned short *stored = tag_of(ptr, &bytes);
+
+    *stored = tag_current;
+
+    tag_pending_bytes += bytes;
+    tag_pending_count++;
+    tag_pending_total += bytes;
+    if (tag_pending_total >= TAG_FLUSH_BYTES){
+        tag_flush();
+    }
+
+    return;
+
+}
+
+
+
+/**
+ * tag_forget() - credits an allocation back to the tag it was charged to
+ * 
+ * void *ptr: allocation about to be freed or resized
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Must run before the memory is actually freed, while the tag stored with it is still its own. The tag is
+ * cleared, so forgetting the same allocation twice changes nothing. Memory of the thread's current tag is taken off
+ * its pending counts, memory of any other tag straight off the shared counters.
+ * 
+ *           
+ */
+static void tag_forget(void *ptr){
+
+    size_t bytes;
+    unsigned short *stored = tag_of(ptr, &bytes);
+    unsigned int tag = *stored;
+    if (tag == TAG_UNTRACKED){
+        return;
+    }
+
+    *stored = TAG_UNTRACKED;
+
+    if (tag == tag_current){
+        tag_pending_bytes -= bytes;
+        tag_pending_count--;
+        if ((ssize_t)tag_pending_bytes <= -TAG_FLUSH_BYTES){
+            tag_flush();
+        }
+        return;
+    }
+
+    tag_charge(tag, -bytes);
+    __atomic_sub_fetch(&tag_counts[tag].live_count, 1, __ATOMIC_RELAXED);
+
+    return;
+
+}
+
+
+
+/**
+ * tag_move() - hands the tag of an allocation over to its new copy
+ * 
+ * void *from: allocation being moved, still allocated
+ * 
+ * void *to: allocation it was copied to
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Used when compaction relocates a handle's block. The new block keeps the old tag, and the live bytes of
+ * the tag change by the difference of the two usable sizes.
+ * 
+ *           
+ */
+static void tag_move(void *from, void *to){
+
+    size_t from_bytes, to_bytes;
+    unsigned short *from_tag = tag_of(from, &from_bytes);
+    unsigned short *to_tag = tag_of(to, &to_bytes);
+    unsigned int tag = *from_tag;
+
+    *to_tag = (unsigned short)tag;
+    *from_tag = TAG_UNTRACKED;
+
+    if (tag != TAG_UNTRACKED){
+        tag_charge(tag, to_bytes - from_bytes);
+    }
+
+    return;
+
+}
+
+
+
+/**
+ * my_malloc_set_tag() - chooses the tag the calling thread's allocations are charged to
+ * 
+ * unsigned int tag: tag to charge from now on, below TAG_COUNT
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Returns the tag that was current before, so a caller can restore it when it is done. An invalid tag is
+ * reported and leaves the current tag as it was. Only the calling thread is affected, and memory it frees is always
+ * credited to the tag it was allocated under.
+ * 
+ *           
+ */
+unsigned int my_malloc_set_tag(unsigned int tag){
+
+    unsigned int previous = tag_current;
+
+    if (tag >= TAG_COUNT){
+        fprintf(stderr,"invalid tag %u\n", tag);
+        return previous;
+    }
+
+    if (tag != previous){
+        tag_flush();
+        tag_current = (unsigned short)tag;
+    }
+
+    return previous;
+
+}
+
+
+
+/**
+ * my_malloc_tag_parent() - places a tag below another one
+ * 
+ * unsigned int tag: tag to move, not 0
+ * 
+ * unsigned int parent: tag above it, 0 to make it a top tag
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: The live bytes of the tag count toward the parent and everything above it from now on. Only a tag with
+ * no live allocations below it can be moved, otherwise its bytes would later be taken off tags they were never added
+ * to, and a tag cannot be placed below itself. Returns 0 on success and -1 if the tag cannot be moved.
+ * 
+ *           
+ */
+int my_malloc_tag_parent(unsigned int tag, unsigned int parent){
+
+    if (tag == 0 || tag >= TAG_COUNT || parent >= TAG_COUNT){
+        fprintf(stderr,"invalid tag %u or parent %u\n", tag, parent);
+        return -1;
+    }
+
+    tag_flush();
+
+    if (__atomic_load_n(&tag_counts[tag].tree_bytes, __ATOMIC_RELAXED) != 0){
+        fprintf(stderr,"tag %u still has live allocations\n", tag);
+        return -1;
+    }
+
+    for (unsigned int above = parent; above != 0; above = tag_counts[above].parent){
+        if (above == tag){
+            fprintf(stderr,"tag %u cannot be placed below itself\n", tag);
+            return -1;
+        }
+    }
+
+    __atomic_store_n(&tag_counts[tag].parent, parent, __ATOMIC_RELAXED);
+
+    return 0;
+
+}
+
+
+
+/**
+ * my_malloc_tag_limit() - caps the live bytes of a tag and the tags below it
+ * 
+ * unsigned int tag: tag to cap
+ * 
+ * size_t bytes: most usable bytes the tag may have live, 0 to remove the limit
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Only allocations made after the call are checked, a tag already past its new limit keeps what it has.
+ * Returns 0 on success and -1 for an invalid tag.
+ * 
+ *           
+ */
+int my_malloc_tag_limit(unsigned int tag, size_t bytes){
+
+    if (tag >= TAG_COUNT){
+        fprintf(stderr,"invalid tag %u\n", tag);
+        return -1;
+    }
+
+    size_t old = __atomic_exchange_n(&tag_counts[tag].limit, bytes, __ATOMIC_RELAXED);
+    if (old == 0 && bytes != 0){
+        __atomic_add_fetch(&tag_limits, 1, __ATOMIC_RELAXED);
+    }
+    else if (old != 0 && bytes == 0){
+        __atomic_sub_fetch(&tag_limits, 1, __ATOMIC_RELAXED);
+    }
+
+    return 0;
+
+}
+
+
+
+/**
+ * my_malloc_tag_usage() - returns the live bytes of a tag
+ * 
+ * unsigned int tag: tag to read
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Usable bytes of the live allocations of the tag and of every tag below it, 0 for an invalid tag. Counts
+ * that other threads have not flushed yet are missing.
+ * 
+ *           
+ */
+size_t my_malloc_tag_usage(unsigned int tag){
+
+    if (tag >= TAG_COUNT){
+        return 0;
+    }
+
+    tag_flush();
+
+    return __atomic_load_n(&tag_counts[tag].tree_bytes, __ATOMIC_RELAXED);
+
+}
+
+
+
+/**
+ * my_malloc_dump_tags() - prints the counters of every tag that was used
+ * 
+ * FILE *out: stream to print to
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Prints one line per tag with its own live bytes, the live bytes of its whole subtree, its live
+ * allocations, its totals, its limit and its refused allocations. A tag's own bytes are its subtree's bytes minus those
+ * of the tags right below it. Other threads may still hold up to TAG_FLUSH_BYTES of their current tag's counts.
+ * Prints nothing useful unless the program ran with MY_MALLOC_TAGS set.
+ * 
+ *           
+ */
+void my_malloc_dump_tags(FILE *out){
+
+    static size_t children[TAG_COUNT];
+    memset(children, 0, sizeof(children));
+
+    tag_flush();
+
+    for (unsigned int i = 1; i < TAG_COUNT; i++){
+        unsigned int parent = __atomic_load_n(&tag_counts[i].parent, __ATOMIC_RELAXED);
+        if (parent != 0){
+            children[parent] += __atomic_load_n(&tag_counts[i].tree_bytes, __ATOMIC_RELAXED);
+        }
+    }
+
+    fprintf(out, "\n============Tags======================\n");
+    if (!tag_enabled){
+        fprintf(out, "Set MY_MALLOC_TAGS to record tags\n");
+    }
+    fprintf(out, "Tag    Parent Own (B)      Tree (B)     Live     Total (B)    Limit (B)    Refused\n");
+
+    for (unsigned int i = 0; i < TAG_COUNT; i++){
+
+        const TagCounts *c = &tag_counts[i];
+        size_t tree = __atomic_load_n(&c->tree_bytes, __ATOMIC_RELAXED);
+        size_t total = __atomic_load_n(&c->total_bytes, __ATOMIC_RELAXED);
+        size_t limit = __atomic_load_n(&c->limit, __ATOMIC_RELAXED);
+        if (total == 0 && tree == 0 && limit == 0){
+            continue;
+        }
+
+        fprintf(out, "%-6u %-6u %-12zu %-12zu %-8zu %-12zu %-12zu %zu\n", i, c->parent, tree - children[i], tree,
+                __atomic_load_n(&c->live_count, __ATOMIC_RELAXED), total, limit,
+                __atomic_load_n(&c->refused, __ATOMIC_RELAXED));
+
+    }
+
+    fprintf(out, "=====================================\n\n");
+
+    return;
+
+}
+
+
+
+/*
+ * ---------------------------------------------------------------------------------------------
+ * Handles
+ * ---------------------------------------------------------------------------------------------
+ * my_malloc() pointers never move, so the Block lists can only merge free neighbours and never compact. Memory
+ * allocated with halloc() is reached through a handle instead, an index into a table that holds the block's current
+ * address. The program takes the address with hlock() only while it uses the memory and gives it back with hunlock().
+ * Unlocked blocks may be moved by my_heap_compact() into free space lower in their arena, after which the free tail of
+ * the arena is handed back to the OS. Handles live on the same heap as everything else, they only add the table entry.
+ */
+
+#define HANDLE_NONE 0//handle that is never handed out, returned by halloc() on failure
+
+#define HANDLE_TABLE_START 1024//entries of the handle table when it is first mapped
+
+#define HANDLE_COMPACT_FREES 256//hfree() calls between two compaction steps made by hfree() itself
+
+#define HANDLE_COMPACT_STEP 16//handles looked at by each of those steps
+
+typedef unsigned int Handle;
+
+typedef struct handle_entry_type{
+    void *ptr;//current address of the allocation, NULL while the entry is unused
+
+    size_t size;//bytes requested
+
+    unsigned int locks;//hlock() calls not yet matched by hunlock(), the block only moves at 0
+
+    unsigned int next_free;//next unused entry while this one is unused
+
+}HandleEntry;
+
+static AllocLock handle_lock = ALLOC_LOCK_INITIALIZER;//protects the handle table and every entry, taken before any arena lock
+
+static HandleEntry *handle_table = NULL;//entries indexed by handle, mapped with mmap()
+
+static unsigned int handle_capacity = 0;//entries of handle_table
+
+static unsigned int handle_free_list = HANDLE_NONE;//first unused entry
+
+static unsigned int handle_cursor = 1;//entry the next compaction step starts at, so steps go round the table
+
+static size_t handle_live = 0;//handles currently allocated
+
+static size_t handle_frees = 0;//hfree() calls so far
+
+static size_t handle_moves = 0;//blocks moved by compaction
+
+static size_t handle_moved_bytes = 0;//bytes copied by those moves
+
+static size_t handle_trimmed_bytes = 0;//bytes handed back to the OS after compaction
+
+
+
+/**
+ * handle_entry_new() - takes an unused entry of the handle table
+ * 
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Pops the free list. When it is empty the table is mapped again twice as large with mmap(), so handles
+ * never allocate from the heap they manage, and the new entries go on the free list. Returns HANDLE_NONE if the table
+ * could not grow. handle_lock must be held.
+ * 
+ *           
+ */
+static Handle handle_entry_new(void){
+
+    if (handle_free_list == HANDLE_NONE){
+
+        unsigned int capacity = (handle_capacity == 0) ? HANDLE_TABLE_START : handle_capacity * 2;
+        HandleEntry *table = mmap(NULL, capacity * sizeof(HandleEntry), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (table == MAP_FAILED){
+            return HANDLE_NONE;
+        }
+
+        if (handle_table != NULL){
+            memcpy(table, handle_table, handle_capacity * sizeof(HandleEntry));
+            munmap(handle_table, handle_capacity * sizeof(HandleEntry));
+        }
+
+        //entry HANDLE_NONE is never used, the new entries are pushed highest first so the lowest comes out first
+        unsigned int first = (handle_capacity == 0) ? HANDLE_NONE + 1 : handle_capacity;
+        for (unsigned int i = capacity - 1; i >= first; i--){
+            table[i].next_free = handle_free_list;
+            handle_free_list = i;
+        }
+
+        handle_table = table;
+        handle_capacity = capacity;
+
+    }
+
+    Handle handle = handle_free_list;
+    handle_free_list = handle_table[handle].next_free;
+
+    return handle;
+
+}
+
+
+
+/**
+ * handle_entry_of() - finds the entry of a handle in use
+ * 
+ * Handle handle: handle returned by halloc()
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Returns NULL, after printing why, for HANDLE_NONE, handles past the table and handles already freed.
+ * handle_lock must be held.
+ * 
+ *           
+ */
+static HandleEntry *handle_entry_of(Handle handle){
+
+    if (handle == HANDLE_NONE || handle >= handle_capacity || handle_table[handle].ptr == NULL){
+        fprintf(stderr,"invalid handle %u\n", handle);
+        return NULL;
+    }
+
+    return &handle_table[handle];
+
+}
+
+
+
+/*
+ * ---------------------------------------------------------------------------------------------
+ * Epoch-based reclamation
+ * ---------------------------------------------------------------------------------------------
+ * Lock-free data structures cannot free a node when they unlink it, since another thread may still be reading it.
+ * Readers wrap their accesses in my_epoch_enter() and my_epoch_exit(), and writers hand unlinked memory to
+ * my_retire() instead of my_free(). The global epoch only moves forward once every thread inside a critical section
+ * has seen its current value, so memory retired in epoch e can no longer be reached once the global epoch is e + 2,
+ * and it is then freed through my_free(), which puts small slots straight back in the thread cache. Retired pointers
+ * are kept in chunks mapped outside the heap, one epoch per chunk, so the retired memory itself is never written.
+ */
+
+#define EPOCH_THREADS 256//threads that can be inside a critical section at the same time
+
+#define EPOCH_RETIRE_BATCH 64//my_retire() calls between two attempts to advance the epoch and free old chunks
+
+#define EPOCH_CHUNK_BYTES 4096//size of a chunk of retired pointers
+
+typedef struct epoch_record_type{
+    size_t epoch;//global epoch the thread saw when its outermost critical section began
+
+    unsigned int active;//critical sections the thread is in, nested ones included
+
+    int used;//1 while a thread owns the record
+
+}EpochRecord;
+
+typedef struct retire_chunk_type{
+    struct retire_chunk_type *next;//next chunk of the same list
+
+    size_t epoch;//epoch every pointer of the chunk was retired in
+
+    size_t count;//pointers in the chunk
+
+    void *ptrs[(EPOCH_CHUNK_BYTES - 3 * sizeof(size_t)) / sizeof(void *)];//retired allocations
+
+}RetireChunk;
+
+#define EPOCH_CHUNK_PTRS (sizeof(((RetireChunk *)0)->ptrs) / sizeof(void *))
+
+static size_t epoch_global = 0;//current global epoch
+
+static EpochRecord epoch_records[EPOCH_THREADS];//one per thread that has entered a critical section
+
+static __thread int epoch_slot = -1;//index of the calling thread's record
+
+static __thread RetireChunk *epoch_retired = NULL;//the calling thread's chunks, newest first
+
+static __thread size_t epoch_retire_calls = 0;//my_retire() calls of the calling thread
+
+static AllocLock epoch_lock = ALLOC_LOCK_INITIALIZER;//protects the orphan and spare chunk lists, never held while another lock is taken
+
+static RetireChunk *epoch_orphans = NULL;//chunks left by exited threads, freed by whichever thread reclaims next
+
+static RetireChunk *epoch_spare = NULL;//emptied chunks ready for reuse
+
+static size_t epoch_pending = 0;//retired allocations not freed yet
+
+static size_t epoch_reclaimed = 0;//retired allocations freed so far
+
+
+
+/**
+ * epoch_detach() - gives up an exiting thread's record and hands its chunks over
+ * 
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Called from thread_exit(). The thread's retired memory may still be read by others, so its chunks are
+ * moved to epoch_orphans to be freed once their epoch is old enough, and its record is released for a new thread.
+ * 
+ *           
+ */
+static void epoch_detach(void){
+
+    if (epoch_retired != NULL){
+        RetireChunk *last = epoch_retired;
+        while (last->next != NULL){
+            last = last->next;
+        }
+
+        lock_acquire(&epoch_lock);
+        last->next = epoch_orphans;
+        __atomic_store_n(&epoch_orphans, epoch_retired, __ATOMIC_RELAXED);
+        lock_release(&epoch_lock);
+
+        epoch_retired = NULL;
+    }
+
+    if (epoch_slot >= 0){
+        __atomic_store_n(&epoch_records[epoch_slot].active, 0, __ATOMIC_RELEASE);
+        __atomic_store_n(&epoch_records[epoch_slot].used, 0, __ATOMIC_RELEASE);
+        epoch_slot = -1;
+    }
+
+    return;
+
+}
+
+
+
+/*
+ * ---------------------------------------------------------------------------------------------
+ * Lifetime segregation
+ * ---------------------------------------------------------------------------------------------
+ * A long-lived object left among short-lived ones keeps their pages, slab runs and arena tails in use long after the
+ * short-lived ones are gone. When MY_MALLOC_LIFETIME is set, one allocation in LIFETIME_SAMPLE_RATE is sampled and its
+ * lifetime, in bytes allocated by the program between its allocation and its free, is counted against its callsite.
+ * Callsites whose samples nearly all die young are predicted short-lived, and their allocations are bump-allocated from
+ * a chunk of the calling thread instead of the heap. A chunk holds no long-lived object to pin it, so it is reset as a
+ * whole once its last object is freed. my_malloc_hint() lets a caller state the lifetime itself, and my_malloc_site()
+ * names the callsite for wrappers that allocate on behalf of their callers, and for trace replay.
+ */
+
+#define LIFETIME_CHUNK_SIZE (256 * 1024)//size of a chunk, chunks are aligned to this size
+
+#define LIFETIME_REGION_SIZE ((size_t)1 << 30)//virtual space reserved for chunks, pages are only backed once touched
+
+#define LIFETIME_MAX_SIZE (16 * 1024)//larger allocations always go to the heap
+
+#define LIFETIME_RETAINED_CHUNKS 4//empty chunks kept backed, the others are purged
+
+#define LIFETIME_SAMPLE_RATE 32//one allocation in this many is sampled
+
+#define LIFETIME_SAMPLE_SLOTS 4096//sampled allocations tracked at the same time, a power of two
+
+#define LIFETIME_SHORT_BYTES (32 * LIFETIME_CHUNK_SIZE)//a sample freed before this many more bytes were allocated is short-lived
+
+#define LIFETIME_MIN_SAMPLES 8//short-lived samples a callsite needs before it is predicted short-lived
+
+#define LIFETIME_DECAY 64//a callsite's counts are halved once they add up to this, so the prediction follows changes
+
+#define LIFETIME_CLOCK_BATCH (64 * 1024)//bytes a thread allocates before it adds them to the global clock
+
+#define LIFETIME_UNKNOWN 0//lifetime left to the prediction
+
+#define LIFETIME_SHORT 1//allocation expected to be freed soon, served from a chunk
+
+#define LIFETIME_LONG 2//allocation expected to live long, served from the heap
+
+typedef struct lifetime_chunk_type{
+    size_t live;//objects not freed yet, plus one while a thread allocates from the chunk
+
+    size_t used;//bytes handed out from the start of the chunk, this header included
+
+    struct lifetime_chunk_type *next;//next chunk on the empty chunk list
+
+    int purged;//1 once the pages after the first were handed back to the OS
+
+}LifetimeChunk;
+
+typedef struct lifetime_sample_type{
+    void *ptr;//sampled allocation, NULL for an unused slot
+
+    size_t clock;//lifetime_clock when it was allocated
+
+    unsigned int site;//its callsite
+
+}LifetimeSample;
+
+typedef struct lifetime_site_type{
+    unsigned int short_lived;//samples of the callsite freed before LIFETIME_SHORT_BYTES
+
+    unsigned int long_lived;//samples that lived longer, freed or not
+
+}LifetimeSite;
+
+static int lifetime_enabled = 0;//set by allocator_setup() when MY_MALLOC_LIFETIME is in the environment
+
+static AllocLock lifetime_lock = ALLOC_LOCK_INITIALIZER;//protects the chunk region, the empty chunk list and the samples, never held while another lock is taken
+
+static char *lifetime_base = NULL;//start of the chunk region, NULL until the first chunk is needed
+
+static char *lifetime_next = NULL;//next unused chunk of the region
+
+static char *lifetime_end = NULL;//end of the chunk region
+
+static LifetimeChunk *lifetime_free_chunks = NULL;//empty chunks ready for reuse
+
+static size_t lifetime_free_count = 0;//chunks on lifetime_free_chunks
+
+static __thread LifetimeChunk *lifetime_current = NULL;//chunk the calling thread allocates from
+
+static size_t lifetime_clock = 0;//bytes allocated by the program, in steps of LIFETIME_CLOCK_BATCH per thread
+
+static __thread size_t lifetime_pending = 0;//bytes the calling thread allocated and has not added to the clock yet
+
+static __thread unsigned int lifetime_countdown = 0;//allocations of the calling thread until the next sample
+
+static LifetimeSample lifetime_samples[LIFETIME_SAMPLE_SLOTS];//sampled allocations not freed yet
+
+static LifetimeSite lifetime_sites[CALLSITE_SITES];//lifetime counts per callsite table entry
+
+static size_t lifetime_chunk_objects = 0;//allocations served from chunks
+
+static size_t lifetime_chunk_resets = 0;//chunks emptied and put back on the empty chunk list
+
+static size_t lifetime_chunks_carved = 0;//chunks taken from the region so far
+
+
+
+/**
+ * lifetime_chunk_purge() - hands the pages of an empty chunk back to the OS
+ * 
+ * LifetimeChunk *chunk: chunk on the empty chunk list
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: The first page holds the header and stays backed, like the first page of a purged run. lifetime_lock must
+ * be held. Returns the number of bytes handed back.
+ * 
+ *           
+ */
+static size_t lifetime_chunk_purge(LifetimeChunk *chunk){
+
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    if (chunk->purged || page >= LIFETIME_CHUNK_SIZE || madvise((char *)chunk + page, LIFETIME_CHUNK_SIZE - page, MADV_DONTNEED) != 0){
+        return 0;
+    }
+
+    chunk->purged = 1;
+    limit_uncharge(LIFETIME_CHUNK_SIZE - page);
+
+    return LIFETIME_CHUNK_SIZE - page;
+
+}
+
+
+
+/**
+ * lifetime_chunk_put() - drops one reference to a chunk
+ * 
+ * LifetimeChunk *chunk: chunk of a freed object, or the chunk a thread stops allocating from
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Whoever drops the last reference resets the chunk: it goes on the empty chunk list, and is purged when
+ * LIFETIME_RETAINED_CHUNKS chunks are already kept there.
+ * 
+ *           
+ */
+static void lifetime_chunk_put(LifetimeChunk *chunk){
+
+    if (__atomic_sub_fetch(&chunk->live, 1, __ATOMIC_ACQ_REL) != 0){
+        return;
+    }
+
+    lock_acquire(&lifetime_lock);
+    chunk->next = lifetime_free_chunks;
+    lifetime_free_chunks = chunk;
+    lifetime_free_count++;
+    lifetime_chunk_resets++;
+    if (lifetime_free_count > LIFETIME_RETAINED_CHUNKS){
+        lifetime_chunk_purge(chunk);
+    }
+    lock_release(&lifetime_lock);
+
+    return;
+
+}
+
+
+
+/**
+ * lifetime_chunk_new() - gets an empty chunk for the calling thread
+ * 
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Takes a chunk from the empty chunk list or carves the next one out of the region, which is reserved on the
+ * first call. Either is charged to the heap limit when its pages have to be backed. The chunk starts with one reference,
+ * held by the thread until it moves on to another chunk. Returns NULL if there is no chunk to be had, the caller then
+ * allocates from the heap.
+ * 
+ *           
+ */
+static LifetimeChunk *lifetime_chunk_new(void){
+
+    LifetimeChunk *chunk = NULL;
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+
+    lock_acquire(&lifetime_lock);
+
+    if (lifetime_base == NULL){
+        void *region = mmap(NULL, LIFETIME_REGION_SIZE + LIFETIME_CHUNK_SIZE, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (region != MAP_FAILED){
+            lifetime_base = (char *)(((uintptr_t)region + LIFETIME_CHUNK_SIZE - 1) & ~(uintptr_t)(LIFETIME_CHUNK_SIZE - 1));
+            lifetime_next = lifetime_base;
+            lifetime_end = lifetime_base + LIFETIME_REGION_SIZE;
+        }
+    }
+
+    if (lifetime_free_chunks != NULL){
+        if (!lifetime_free_chunks->purged || limit_charge(LIFETIME_CHUNK_SIZE - page) == 0){
+            chunk = lifetime_free_chunks;
+            lifetime_free_chunks = chunk->next;
+            lifetime_free_count--;
+        }
+    }
+
+    else if (lifetime_base != NULL && lifetime_next < lifetime_end && limit_charge(LIFETIME_CHUNK_SIZE) == 0){
+        chunk = (LifetimeChunk *)lifetime_next;
+        lifetime_next += LIFETIME_CHUNK_SIZE;
+        lifetime_chunks_carved++;
+    }
+
+    lock_release(&lifetime_lock);
+
+    if (chunk == NULL){
+        return NULL;
+    }
+
+    //the reference is published last, a snapshot only reads a chunk it holds a reference to
+    chunk->used = ALIGN(sizeof(LifetimeChunk));
+    chunk->next = NULL;
+    chunk->purged = 0;
+    __atomic_store_n(&chunk->live, 1, __ATOMIC_RELEASE);
+
+    return chunk;
+
+}
+
+
+
+/**
+ * lifetime_chunk_alloc() - bump-allocates an object from the calling thread's chunk
+ * 
+ * size_t aligned_size: requested size already aligned with ALIGN(), at most LIFETIME_MAX_SIZE
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: The object gets a Block header of arena ARENA_CHUNK, so my_free(), my_realloc() and the callsite
+ * accounting treat it like any block. A chunk without room left is given up and a new one started. Returns NULL if no
+ * chunk could be had.
+ * 
+ *           
+ */
+static void *lifetime_chunk_alloc(size_t aligned_size){
+
+    size_t need = sizeof(Block) + aligned_size;
+    LifetimeChunk *chunk = lifetime_current;
+
+    if (chunk == NULL || chunk->used + need > LIFETIME_CHUNK_SIZE){
+        if (chunk != NULL){
+            lifetime_current = NULL;
+            lifetime_chunk_put(chunk);
+        }
+        chunk = lifetime_chunk_new();
+        if (chunk == NULL){
+            return NULL;
+        }
+        lifetime_current = chunk;
+        thread_exit_register();
+    }
+
+    Block *block = (Block *)((char *)chunk + chunk->used);
+    block->size = aligned_size;
+    block->free = 0;
+    block->arena = ARENA_CHUNK;
+    block->site = CALLSITE_UNTRACKED;
+    block->tag = TAG_UNTRACKED;
+    block_set_next(block, NULL);
+    block_set_prev(block, NULL);
+
+    //the header is written before used covers it, so a snapshot walking the chunk never reads a half written one
+    __atomic_store_n(&chunk->used, chunk->used + need, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&chunk->live, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&lifetime_chunk_objects, 1, __ATOMIC_RELAXED);
+
+    return (void *)(block + 1);
+
+}
+
+
+
+/**
+ * lifetime_chunk_free() - frees an object allocated from a chunk
+ * 
+ * Block *block: header of the object
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Called by my_free() for blocks of arena ARENA_CHUNK. The memory itself is only reused once the whole chunk
+ * is reset, until then the header is marked free so heap snapshots skip the object.
+ * 
+ *           
+ */
+static void lifetime_chunk_free(Block *block){
+
+    __atomic_store_n(&block->free, 1, __ATOMIC_RELAXED);
+    lifetime_chunk_put((LifetimeChunk *)((uintptr_t)block & ~(uintptr_t)(LIFETIME_CHUNK_SIZE - 1)));
+
+    return;
+
+}
+
+
+
+/**
+ * lifetime_release() - purges every empty chunk
+ * 
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Part of heap_release(). Returns the number of bytes handed back.
+ * 
+ *           
+ */
+static size_t lifetime_release(void){
+
+    size_t released = 0;
+
+    lock_acquire(&lifetime_lock);
+    for (LifetimeChunk *chunk = lifetime_free_chunks; chunk != NULL; chunk = chunk->next){
+        released += lifetime_chunk_purge(chunk);
+    }
+    lock_release(&lifetime_lock);
+
+    return released;
+
+}
+
+
+
+/**
+ * lifetime_count() - adds a sampled lifetime to its callsite
+ * 
+ * unsigned int site: callsite of the sample
+ * 
+ * int short_lived: 1 if the sample was freed before LIFETIME_SHORT_BYTES
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: lifetime_lock must be held. The counts are halved once they reach LIFETIME_DECAY, so a callsite whose
+ * objects start living longer loses its short-lived prediction after a few samples.
+ * 
+ *           
+ */
+static void lifetime_count(unsigned int site, int short_lived){
+
+    LifetimeSite *counts = &lifetime_sites[site];
+
+    if (short_lived){
+        __atomic_store_n(&counts->short_lived, counts->short_lived + 1, __ATOMIC_RELAXED);
+    }
+    else{
+        __atomic_store_n(&counts->long_lived, counts->long_lived + 1, __ATOMIC_RELAXED);
+    }
+
+    if (counts->short_lived + counts->long_lived >= LIFETIME_DECAY){
+        __atomic_store_n(&counts->short_lived, counts->short_lived / 2, __ATOMIC_RELAXED);
+        __atomic_store_n(&counts->long_lived, counts->long_lived / 2, __ATOMIC_RELAXED);
+    }
+
+    return;
+
+}
+
+
+
+/**
+ * lifetime_slot() - hashes an allocation to its sample slot
+ * 
+ * const void *ptr: allocation
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Fibonacci hashing, like callsite_hash().
+ * 
+ *           
+ */
+static inline LifetimeSample *lifetime_slot(const void *ptr){
+    return &lifetime_samples[((uint64_t)(uintptr_t)ptr * 0x9E3779B97F4A7C15ULL) >> 52 & (LIFETIME_SAMPLE_SLOTS - 1)];
+}
+
+
+
+/**
+ * lifetime_forget() - ends the sample of an allocation that is being freed
+ * 
+ * void *ptr: allocation passed to my_free()
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Called by my_free() when MY_MALLOC_LIFETIME is set. Most allocations are not sampled, which the slot shows
+ * without taking the lock. A sample's lifetime is counted against its callsite.
+ * 
+ *           
+ */
+static void lifetime_forget(void *ptr){
+
+    LifetimeSample *slot = lifetime_slot(ptr);
+    if (__atomic_load_n(&slot->ptr, __ATOMIC_RELAXED) != ptr){
+        return;
+    }
+
+    lock_acquire(&lifetime_lock);
+    if (slot->ptr == ptr){
+        size_t age = __atomic_load_n(&lifetime_clock, __ATOMIC_RELAXED) - slot->clock;
+        lifetime_count(slot->site, age < LIFETIME_SHORT_BYTES);
+        __atomic_store_n(&slot->ptr, NULL, __ATOMIC_RELAXED);
+    }
+    lock_release(&lifetime_lock);
+
+    return;
+
+}
+
+
+
+/**
+ * lifetime_detach() - gives up an exiting thread's chunk
+ * 
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Called from thread_exit(). The chunk is reset once its objects are freed, whichever thread frees them.
+ * 
+ *           
+ */
+static void lifetime_detach(void){
+
+    if (lifetime_current != NULL){
+        LifetimeChunk *chunk = lifetime_current;
+        lifetime_current = NULL;
+        lifetime_chunk_put(chunk);
+    }
+
+    return;
+
+}
+
+
+
+/*
+ * ---------------------------------------------------------------------------------------------
+ * Guarded sampling
+ * ---------------------------------------------------------------------------------------------
+ * Full address sanitizing costs too much to leave on, but an overflow that runs into a Block header only shows up much
+ * later as a crash in my_free(). With MY_MALLOC_GUARD=<N> set, one allocation in N that fits in a page is placed at the
+ * end of a page of a dedicated pool instead, right before a PROT_NONE guard page, so the first write past it faults.
+ * Freed slots are made PROT_NONE and wait in a quarantine, the least recently freed one reused first, so reading or
+ * writing them after the free faults as well. A SIGSEGV handler recognizes faults inside the pool and prints what
+ * happened with the allocation and free stack traces of the slot, then lets the signal end the program. A double free
+ * or a free of a pointer the pool never handed out is reported the same way. The stack traces are only taken for sampled
+ * allocations, every other allocation pays a decrement and a branch. Sizes are rounded up to ALIGNMENT, so an overflow
+ * of fewer than ALIGNMENT bytes past an unaligned size is not caught. The pool is not charged to the heap limit.
+ */
+
+#define GUARD_SLOTS 256//slots in the pool, each one page of data behind a guard page, the pool ends with a guard page
+
+#define GUARD_DEFAULT_RATE 1000//one allocation in this many is guarded when MY_MALLOC_GUARD is not a number above 0
+
+#define GUARD_STACK_DEPTH 16//return addresses kept for the allocation and the free of a slot
+
+#define GUARD_UNUSED 0//slot never handed out
+
+#define GUARD_LIVE 1//slot holds an allocation that is not freed yet
+
+#define GUARD_FREED 2//slot is freed and waits in the quarantine
+
+typedef struct guard_slot_type{
+    int state;//GUARD_UNUSED, GUARD_LIVE or GUARD_FREED
+
+    size_t size;//size requested for the allocation
+
+    void *ptr;//address handed to the program
+
+    long alloc_thread;//thread id of the allocating thread
+
+    long free_thread;//thread id of the freeing thread
+
+    int alloc_depth;//return addresses in alloc_stack
+
+    int free_depth;//return addresses in free_stack
+
+    void *alloc_stack[GUARD_STACK_DEPTH];//stack trace of the allocation
+
+    void *free_stack[GUARD_STACK_DEPTH];//stack trace of the free
+
+    struct guard_slot_type *next;//next slot of the quarantine
+
+}GuardSlot;
+
+static int guard_enabled = 0;//set by allocator_setup() when MY_MALLOC_GUARD is in the environment and the pool was reserved
+
+static unsigned int guard_rate = GUARD_DEFAULT_RATE;//one allocation in guard_rate is guarded
+
+static __thread unsigned int guard_countdown = 0;//allocations of the calling thread until the next guarded one
+
+static AllocLock guard_lock = ALLOC_LOCK_INITIALIZER;//protects the slots and the quarantine, never held while another lock is taken
+
+static char *guard_pool = NULL;//start of the pool, every even page is a guard page
+
+static size_t guard_page = 0;//page size
+
+static GuardSlot guard_slots[GUARD_SLOTS];//one entry per data page of the pool
+
+static unsigned int guard_unused = 0;//slots before this index have been handed out at least once
+
+static GuardSlot *guard_quarantine = NULL;//freed slots, least recently freed first
+
+static GuardSlot *guard_quarantine_last = NULL;//most recently freed slot
+
+static size_t guard_allocations = 0;//allocations placed in the pool
+
+static size_t guard_live = 0;//slots holding an allocation
+
+static size_t guard_misses = 0;//sampled allocations that found no slot or were too large
+
+static struct sigaction guard_old_action;//SIGSEGV action replaced by guard_fault()
+
+
+
+/**
+ * guard_owns() - checks if a pointer is inside the guarded pool
+ * 
+ * const void *ptr: pointer to check
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Returns 1 if the pointer lies in the pool, 0 otherwise, always 0 while guarded sampling is off.
+ * 
+ *           
+ */
+static inline int guard_owns(const void *ptr){
+
+    return guard_pool != NULL && (const char *)ptr >= guard_pool && (const char *)ptr < guard_pool + (2 * GUARD_SLOTS + 1) * guard_page;
+
+}
+
+
+
+/**
+ * guard_slot_of() - finds the slot a pool address belongs to
+ * 
+ * const void *address: address inside the pool
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: A guard page belongs to the slot in front of it, whose allocation ends where the guard page starts.
+ * Returns NULL for the guard page at the start of the pool.
+ * 
+ *           
+ */
+static GuardSlot *guard_slot_of(const void *address){
+
+    size_t page = (size_t)((const char *)address - guard_pool) / guard_page;
+
+    if (page == 0){
+        return NULL;
+    }
+
+    return &guard_slots[(page - 1) / 2];
+
+}
+
+
+
+/*
+ * Reports are made from the SIGSEGV handler, where snprintf() may not be called, so their lines are put together by hand
+ * in a GuardLine on the stack and written with write().
+ */
+
+typedef struct guard_line_type{
+    char text[256];//line so far, not terminated
+
+    size_t length;//characters in text
+
+}GuardLine;
+
+
+
+/**
+ * guard_put_text() - appends a string to a report line
+ * 
+ * GuardLine *line: line to append to
+ * 
+ * const char *text: string to append, cut off when the line is full
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Async-signal-safe.
+ * 
+ *           
+ */
+static void guard_put_text(GuardLine *line, const char *text){
+
+    while (*text != '\0' && line->length < sizeof(line->text)){
+        line->text[line->length++] = *text++;
+    }
+
+    return;
+
+}
+
+
+
+/**
+ * guard_put_number() - appends a number to a report line
+ * 
+ * GuardLine *line: line to append to
+ * 
+ * size_t value: number to append
+ * 
+ * unsigned int base: 10, or 16 for a "0x" prefixed address
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Async-signal-safe.
+ * 
+ *           
+ */
+static void guard_put_number(GuardLine *line, size_t value, unsigned int base){
+
+    char digits[sizeof(size_t) * 3 + 1];
+    int count = 0;
+
+    do{
+        digits[count++] = "0123456789abcdef"[value % base];
+        value /= base;
+    }while (value != 0);
+
+    if (base == 16){
+        guard_put_text(line, "0x");
+    }
+    while (count > 0 && line->length < sizeof(line->text)){
+        line->text[line->length++] = digits[--count];
+    }
+
+    return;
+
+}
+
+
+
+/**
+ * guard_print_stack() - prints one stack trace of a slot
+ * 
+ * const char *title: what the stack trace is of
+ * 
+ * long thread: thread id it was taken in
+ * 
+ * void *const *stack: return addresses
+ * 
+ * int depth: number of return addresses
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Only uses write() and backtrace_symbols_fd(), which does not allocate, so it can run in the SIGSEGV
+ * handler.
+ * 
+ *           
+ */
+static void guard_print_stack(const char *title, long thread, void *const *stack, int depth){
+
+    GuardLine line = {.length = 0};
+    guard_put_text(&line, title);
+    guard_put_text(&line, " by thread ");
+    guard_put_number(&line, (size_t)thread, 10);
+    guard_put_text(&line, ":\n");
+    if (write(STDERR_FILENO, line.text, line.length) < 0){
+        return;
+    }
+
+    backtrace_symbols_fd(stack, depth, STDERR_FILENO);
+
+    return;
+
+}
+
+
+
+/**
+ * guard_report() - prints a memory error found in the pool
+ * 
+ * const char *what: kind of error
+ * 
+ * const void *address: address that was accessed or freed
+ * 
+ * GuardSlot *slot: slot the address belongs to, NULL if none
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Prints where the address lies relative to the slot's allocation, the current stack trace, and the
+ * allocation and free stack traces of the slot. The current stack trace comes from backtrace(), which POSIX does not list
+ * as async-signal-safe but which glibc only makes unsafe on its first call, when it loads the unwinder. guard_setup()
+ * makes that call, so the report can be printed from the SIGSEGV handler.
+ * 
+ *           
+ */
+static void guard_report(const char *what, const void *address, GuardSlot *slot){
+
+    GuardLine line = {.length = 0};
+    guard_put_text(&line, "\nguarded heap: ");
+    guard_put_text(&line, what);
+    guard_put_text(&line, " at ");
+    guard_put_number(&line, (size_t)address, 16);
+
+    if (slot == NULL || slot->state == GUARD_UNUSED){
+        guard_put_text(&line, ", not near any allocation\n");
+    }
+    else{
+        const char *position;
+        size_t distance;
+        if ((const char *)address >= (const char *)slot->ptr + slot->size){
+            position = " bytes past the end of the ";
+            distance = (size_t)((const char *)address - (const char *)slot->ptr - slot->size);
+        }
+        else if ((const char *)address < (const char *)slot->ptr){
+            position = " bytes before the ";
+            distance = (size_t)((const char *)slot->ptr - (const char *)address);
+        }
+        else{
+            position = " bytes into the ";
+            distance = (size_t)((const char *)address - (const char *)slot->ptr);
+        }
+        guard_put_text(&line, ", ");
+        guard_put_number(&line, distance, 10);
+        guard_put_text(&line, position);
+        guard_put_number(&line, slot->size, 10);
+        guard_put_text(&line, "-byte allocation ");
+        guard_put_number(&line, (size_t)slot->ptr, 16);
+        guard_put_text(&line, "\n");
+    }
+    if (write(STDERR_FILENO, line.text, line.length) < 0){
+        return;
+    }
+
+    void *stack[GUARD_STACK_DEPTH];
+    guard_print_stack("Detected", (long)syscall(SYS_gettid), stack, backtrace(stack, GUARD_STACK_DEPTH));
+
+    if (slot != NULL && slot->state != GUARD_UNUSED){
+        guard_print_stack("Allocated", slot->alloc_thread, slot->alloc_stack, slot->alloc_depth);
+    }
+    if (slot != NULL && slot->state == GUARD_FREED){
+        guard_print_stack("Freed", slot->free_thread, slot->free_stack, slot->free_depth);
+    }
+
+    return;
+
+}
+
+
+
+/**
+ * guard_fault() - SIGSEGV handler that reports faults inside the pool
+ * 
+ * int signal: SIGSEGV
+ * 
+ * siginfo_t *info: holds the faulting address
+ * 
+ * void *context: passed on to the previous handler
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: A fault on a guard page is reported as an overflow of the slot in front of it, a fault on a freed slot as
+ * a use after free. The previous action is then put back and the handler returns, so the access faults again and ends
+ * the program or reaches the program's own handler. Faults outside the pool are none of the pool's business and are
+ * passed to the previous handler while this one stays installed, so a program that recovers from its own faults keeps
+ * guarded reporting. If there was no previous handler the default action is put back and the signal raised again, which
+ * is delivered as soon as this handler returns.
+ * 
+ *           
+ */
+static void guard_fault(int signal, siginfo_t *info, void *context){
+
+    if (guard_owns(info->si_addr)){
+        size_t page = (size_t)((char *)info->si_addr - guard_pool) / guard_page;
+        guard_report((page % 2 == 0) ? "heap-buffer-overflow" : "heap-use-after-free", info->si_addr, guard_slot_of(info->si_addr));
+        sigaction(SIGSEGV, &guard_old_action, NULL);
+        return;
+    }
+
+    if (guard_old_action.sa_flags & SA_SIGINFO){
+        guard_old_action.sa_sigaction(signal, info, context);
+    }
+    else if (guard_old_action.sa_handler != SIG_DFL && guard_old_action.sa_handler != SIG_IGN){
+        guard_old_action.sa_handler(signal);
+    }
+    else{
+        struct sigaction fallback;
+        memset(&fallback, 0, sizeof(fallback));
+        fallback.sa_handler = SIG_DFL;
+        sigemptyset(&fallback.sa_mask);
+        sigaction(SIGSEGV, &fallback, NULL);
+        raise(SIGSEGV);
+    }
+
+    return;
+
+}
+
+
+
+/**
+ * guard_setup() - reserves the pool and installs the SIGSEGV handler
+ * 
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Part of allocator_setup() when MY_MALLOC_GUARD is set. The whole pool starts as PROT_NONE and data pages
+ * are only made accessible while they hold an allocation. backtrace() is called once here, since its first call loads
+ * the unwinder, which is not safe to do from a signal handler.
+ * 
+ *           
+ */
+static void guard_setup(void){
+
+    const char *env = getenv("MY_MALLOC_GUARD");
+    unsigned long rate = strtoul(env, NULL, 10);
+    guard_rate = (rate != 0 && rate <= UINT32_MAX) ? (unsigned int)rate : GUARD_DEFAULT_RATE;
+
+    guard_page = (size_t)sysconf(_SC_PAGESIZE);
+    void *pool = mmap(NULL, (2 * GUARD_SLOTS + 1) * guard_page, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (pool == MAP_FAILED){
+        perror("mmap error");
+        return;
+    }
+
+    void *stack[1];
+    backtrace(stack, 1);
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = guard_fault;
+    action.sa_flags = SA_SIGINFO | SA_ONSTACK;
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGSEGV, &action, &guard_old_action);
+
+    guard_pool = pool;
+    guard_enabled = 1;
+
+    return;
+
+}
+
+
+
+/**
+ * guard_alloc() - places an allocation before a guard page
+ * 
+ * size_t size: requested size in bytes
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Takes a slot that was never used, or the least recently freed one, makes its page accessible and puts the
+ * allocation behind a Block header of arena ARENA_GUARDED at the end of the page, so my_free(), my_realloc(), the tags
+ * and the callsites treat it like any block. Returns NULL if the allocation and its header do not fit in a page or every
+ * slot is in use, and the caller allocates from the heap instead.
+ * 
+ *           
+ */
+static void *guard_alloc(size_t size){
+
+    size_t aligned_size = ALIGN(size);
+    if (aligned_size == 0 || aligned_size + sizeof(Block) > guard_page){
+        __atomic_add_fetch(&guard_misses, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    lock_acquire(&guard_lock);
+    GuardSlot *slot = NULL;
+    if (guard_unused < GUARD_SLOTS){
+        slot = &guard_slots[guard_unused++];
+    }
+    else if (guard_quarantine != NULL){
+        slot = guard_quarantine;
+        guard_quarantine = slot->next;
+        if (guard_quarantine == NULL){
+            guard_quarantine_last = NULL;
+        }
+    }
+    if (slot == NULL){
+        lock_release(&guard_lock);
+        __atomic_add_fetch(&guard_misses, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    char *page = guard_pool + (2 * (size_t)(slot - guard_slots) + 1) * guard_page;
+    mprotect(page, guard_page, PROT_READ | PROT_WRITE);
+
+    Block *block = (Block *)(page + guard_page - aligned_size) - 1;
+    block->size = aligned_size;
+    block->free = 0;
+    block->arena = ARENA_GUARDED;
+    block->site = CALLSITE_UNTRACKED;
+    block->tag = TAG_UNTRACKED;
+    block_set_next(block, NULL);
+    block_set_prev(block, NULL);
+
+    slot->state = GUARD_LIVE;
+    slot->size = size;
+    slot->ptr = block + 1;
+    slot->alloc_thread = (long)syscall(SYS_gettid);
+    slot->alloc_depth = backtrace(slot->alloc_stack, GUARD_STACK_DEPTH);
+    slot->free_depth = 0;
+    slot->next = NULL;
+    guard_allocations++;
+    guard_live++;
+    lock_release(&guard_lock);
+
+    return block + 1;
+
+}
+
+
+
+/**
+ * guard_check_free() - stops a bad free of a pool pointer before anything reads its header
+ * 
+ * void *ptr: pointer passed to my_free() that lies in the pool
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: A freed slot is PROT_NONE, so reading its header would fault, and a pointer that is not the start of a
+ * live allocation has no header at all. Both are reported with the slot's stack traces and end the program with abort().
+ * 
+ *           
+ */
+static void guard_check_free(void *ptr){
+
+    GuardSlot *slot = guard_slot_of(ptr);
+
+    if (slot != NULL && slot->state == GUARD_LIVE && slot->ptr == ptr){
+        return;
+    }
+
+    guard_report((slot != NULL && slot->state == GUARD_FREED && slot->ptr == ptr) ? "double-free" : "invalid-free", ptr, slot);
+    abort();
+
+}
+
+
+
+/**
+ * guard_free() - frees an allocation of the pool
+ * 
+ * Block *block: header of the allocation, already checked by guard_check_free()
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Called by my_free() for blocks of arena ARENA_GUARDED. Records the free stack trace, hands the page back
+ * and makes it PROT_NONE, then puts the slot at the end of the quarantine.
+ * 
+ *           
+ */
+static void guard_free(Block *block){
+
+    GuardSlot *slot = guard_slot_of(block + 1);
+    char *page = guard_pool + (2 * (size_t)(slot - guard_slots) + 1) * guard_page;
+
+    lock_acquire(&guard_lock);
+    slot->free_thread = (long)syscall(SYS_gettid);
+    slot->free_depth = backtrace(slot->free_stack, GUARD_STACK_DEPTH);
+    slot->state = GUARD_FREED;
+    madvise(page, guard_page, MADV_DONTNEED);
+    mprotect(page, guard_page, PROT_NONE);
+
+    if (guard_quarantine_last != NULL){
+        guard_quarantine_last->next = slot;
+    }
+    else{
+        guard_quarantine = slot;
+    }
+    guard_quarantine_last = slot;
+    guard_live--;
+    lock_release(&guard_lock);
+
+    return;
+
+}
+
+
+
+/*
+ * ---------------------------------------------------------------------------------------------
+ * Sealed stream buffers
+ * ---------------------------------------------------------------------------------------------
+ * A sealed stream buffer has a mapping of its own and is on no arena list, so the headers of the sealed buffers that are
+ * not freed yet are kept in an open addressing set for heap snapshots to find. my_stream_seal() adds a buffer and
+ * stream_unmap() takes it out again.
+ */
+
+static AllocLock stream_lock = ALLOC_LOCK_INITIALIZER;//protects the sealed buffer set, never held while another lock is taken
+
+static Block **stream_sealed = NULL;//headers of the sealed buffers not freed yet, NULL for an empty entry
+
+static size_t stream_sealed_capacity = 0;//entries of stream_sealed, a power of two
+
+static size_t stream_sealed_entries = 0;//headers in stream_sealed
+
+
+
+/**
+ * stream_sealed_home() - finds the entry of the sealed buffer set a header belongs in
+ * 
+ * Block *block: header of a sealed buffer
+ * 
+ * size_t capacity: entries of the set, a power of two
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Every header starts a page, so the page number is hashed. Returns the index to start probing at.
+ * 
+ *           
+ */
+static inline size_t stream_sealed_home(Block *block, size_t capacity){
+
+    return (size_t)((((uint64_t)(uintptr_t)block >> 12) * 0x9E3779B97F4A7C15ULL) >> 32) & (capacity - 1);
+
+}
+
+
+
+/**
+ * stream_register() - adds a sealed buffer to the sealed buffer set
+ * 
+ * Block *block: header of the buffer
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: The set is kept at most half full and doubles with mmap() when it would not be. If that fails the buffer
+ * is simply left out, it then only misses from heap snapshots.
+ * 
+ *           
+ */
+static void stream_register(Block *block){
+
+    lock_acquire(&stream_lock);
+
+    if ((stream_sealed_entries + 1) * 2 > stream_sealed_capacity){
+        size_t capacity = (stream_sealed_capacity == 0) ? 64 : stream_sealed_capacity * 2;
+        Block **table = mmap(NULL, capacity * sizeof(Block *), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (table == MAP_FAILED){
+            lock_release(&stream_lock);
+            return;
+        }
+        for (size_t i = 0; i < stream_sealed_capacity; i++){
+            if (stream_sealed[i] != NULL){
+                size_t j = stream_sealed_home(stream_sealed[i], capacity);
+                while (table[j] != NULL){
+                    j = (j + 1) & (capacity - 1);
+                }
+                table[j] = stream_sealed[i];
+            }
+        }
+        if (stream_sealed != NULL){
+            munmap(stream_sealed, stream_sealed_capacity * sizeof(Block *));
+        }
+        stream_sealed = table;
+        stream_sealed_capacity = capacity;
+    }
+
+    size_t i = stream_sealed_home(block, stream_sealed_capacity);
+    while (stream_sealed[i] != NULL){
+        i = (i + 1) & (stream_sealed_capacity - 1);
+    }
+    stream_sealed[i] = block;
+    stream_sealed_entries++;
+
+    lock_release(&stream_lock);
+
+    return;
+
+}
+
+
+
+/**
+ * stream_unregister() - takes a sealed buffer out of the sealed buffer set
+ * 
+ * Block *block: header of the buffer
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: The headers after it that probed past its entry are shifted back, so the set never needs deleted
+ * markers. Does nothing if the buffer is not in the set.
+ * 
+ *           
+ */
+static void stream_unregister(Block *block){
+
+    lock_acquire(&stream_lock);
+
+    size_t mask = stream_sealed_capacity - 1;
+    size_t i = (stream_sealed_capacity == 0) ? 0 : stream_sealed_home(block, stream_sealed_capacity);
+    while (stream_sealed_capacity != 0 && stream_sealed[i] != NULL && stream_sealed[i] != block){
+        i = (i + 1) & mask;
+    }
+    if (stream_sealed_capacity == 0 || stream_sealed[i] == NULL){
+        lock_release(&stream_lock);
+        return;
+    }
+
+    for (size_t j = (i + 1) & mask; stream_sealed[j] != NULL; j = (j + 1) & mask){
+        //an entry moves into the hole unless its home lies cyclically after the hole and at or before the entry
+        size_t home = stream_sealed_home(stream_sealed[j], stream_sealed_capacity);
+        if (((j - home) & mask) >= ((j - i) & mask)){
+            stream_sealed[i] = stream_sealed[j];
+            i = j;
+        }
+    }
+    stream_sealed[i] = NULL;
+    stream_sealed_entries--;
+
+    lock_release(&stream_lock);
+
+    return;
+
+}
+
+
+
+/*
+ * ---------------------------------------------------------------------------------------------
+ * Initialization and fork safety
+ * ---------------------------------------------------------------------------------------------
+ * Locks are always taken in the same order: epoch_lock, then handle_lock, then arena locks by index, then transfer cache
+ * locks by index, then slab class locks by index, then slab_region_lock, then callsite_lock, then lifetime_lock, then
+ * guard_lock, then stream_lock. A transfer cache lock is never held while a class lock is taken, and callsite_lock,
+ * lifetime_lock, guard_lock and stream_lock are never held while another lock is taken. allocator_lock_all() takes
+ * every lock in this order, which gives the heap checker and the statistics a stable view of the heap and lets fork()
+ * happen while no other thread is inside the allocator.
+ * Without it a child forked while another thread held an arena lock would inherit that lock locked forever.
+ */
+
+static pthread_once_t allocator_once = PTHREAD_ONCE_INIT;
+
+
+
+/**
+ * slab_lock_all() - takes every slab lock
+ * 
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Locks every transfer cache, every slab class and then the slab region, so every run and every batch can be
+ * read while the arenas stay usable.
+ * 
+ *           
+ */
+static void slab_lock_all(void){
+
+    for (int i = 0; i < SLAB_MAX_CLASSES; i++){
+        lock_acquire(&transfer_caches[i].lock);
+    }
+
+    for (int i = 0; i < SLAB_MAX_CLASSES; i++){
+        lock_acquire(&slab_classes[i].lock);
+    }
+
+    lock_acquire(&slab_region_lock);
+
+    return;
+
+}
+
+
+
+/**
+ * slab_unlock_all() - releases every lock taken by slab_lock_all()
+ * 
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Unlocks in the reverse order.
+ * 
+ *           
+ */
+static void slab_unlock_all(void){
+
+    lock_release(&slab_region_lock);
+
+    for (int i = SLAB_MAX_CLASSES - 1; i >= 0; i--){
+        lock_release(&slab_classes[i].lock);
+    }
+
+    for (int i = SLAB_MAX_CLASSES - 1; i >= 0; i--){
+        lock_release(&transfer_caches[i].lock);
+    }
+
+    return;
+
+}
+
+
+
+/**
+ * allocator_lock_all() - takes every lock of the allocator
+ * 
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Locks the epoch lists, the handle table, every arena, then every slab lock, then the callsite table, the
+ * lifetime chunks, the guarded pool and the sealed stream buffers, in lock order. Also used as the pthread_atfork()
+ * prepare handler so no lock is held by another thread at the moment of the fork.
+ * 
+ *           
+ */
+static void allocator_lock_all(void){
+
+    lock_acquire(&epoch_lock);
+
+    lock_acquire(&handle_lock);
+
+    for (int i = 0; i < ARENA_COUNT; i++){
+        lock_acquire(&arenas[i].lock);
+    }
+
+    slab_lock_all();
+
+    lock_acquire(&callsite_lock);
+
+    lock_acquire(&lifetime_lock);
+
+    lock_acquire(&guard_lock);
+
+    lock_acquire(&stream_lock);
+
+    return;
+
+}
+
+
+
+/**
+ * allocator_unlock_all() - releases every lock taken by allocator_lock_all()
+ * 
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Unlocks in the reverse order. Also used as the pthread_atfork() parent handler.
+ * 
+ *           
+ */
+static void allocator_unlock_all(void){
+
+    lock_release(&stream_lock);
+
+    lock_release(&guard_lock);
+
+    lock_release(&lifetime_lock);
+
+    lock_release(&callsite_lock);
+
+    slab_unlock_all();
+
+    for (int i = ARENA_COUNT - 1; i >= 0; i--){
+        lock_release(&arenas[i].lock);
+    }
+
+    lock_release(&handle_lock);
+
+    lock_release(&epoch_lock);
+
+    return;
+
+}
+
+
+
+/**
+ * thread_exit() - hands back what an exiting thread holds in the allocator
+ * 
+ * void *value: the thread's thread_exit_key value, unused
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Destructor of thread_exit_key, run by pthreads when a thread that used the allocator exits. Every slot of
+ * the thread's cache goes back to its size class, the thread's budget goes back to the unclaimed part of the cap and its
+ * entry of thread_budgets[] is freed for the next thread, and the thread stops owning its arena so the arena can be handed
+ * to a new thread. Its pending tag counts are flushed, its epoch record is released and its retired memory is left to
+ * whichever thread reclaims next. If a later destructor allocates again the thread simply registers again.
+ * 
+ *           
+ */
+static void thread_exit(void *value){
+
+    (void)value;
+    ThreadCache *tc = &thread_cache;
+
+    if (tc->budget != NULL){
+        for (unsigned int i = 0; i < slab_class_count; i++){
+            thread_cache_release(i, tc->bins[i].count);
+        }
+
+        size_t budget = __atomic_exchange_n(tc->budget, 0, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&thread_budget_unclaimed, budget, __ATOMIC_RELAXED);
+        if (tc->slot >= 0){
+            __atomic_store_n(&thread_budget_owned[tc->slot], 0, __ATOMIC_RELEASE);
+        }
+
+        memset(tc, 0, sizeof(*tc));
+        tc->slot = -1;
+    }
+
+    if (thread_arena != NULL){
+        __atomic_sub_fetch(&thread_arena->owners, 1, __ATOMIC_RELAXED);
+        thread_arena = NULL;
+    }
+
+    callsite_detach();
+
+    tag_detach();
+
+    epoch_detach();
+
+    lifetime_detach();
+
+    thread_exit_registered = 0;
+
+    return;
+
+}
+
+
+
+/**
+ * allocator_fork_child() - resets the allocator's locks in a freshly forked child
+ * 
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: The child only has the thread that called fork(), which took every lock in the prepare handler, so every
+ * lock is initialized again as unlocked. The heap itself was consistent at the moment of the fork and is kept as is.
+ * The forking thread's cache was copied with it and stays valid, the caches of the other threads do not exist in the
+ * child, so their slots simply stay marked as in use, their cache budgets go back to the unclaimed part of the cap and
+ * their arenas are left without owners.
+ * 
+ *           
+ */
+static void allocator_fork_child(void){
+
+    for (int i = 0; i < ARENA_COUNT; i++){
+        lock_reset(&arenas[i].lock);
+    }
+
+    for (int i = 0; i < SLAB_MAX_CLASSES; i++){
+        lock_reset(&transfer_caches[i].lock);
+        lock_reset(&slab_classes[i].lock);
+    }
+
+    for (int i = 0; i < THREAD_CACHE_SLOTS; i++){
+        if (thread_budget_owned[i] && i != thread_cache.slot){
+            thread_budget_unclaimed += thread_budgets[i];
+            thread_budgets[i] = 0;
+            thread_budget_owned[i] = 0;
+        }
+    }
+
+    //only the forking thread owns an arena now
+    for (int i = 0; i < ARENA_COUNT; i++){
+        arenas[i].owners = 0;
+    }
+    if (thread_arena != NULL){
+        thread_arena->owners = 1;
+    }
+
+    lock_reset(&slab_region_lock);
+
+    lock_reset(&callsite_lock);
+
+    lock_reset(&handle_lock);
+
+    //threads that do not exist in the child cannot hold the epoch back, their retired memory stays allocated
+    for (int i = 0; i < EPOCH_THREADS; i++){
+        if (i != epoch_slot){
+            epoch_records[i].active = 0;
+            epoch_records[i].used = 0;
+        }
+    }
+
+    lock_reset(&epoch_lock);
+
+    //chunks the other threads were allocating from keep their reference and are never reset in the child
+    lock_reset(&lifetime_lock);
+
+    lock_reset(&guard_lock);
+
+    lock_reset(&stream_lock);
+
+    return;
+
+}
+
+
+
+/**
+ * allocator_setup() - one time setup of the allocator
+ * 
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Reserves the slab region, picks the double free mark of the thread caches, creates the key whose destructor
+ * cleans up after exiting threads, picks the heap limit, applies glibc's MALLOC_*_ settings, reserves the guarded pool when
+ * asked to and registers the fork handlers. Runs once, from the first
+ * allocation of any thread.
+ * 
+ *           
+ */
+static void allocator_setup(void){
+
+    slab_init();
+
+    //any value that user data is unlikely to hold in its second word will do
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    thread_cache_key = ((uintptr_t)&thread_cache_key * 0x9E3779B97F4A7C15ULL) ^ (uintptr_t)now.tv_nsec;
+
+    pthread_key_create(&thread_exit_key, thread_exit);
+
+    limit_setup();
+
+    mallopt_setup();
+
+    //the shadow only gets backed for the runs that are actually used
+    if (getenv("MY_MALLOC_CALLSITES") != NULL && slab_base != NULL){
+        void *shadow = mmap(NULL, SLAB_REGION_SIZE / ALIGNMENT * sizeof(unsigned short), PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (shadow != MAP_FAILED){
+            callsite_shadow = shadow;
+            callsite_enabled = 1;
+        }
+    }
+    if (getenv("MY_MALLOC_TAGS") != NULL && slab_base != NULL){
+        void *shadow = mmap(NULL, SLAB_REGION_SIZE / ALIGNMENT * sizeof(unsigned short), PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (shadow != MAP_FAILED){
+            tag_shadow = shadow;
+            tag_enabled = 1;
+        }
+    }
+
+    lifetime_enabled = (getenv("MY_MALLOC_LIFETIME") != NULL);
+
+    if (getenv("MY_MALLOC_GUARD") != NULL){
+        guard_setup();
+    }
+
+    pthread_atfork(allocator_lock_all, allocator_unlock_all, allocator_fork_child);
+
+    return;
+
+}
+
+
+
+/**
+ * allocator_init() - makes sure the allocator is set up before it is used
+ * 
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Runs allocator_setup() exactly once no matter how many threads race to allocate first.
+ * 
+ *           
+ */
+static inline void allocator_init(void){
+    pthread_once(&allocator_once, allocator_setup);
+}
+
+
+
+/*
+ * ---------------------------------------------------------------------------------------------
+ * Allocation size telemetry
+ * ---------------------------------------------------------------------------------------------
+ * Every size requested through my_malloc(), my_calloc() and my_realloc() is counted in a log-linear histogram:
+ * sizes below 2^SIZE_HISTOGRAM_SUB_BITS get a bucket each, and every power of two above that is split into
+ * 2^SIZE_HISTOGRAM_SUB_BITS equal buckets, so the relative error of a bucket never goes above 1/16.
+ */
+
+#define SIZE_HISTOGRAM_SUB_BITS 4//every power of two is split into 16 buckets
+
+#define SIZE_HISTOGRAM_SUB_COUNT (1 << SIZE_HISTOGRAM_SUB_BITS)
+
+#define SIZE_HISTOGRAM_BUCKETS ((64 - SIZE_HISTOGRAM_SUB_BITS + 1) * SIZE_HISTOGRAM_SUB_COUNT)//enough buckets for any size_t
+
+static size_t size_histogram[SIZE_HISTOGRAM_BUCKETS];//number of requests per bucket
+
+
+
+/**
+ * size_histogram_index() - finds the histogram bucket of a requested size
+ * 
+ * size_t size: requested size in bytes
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Sizes below SIZE_HISTOGRAM_SUB_COUNT map to themselves. Larger sizes use their highest set bit to pick the
+ * power of two and the SIZE_HISTOGRAM_SUB_BITS bits below it to pick the bucket inside it.
+ * 
+ *           
+ */
+static inline unsigned int size_histogram_index(size_t size){
+
+    if (size < SIZE_HISTOGRAM_SUB_COUNT){
+        return (unsigned int)size;
+    }
+
+    unsigned int exponent = 63 - (unsigned int)__builtin_clzll(size);
+    unsigned int sub = (unsigned int)(size >> (exponent - SIZE_HISTOGRAM_SUB_BITS)) & (SIZE_HISTOGRAM_SUB_COUNT - 1);
+
+    return (exponent - SIZE_HISTOGRAM_SUB_BITS + 1) * SIZE_HISTOGRAM_SUB_COUNT + sub;
+
+}
+
+
+
+/**
+ * size_histogram_lower() - returns the smallest size that falls in a histogram bucket
+ * 
+ * unsigned int index: histogram bucket
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Inverse of size_histogram_index(), the bucket covers sizes from this value up to the lower bound of the next bucket minus 1.
+ * 
+ *           
+ */
+static size_t size_histogram_lower(unsigned int index){
+
+    if (index < SIZE_HISTOGRAM_SUB_COUNT){
+        return index;
+    }
+
+    unsigned int exponent = index / SIZE_HISTOGRAM_SUB_COUNT + SIZE_HISTOGRAM_SUB_BITS - 1;
+    size_t sub = index % SIZE_HISTOGRAM_SUB_COUNT;
+
+    return (SIZE_HISTOGRAM_SUB_COUNT + sub) << (exponent - SIZE_HISTOGRAM_SUB_BITS);
+
+}
+
+
+
+/**
+ * size_histogram_record() - counts one requested size
+ * 
+ * size_t size: requested size in bytes
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Adds one to the histogram bucket of the size, atomically since any thread may be allocating.
+ * 
+ *           
+ */
+static inline void size_histogram_record(size_t size){
+    __atomic_fetch_add(&size_histogram[size_histogram_index(size)], 1, __ATOMIC_RELAXED);
+}
+
+
+
+/**
+ * my_malloc_dump_size_histogram() - writes the requested size histogram
+ * 
+ * FILE *out: stream to write to
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Writes one "<lower> <upper> <count>" line per non-empty bucket, in increasing size order. The output can be
+ * given to "my_malloc tune-classes" to derive a size class table for the workload that produced it.
+ * 
+ *           
+ */
+void my_malloc_dump_size_histogram(FILE *out){
+
+    fprintf(out, "# lower upper count\n");
+
+    for (unsigned int i = 0; i < SIZE_HISTOGRAM_BUCKETS; i++){
+        if (size_histogram[i] == 0){
+            continue;
+        }
+        size_t upper = (i + 1 < SIZE_HISTOGRAM_BUCKETS) ? size_histogram_lower(i + 1) - 1 : SIZE_MAX;
+        fprintf(out, "%zu %zu %zu\n", size_histogram_lower(i), upper, size_histogram[i]);
+    }
+
+    return;
+
+}
+
+
+
+/*
+ * ---------------------------------------------------------------------------------------------
+ * Heap consistency checking
+ * ---------------------------------------------------------------------------------------------
+ * my_malloc_check() walks every structure of the allocator and reports anything that breaks its invariants. Builds made
+ * with -DMY_MALLOC_DEBUG also run it every MY_MALLOC_CHECK_INTERVAL calls to my_malloc() and my_free() and abort on the
+ * first problem, so changes to the fast paths fail close to the operation that broke the heap.
+ */
+
+#ifndef MY_MALLOC_CHECK_INTERVAL
+#define MY_MALLOC_CHECK_INTERVAL 1024//my_malloc() and my_free() calls between two checks in debug builds
+#endif
+
+
+
+/**
+ * check_blocks() - checks the invariants of an arena's Block list
+ * 
+ * Arena *arena: arena to check
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Checks that prev and next agree, that blocks appear in increasing address order without overlapping, that
+ * no two free blocks touching in memory were left unmerged, that every block records this arena, that last is the end of
+ * the list and that the blocks add up to every byte the arena received from the OS. Returns the number of problems found.
+ * 
+ *           
+ */
+static int check_blocks(Arena *arena){
+
+    int problems = 0;
+    size_t bytes = 0, blocks = 0;
+    size_t max_blocks = arena->os_bytes / sizeof(Block) + 1;//more blocks than this means the list loops
+    Block *head = arena->head;
+
+    if (head != NULL && block_prev(head) != NULL){
+        fprintf(stderr,"heap check: head %p has a prev block\n", (void *)head);
+        problems++;
+    }
+
+    Block *current = head, *previous = NULL;
+    while (current != NULL){
+
+        if (++blocks > max_blocks){
+            fprintf(stderr,"heap check: block list loops\n");
+            return problems + 1;
+        }
+
+        if (current->free != 0 && current->free != 1){
+            fprintf(stderr,"heap check: block %p has free = %u\n", (void *)current, current->free);
+            problems++;
+        }
+
+        if (&arenas[current->arena] != arena){
+            fprintf(stderr,"heap check: block %p records arena %u but is in arena %ld\n", (void *)current, current->arena, (long)(arena - arenas));
+            problems++;
+        }
+
+        if (current->size % ALIGNMENT != 0){
+            fprintf(stderr,"heap check: block %p has unaligned size %zu\n", (void *)current, current->size);
+            problems++;
+        }
+
+        if (block_prev(current) != previous){
+            fprintf(stderr,"heap check: block %p prev is %p, expected %p\n", (void *)current, (void *)block_prev(current), (void *)previous);
+            problems++;
+        }
+
+        Block *next = block_next(current);
+        if (next != NULL){
+            char *end = (char *)(current + 1) + current->size;
+            if ((char *)next < end){
+                fprintf(stderr,"heap check: block %p overlaps or comes after next block %p\n", (void *)current, (void *)next);
+                problems++;
+            }
+            else if ((char *)next == end && current->free == 1 && next->free == 1){
+                fprintf(stderr,"heap check: adjacent free blocks %p and %p were not merged\n", (void *)current, (void *)next);
+                problems++;
+            }
+        }
+
+        bytes += sizeof(Block) + current->size;
+        previous = current;
+        current = next;
+
+    }
+
+    if (arena->last != previous){
+        fprintf(stderr,"heap check: last is %p but the list ends at %p\n", (void *)arena->last, (void *)previous);
+        problems++;
+    }
+
+    if (bytes != arena->os_bytes){
+        fprintf(stderr,"heap check: blocks cover %zu bytes but the OS provided %zu\n", bytes, arena->os_bytes);
+        problems++;
+    }
+
+    return problems;
+
+}
+
+
+
+/**
+ * check_run() - checks that a run's bitmap agrees with its counters
+ * 
+ * Run *run: run to check
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Counts the set bits of the bitmap and compares them with the run's free slot count, and checks that no bit
+ * past the last slot is set. Returns the number of problems found.
+ * 
+ *           
+ */
+static int check_run(Run *run){
+
+    int problems = 0;
+    size_t free_bits = 0;
+
+    for (unsigned int w = 0; w < RUN_BITMAP_WORDS; w++){
+        free_bits += (size_t)__builtin_popcountll(run->bitmap[w]);
+    }
+
+    unsigned int words = (run->total_slots + 63) / 64;
+    uint64_t tail = (run->total_slots % 64 == 0) ? 0 : ~(((uint64_t)1 << (run->total_slots % 64)) - 1);
+    int stray = words > 0 && (run->bitmap[words - 1] & tail) != 0;
+    for (unsigned int w = words; w < RUN_BITMAP_WORDS; w++){
+        stray |= run->bitmap[w] != 0;
+    }
+
+    if (free_bits != run->free_slots || stray){
+        fprintf(stderr,"heap check: run %p has %zu free bits but counts %u free slots\n", (void *)run, free_bits, run->free_slots);
+        problems++;
+    }
+
+    return problems;
+
+}
+
+
+
+/**
+ * check_cached_list() - checks a list of cached slots
+ * 
+ * void *list: slots linked through their first word
+ * 
+ * unsigned int count: number of slots the list should hold
+ * 
+ * unsigned int size_class: size class every slot should belong to
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Every slot of a thread cache or transfer cache batch must be the start of a slot of a run of the right
+ * class, and must be marked in use in the run's bitmap since the runs count it as handed out. Returns the number of
+ * problems found.
+ * 
+ *           
+ */
+static int check_cached_list(void *list, unsigned int count, unsigned int size_class){
+
+    int problems = 0;
+    unsigned int found = 0;
+
+    for (void *ptr = list; ptr != NULL && found <= count; ptr = *(void **)ptr, found++){
+
+        if (!slab_owns(ptr)){
+            fprintf(stderr,"heap check: cached slot %p of class %zu is outside the slab region\n", ptr, slab_class_size[size_class]);
+            return problems + 1;
+        }
+
+        Run *run = slab_run_of(ptr);
+        size_t offset = (size_t)((char *)ptr - run->slots);
+        size_t slot = offset / run->slot_size;
+        if (run->size_class != size_class || (char *)ptr < run->slots || offset % run->slot_size != 0
+                || slot >= run->total_slots || (run->bitmap[slot / 64] >> (slot % 64)) & 1){
+            fprintf(stderr,"heap check: cached slot %p of class %zu is not a used slot of that class\n", ptr, slab_class_size[size_class]);
+            problems++;
+        }
+
+    }
+
+    if (found != count){
+        fprintf(stderr,"heap check: cached list of class %zu holds %u slots but counts %u\n", slab_class_size[size_class], found, count);
+        problems++;
+    }
+
+    return problems;
+
+}
+
+
+
+/**
+ * check_slabs() - checks the invariants of the slab runs and size classes
+ * 
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Checks every run's bitmap, that every run in a fullness bucket belongs to that class and bucket and still has
+ * both used and free slots, that the class counters match the runs found, and that the free run list holds exactly the
+ * empty runs. The batches of every transfer cache and the calling thread's own cache are checked with check_cached_list(),
+ * the caches of other threads cannot be reached. Returns the number of problems found.
+ * 
+ *           
+ */
+static int check_slabs(void){
+
+    int problems = 0;
+    size_t runs[SLAB_MAX_CLASSES] = {0}, used[SLAB_MAX_CLASSES] = {0}, total[SLAB_MAX_CLASSES] = {0};
+    size_t empty_runs = 0;
+
+    //every run of the region, the bitmap is the source of truth for everything else
+    for (char *address = slab_base; address != NULL && address < slab_next_run; address += RUN_SIZE){
+        Run *run = (Run *)address;
+        problems += check_run(run);
+
+        if (run->free_slots == run->total_slots){
+            empty_runs++;
+            continue;
+        }
+
+        runs[run->size_class]++;
+        used[run->size_class] += run->total_slots - run->free_slots;
+        total[run->size_class] += run->total_slots;
+    }
+
+    for (unsigned int i = 0; i < slab_class_count; i++){
+
+        SlabClass *cls = &slab_classes[i];
+
+        for (unsigned int b = 0; b < SLAB_FULLNESS_BUCKETS; b++){
+            Run *previous = NULL;
+            for (Run *run = cls->buckets[b]; run != NULL; run = run->next){
+                if (run->size_class != i || run->bucket != b || run_bucket(run) != b || run->prev != previous
+                        || run->free_slots == 0 || run->free_slots == run->total_slots){
+                    fprintf(stderr,"heap check: run %p is misplaced in bucket %u of class %zu\n", (void *)run, b, slab_class_size[i]);
+                    problems++;
+                }
+                previous = run;
+            }
+        }
+
+        if (cls->runs != runs[i] || cls->used_slots != used[i] || cls->total_slots != total[i]){
+            fprintf(stderr,"heap check: class %zu counts %zu runs and %zu/%zu slots but has %zu runs and %zu/%zu slots\n",
+                    slab_class_size[i], cls->runs, cls->used_slots, cls->total_slots, runs[i], used[i], total[i]);
+            problems++;
+        }
+
+    }
+
+    size_t listed = 0;
+    for (Run *run = slab_free_runs; run != NULL && listed <= empty_runs; run = run->next){
+        if (run->free_slots != run->total_slots){
+            fprintf(stderr,"heap check: run %p on the free run list is in use\n", (void *)run);
+            problems++;
+        }
+        listed++;
+    }
+
+    if (listed != empty_runs || listed != slab_free_run_count){
+        fprintf(stderr,"heap check: %zu empty runs, %zu on the free run list, %zu counted\n", empty_runs, listed, slab_free_run_count);
+        problems++;
+    }
+
+    size_t cached_bytes = 0;
+    for (unsigned int i = 0; i < slab_class_count; i++){
+        TransferCache *tc = &transfer_caches[i];
+        for (unsigned int b = 0; b < tc->used; b++){
+            problems += check_cached_list(tc->batches[b], tc->counts[b], i);
+        }
+        problems += check_cached_list(thread_cache.bins[i].head, thread_cache.bins[i].count, i);
+        cached_bytes += (size_t)thread_cache.bins[i].count * slab_class_size[i];
+    }
+
+    if (cached_bytes != thread_cache.bytes){
+        fprintf(stderr,"heap check: thread cache holds %zu B but counts %zu B\n", cached_bytes, thread_cache.bytes);
+        problems++;
+    }
+
+    return problems;
+
+}
+
+
+
+/**
+ * my_malloc_check() - verifies that the heap is consistent
+ * 
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Runs every check of the arenas and the slab runs while holding every lock of the allocator, printing each
+ * problem to stderr. Returns the number of problems found, 0 when the heap is consistent.
+ * 
+ *           
+ */
+int my_malloc_check(void){
+
+    int problems = 0;
+
+    allocator_lock_all();
+
+    for (int i = 0; i < ARENA_COUNT; i++){
+        problems += check_blocks(&arenas[i]);
+    }
+    problems += check_slabs();
+
+    allocator_unlock_all();
+
+    return problems;
+
+}
+
+
+
+#ifdef MY_MALLOC_DEBUG
+
+static size_t debug_check_ops = 0;//my_malloc() and my_free() calls since the program started
+
+
+
+/**
+ * debug_check() - runs my_malloc_check() every MY_MALLOC_CHECK_INTERVAL calls in debug builds
+ * 
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Aborts the program as soon as a check finds a problem so the failure is reported close to its cause.
+ * 
+ *           
+ */
+static void debug_check(void){
+
+    size_t ops = __atomic_add_fetch(&debug_check_ops, 1, __ATOMIC_RELAXED);
+    if (ops % MY_MALLOC_CHECK_INTERVAL == 0 && my_malloc_check() != 0){
+        fprintf(stderr,"heap check failed after %zu operations\n", ops);
+        abort();
+    }
+
+    return;
+
+}
+
+#define DEBUG_CHECK() debug_check()
+
+#else
+
+#define DEBUG_CHECK() ((void)0)
+
+#endif
+
+
+
+/**
+ * arena_fit() - takes the first free block of an arena that fits a request
+ * 
+ * Arena *arena: arena to search, its lock must be held
+ * 
+ * size_t aligned_size: requested size already aligned with ALIGN()
+ * 
+ * Block *limit: block where the search stops, NULL to search the whole list
+ * -----------------------------------------------------------------------------------  
+ * 
+ * Description: Walks the list first-fit from the head, which is also the lowest address, and splits the block that fits
+ * when the rest is large enough for a block of its own. Only blocks before limit are looked at, which is how compaction
+ * finds a place lower in the arena than a block it wants to move. Returns the payload of the block, or NULL if no free
+ * block fits.
+ * 
+ *           
+ */
+static void *arena_fit(Arena *arena, size_t aligned_size, Block *limit){
+
+    Block *current = arena->head;//Set current as the head block in the linked list
+
+
+    //Continue looping through the linked list until the end of the list, or the limit, has been reached
+    while (current != NULL && current != limit){
+
+        //check if the block is free to use
+        if (current->free == 1 && current->size >= aligned_size){
+            current->free = 0;
+
+            //After checking if the block is free, check if the block can split with a new block being made from the extra space with atleast 8 bytes 
+            if (current->size >= aligned_size + sizeof(Block) + ALIGNMENT){
+                Block *new_block = (Block *)((char *)(current + 1) + aligned_size);//ensuring that the new_block takes up space in the heap that does not effect the current block
+                
+                new_block->size = current->size - aligned_size - sizeof(Block);
+                new_block->free = 1;
+                new_block->arena = current->arena;
+                block_set_prev(new_block, current);
+                block_set_next(new_block, block_next(current));
+                block_set_next(current, new_block);
+                current->size = aligned_size;
+
+                if (block_next(new_block) != NULL){
+                    block_set_prev(block_next(new_block), new_block);
+                }
+                else{
+                    arena->last = new_block;
+                }
+                
+
+            }
+            //return the block with the correct size to the user
+            return (void *)(current + 1);
+        }
+
+        //continue going through each block in the linked list
+        current = block_next(current);
+
+    }
+
+    return NULL;
+
+}
+
+
+
+/**
+ * arena_malloc() - allocates and return a pointer to a memory block of requested size from an arena
+ * 
+ * Arena *arena: arena to allocate from, its lock must be held
+ * 
+ * size_t aligned_size: requested size already aligned with ALIGN()
+ * -----------------------------------------------------------------------------------  
+ * 
+ * Description: Allocates a block that is ensured to have 8-byte alignment. It first searches the arena for a suitable free block
+ * using first-fit strategy with arena_fit(). If none is found, then the function request more space directly from the OS to
+ * expand the heap using arena_grow(). It also manages metadata for managing a doubly linked list to track
+ * all the allocated and free blocks. If any errors occur during this process, NULL is returned to the user.
+ * 
+ *           
+ */
+static void *arena_malloc(Arena *arena, size_t aligned_size){
+
+    void *reused = arena_fit(arena, aligned_size, NULL);
+    if (reused != NULL){
+        return reused;
+    }
+
+    //after looping through the linked list, if none of the previously freed blocks has enough space to be reused, a new block will be created with new memory requested from the OS 
+    //using arena_grow() to add to the heap. This block is returned to the user and is set at the end of the linked list.
+    
+    void *mem_block = arena_grow(arena, aligned_size + sizeof(Block));
+    if (mem_block == NULL){
+        return NULL;
+    }
+
+    Block *allocated_block = (Block *)mem_block;
+
+    allocated_block->free = 0;
+    allocated_block->arena = (unsigned short)(arena - arenas);
+    allocated_block->size = aligned_size;
+    block_set_next(allocated_block, NULL);
+    block_set_prev(allocated_block, NULL);
+
+    //If the block created is the first block in the linked list
+    if (arena->head == NULL){
+        arena->head = allocated_block;
+        arena->last = allocated_block;
+    }
+
+    //Place the block at the end of the linked list if it is not the first block
+    else{
+        block_set_prev(allocated_block, arena->last);
+        block_set_next(arena->last, allocated_block);
+        arena->last = allocated_block;
+    }
+    
+    //the + 1 ensures that the user only recieves space from the heap that is not apart of the meta data, since the + 1 skips past all the bytes that contain the meta data in the memory address.
+    return ((void *)(allocated_block + 1));
+
+}
+
+
+
+/**
+ * heap_alloc() - allocates a block or slot of an aligned size
+ * 
+ * size_t aligned_size: requested size already aligned with ALIGN()
+ * -----------------------------------------------------------------------------------  
+ * 
+ * Description: Serves small sizes from a slab run and everything else from the calling thread's arena while holding its
+ * lock. One attempt only, heap_malloc() decides what to do when it fails. Returns NULL if there is no memory.
+ * 
+ *           
+ */
+static void *heap_alloc(size_t aligned_size){
+
+    //small requests are served from a slab run of their size class
+    if (aligned_size <= SLAB_MAX_SIZE){
+        return thread_cache_alloc(aligned_size);
+    }
+
+    Arena *arena = arena_of_thread();
+
+    lock_acquire(&arena->lock);
+    void *ptr = arena_malloc(arena, aligned_size);
+    lock_release(&arena->lock);
+
+    return ptr;
+
+}
+
+
+
+
+/**
+ * arena_free() - marks a block of an arena reusable and merges it with its free neighbours
+ * 
+ * Arena *arena: arena that holds the block, its lock must be held
+ * 
+ * Block *free_block: header of the block being freed
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Sets the meta data free variable to 1, then checks adjecent nodes if they are also free to merge all free adjecent
+ * data blocks in the doubly linked list into one block to reduce fragmentation.
+ * 
+ *           
+ */
+static void arena_free(Arena *arena, Block *free_block){
+
+    free_block->free = 1;
+
+    //Continue looping through any adjecent blocks that are also free to the given block and combine the size so all adjcent blocks can be treated as one large block.
+    //Blocks are only merged when they touch in memory, sbrk() may have handed out memory to someone else between two blocks of the list.
+    Block *current_fwd = block_next(free_block);
+    while (current_fwd != NULL && current_fwd->free == 1 && block_touches_next(free_block, current_fwd)){
+        free_block->size += (sizeof(Block) + current_fwd->size);
+        current_fwd  = block_next(current_fwd);
+    }
+
+    block_set_next(free_block, current_fwd);
+
+    if (current_fwd != NULL){
+        block_set_prev(current_fwd, free_block);
+    }
+
+
+    //continue looping through blocks adjacent to the given block in the left direction or previous direction, for each adjacent block, update the size to include all free adjacent blocks size in the right direction of the block.
+    //Continue doing this until there is no more free blocks, combining adjacent blocks into one large block for more reusability.
+    Block *current_bck = block_prev(free_block);
+    while (current_bck != NULL && current_bck->free == 1 && block_touches_next(current_bck, free_block)){
+
+        current_bck->size += sizeof(Block)+free_block->size;
+        block_set_next(current_bck, block_next(free_block));
+        
+        if (block_next(free_block) != NULL){
+            block_set_prev(block_next(free_block), current_bck);
+        }
+
+        free_block = current_bck;
+        current_bck = block_prev(current_bck);
+
+    }
+
+    //the merged block may have swallowed the old end of the list
+    if (block_next(free_block) == NULL){
+        arena->last = free_block;
+    }
+
+    return;
+
+}
+
+
+
+
+/**
+ * arena_trim() - hands the free tail of an arena back to the OS
+ * 
+ * Arena *arena: arena to trim, its lock must be held
+ * 
+ * size_t pad: bytes of the free tail to keep, on top of its header
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: When the last block of the arena is free and ends where the arena's memory ends, every whole page of it
+ * past the first pad bytes is given back: arena 0 lowers the program break with sbrk(), as long as nothing else moved it
+ * since, and the other arenas madvise() the pages away and lower region_next so the range is handed out again on the next
+ * growth. The block keeps its header and at least ALIGNMENT bytes. Fires the trim probe and returns the number of bytes
+ * released.
+ * 
+ *           
+ */
+static size_t arena_trim(Arena *arena, size_t pad){
+
+    Block *last = arena->last;
+    if (last == NULL || last->free != 1){
+        return 0;
+    }
+
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    char *end = (char *)(last + 1) + last->size;
+    char *keep = (char *)(((uintptr_t)(last + 1) + (pad > ALIGNMENT ? pad : ALIGNMENT) + page - 1) & ~(uintptr_t)(page - 1));
+    if (keep >= end){
+        return 0;
+    }
+    size_t release = (size_t)(end - keep);
+
+    if (arena == &arenas[0]){
+        if (sbrk(0) != end || sbrk(-(intptr_t)release) == (void *)-1){
+            return 0;
+        }
+    }
+    else{
+        if (end != arena->region_next){
+            return 0;
+        }
+        madvise(keep, release, MADV_DONTNEED);
+        arena->region_next = keep;
+    }
+
+    last->size -= release;
+    arena->os_bytes -= release;
+    limit_uncharge(release);
+
+    MALLOC_PROBE2(trim, (int)(arena - arenas), release);
+
+    return release;
+
+}
+
+
+
+/*
+ * ---------------------------------------------------------------------------------------------
+ * Stream buffers
+ * ---------------------------------------------------------------------------------------------
+ * A buffer that is only ever appended to, like a log line or a serialized message, would normally be grown with
+ * my_realloc(), copying it every time it doubles. A StreamBuffer instead reserves a range of address space with no
+ * access up front and makes pages readable and writable as the buffer reaches them, so the data never moves and a
+ * pointer returned by my_stream_extend() stays valid. my_stream_seal() hands the unused part of the range back and writes
+ * a Block header with arena ARENA_MAPPED in front of the data, which my_free() and my_realloc() recognize. A few freed
+ * buffers keep their mapping, and the next buffer moves one to the front of its range with mremap(), so serializing one
+ * message after another does not fault in and zero fresh pages every time.
+ */
+
+#define STREAM_DEFAULT_RESERVE ((size_t)1 << 30)//range reserved when my_stream_open() is given 0
+
+#define STREAM_COMMIT_BYTES (64 * 1024)//bytes made writable at least each time a buffer runs out of them
+
+#define STREAM_CACHE_SLOTS 4//freed buffer mappings kept to start new buffers with pages that are already backed
+
+#define STREAM_CACHE_MAX_BYTES ((size_t)16 << 20)//larger freed buffers are always unmapped
+
+typedef struct stream_buffer_type{
+    char *base;//start of the reserved range, the Block header of the sealed buffer goes here
+
+    size_t reserved;//bytes reserved, header included
+
+    size_t committed;//bytes from base that are readable and writable
+
+    size_t length;//bytes appended so far
+
+}StreamBuffer;
+
+static size_t stream_open_count = 0;//buffers opened and not sealed yet
+
+static size_t stream_sealed_count = 0;//sealed buffers not freed yet
+
+static size_t stream_committed_bytes = 0;//readable and writable bytes of open and sealed buffers, headers included
+
+static Block *stream_cache[STREAM_CACHE_SLOTS];//mappings of freed buffers, their header still holds their size
+
+static size_t stream_cached_bytes = 0;//bytes of the mappings in stream_cache
+
+static size_t stream_reused = 0;//buffers started on a cached mapping
+
+
+
+/**
+ * stream_unmap() - frees a sealed stream buffer
+ * 
+ * Block *block: header of the sealed buffer
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Called by my_free() for blocks of arena ARENA_MAPPED. The mapping holds nothing else, so it goes to an
+ * empty slot of stream_cache, still charged to the heap limit, or is unmapped as a whole if the cache is full or the
+ * mapping is too large to keep.
+ * 
+ *           
+ */
+static void stream_unmap(Block *block){
+
+    size_t bytes = block->size + sizeof(Block);
+
+    stream_unregister(block);
+
+    __atomic_sub_fetch(&stream_committed_bytes, bytes, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&stream_sealed_count, 1, __ATOMIC_RELAXED);
+
+    if (bytes <= STREAM_CACHE_MAX_BYTES){
+        for (int i = 0; i < STREAM_CACHE_SLOTS; i++){
+            Block *expected = NULL;
+            if (__atomic_compare_exchange_n(&stream_cache[i], &expected, block, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED)){
+                __atomic_add_fetch(&stream_cached_bytes, bytes, __ATOMIC_RELAXED);
+                return;
+            }
+        }
+    }
+
+    limit_uncharge(bytes);
+    munmap(block, bytes);
+
+    return;
+
+}
+
+
+
+/**
+ * stream_cache_take() - takes a mapping out of stream_cache
+ * 
+ * size_t max_bytes: largest mapping the caller can use
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Returns the header at the start of the mapping, whose size tells how large it is, or NULL if no cached
+ * mapping fits.
+ * 
+ *           
+ */
+static Block *stream_cache_take(size_t max_bytes){
+
+    for (int i = 0; i < STREAM_CACHE_SLOTS; i++){
+        Block *block = __atomic_load_n(&stream_cache[i], __ATOMIC_ACQUIRE);
+        if (block != NULL && block->size + sizeof(Block) <= max_bytes
+                && __atomic_compare_exchange_n(&stream_cache[i], &block, NULL, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)){
+            __atomic_sub_fetch(&stream_cached_bytes, block->size + sizeof(Block), __ATOMIC_RELAXED);
+            return block;
+        }
+    }
+
+    return NULL;
+
+}
+
+
+
+/**
+ * stream_cache_release() - unmaps every cached stream buffer mapping
+ * 
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Part of heap_release(). Returns the number of bytes handed back.
+ * 
+ *           
+ */
+static size_t stream_cache_release(void){
+
+    size_t released = 0;
+
+    for (Block *block; (block = stream_cache_take(SIZE_MAX)) != NULL; ){
+        size_t bytes = block->size + sizeof(Block);
+        limit_uncharge(bytes);
+        munmap(block, bytes);
+        released += bytes;
+    }
+
+    return released;
+
+}
+
+
+
+/**
+ * heap_release() - hands the free memory the allocator holds back to the OS
+ * 
+ * size_t pad: bytes of each arena's free tail to keep
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Purges every run on the free run list, including the SLAB_RETAINED_RUNS normally kept backed for reuse,
+ * trims the free tail of every arena, unmaps the cached stream buffers and purges the empty lifetime chunks. Called
+ * when the footprint nears or reaches the limit, and by my_malloc_trim(). Returns the number of bytes handed back.
+ * 
+ *           
+ */
+static size_t heap_release(size_t pad){
+
+    lock_acquire(&slab_region_lock);
+    size_t released = slab_purged_bytes;
+    for (Run *run = slab_free_runs; run != NULL; run = run->next){
+        run_purge(run);
+    }
+    released = slab_purged_bytes - released;
+    lock_release(&slab_region_lock);
+
+    for (int i = 0; i < ARENA_COUNT; i++){
+        lock_acquire(&arenas[i].lock);
+        released += arena_trim(&arenas[i], pad);
+        lock_release(&arenas[i].lock);
+    }
+
+    released += stream_cache_release();
+
+    released += lifetime_release();
+
+    return released;
+
+}
+
+
+
+typedef void (*PressureCallback)(size_t bytes, void *arg);//told how many bytes did not fit, frees what the program can spare
+
+static PressureCallback limit_callback = NULL;//registered with my_malloc_set_pressure_callback(), NULL if none
+
+static void *limit_callback_arg = NULL;//passed back to limit_callback
+
+static __thread int limit_in_callback = 0;//keeps an allocation made by the callback from calling it again
+
+
+
+/**
+ * my_malloc_set_limit() - sets the heap limit
+ * 
+ * size_t bytes: largest number of bytes the heap may hold from the OS, 0 for no limit
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Replaces the limit picked from MY_MALLOC_LIMIT or the cgroup. A limit below the current footprint only
+ * stops the heap from growing, nothing already allocated is taken away.
+ * 
+ *           
+ */
+void my_malloc_set_limit(size_t bytes){
+
+    allocator_init();
+
+    __atomic_store_n(&limit_bytes, bytes, __ATOMIC_RELAXED);
+    __atomic_store_n(&limit_source, (bytes != 0) ? LIMIT_API : LIMIT_NONE, __ATOMIC_RELAXED);
+
+    return;
+
+}
+
+
+
+/**
+ * my_malloc_set_pressure_callback() - registers the function called when an allocation hits the limit
+ * 
+ * PressureCallback callback: function to call, NULL to remove it
+ * 
+ * void *arg: passed to the callback as is
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: The callback runs in the allocating thread with no allocator lock held, after the allocator has handed its
+ * own free memory back and the allocation still does not fit. It should free what the program can spare, such as
+ * caches, with my_free(). The allocation is tried once more when it returns.
+ * 
+ *           
+ */
+void my_malloc_set_pressure_callback(PressureCallback callback, void *arg){
+
+    __atomic_store_n(&limit_callback_arg, arg, __ATOMIC_RELAXED);
+    __atomic_store_n(&limit_callback, callback, __ATOMIC_RELEASE);
+
+    return;
+
+}
+
+
+
+/**
+ * heap_malloc() - allocates and return a pointer to a memory block of requested size
+ * 
+ * size_t size: requested size in bytes from user
+ * -----------------------------------------------------------------------------------  
+ * 
+ * Description: Allocator behind my_malloc(), my_calloc() and my_realloc(). Makes sure the allocator is initialized and
+ * allocates with heap_alloc(). If the heap could not grow because of the limit, the free memory of the heap is handed
+ * back to the OS and the allocation tried again, then the pressure callback is called and the allocation tried one last
+ * time. An allocation that grew the heap past the soft limit hands free memory back before returning. If any errors
+ * occur during this process, NULL is returned to the user. With M_PERTURB set the memory is filled before it is returned.
+ * With MY_MALLOC_GUARD set, one call in guard_rate is placed in the guarded pool instead.
+ * 
+ *           
+ */
+static void *heap_malloc(size_t size){
+
+    size_t aligned_size = ALIGN(size);//align size to ensure it is rounded to nearest 8-byte for correct memory alignment
+
+    allocator_init();
+
+    if (tag_admit(size) != 0){
+        return NULL;
+    }
+
+    if (guard_enabled && guard_countdown-- == 0){
+        guard_countdown = guard_rate - 1;
+        void *guarded = guard_alloc(size);
+        if (guarded != NULL){
+            return guarded;
+        }
+    }
+
+    limit_refused = 0;
+    void *ptr = heap_alloc(aligned_size);
+
+    if (ptr == NULL && limit_refused){
+        heap_release(0);
+        limit_refused = 0;
+        ptr = heap_alloc(aligned_size);
+    }
+
+    PressureCallback callback = __atomic_load_n(&limit_callback, __ATOMIC_ACQUIRE);
+    if (ptr == NULL && limit_refused && callback != NULL && !limit_in_callback){
+        __atomic_add_fetch(&limit_callbacks, 1, __ATOMIC_RELAXED);
+        limit_in_callback = 1;
+        callback(aligned_size, __atomic_load_n(&limit_callback_arg, __ATOMIC_RELAXED));
+        limit_in_callback = 0;
+        limit_refused = 0;
+        ptr = heap_alloc(aligned_size);
+    }
+
+    if (ptr == NULL && limit_refused){
+        __atomic_add_fetch(&limit_failures, 1, __ATOMIC_RELAXED);
+        fprintf(stderr,"heap limit of %zu bytes reached\n", limit_bytes);
+    }
+
+    if (limit_soft_crossed){
+        limit_soft_crossed = 0;
+        __atomic_add_fetch(&limit_soft_releases, 1, __ATOMIC_RELAXED);
+        heap_release(0);
+    }
+
+    if (perturb_byte != 0 && ptr != NULL){
+        memset(ptr, perturb_byte ^ 0xFF, size);
+    }
+
+    return ptr;
+
+}
+
+
+
+
+/**
+ * my_stream_open() - starts a stream buffer
+ * 
+ * StreamBuffer *stream: buffer to start
+ * 
+ * size_t max_bytes: most bytes the buffer will ever hold, 0 for STREAM_DEFAULT_RESERVE
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Reserves the range with PROT_NONE and MAP_NORESERVE, which costs address space only. If a freed buffer's
+ * mapping is cached, its pages are moved to the start of the range and count as committed. Returns 0, or -1 if the
+ * range could not be reserved.
+ * 
+ *           
+ */
+int my_stream_open(StreamBuffer *stream, size_t max_bytes){
+
+    allocator_init();
+
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    if (max_bytes == 0){
+        max_bytes = STREAM_DEFAULT_RESERVE;
+    }
+    size_t reserved = (sizeof(Block) + max_bytes + page - 1) & ~(page - 1);
+
+    void *base = mmap(NULL, reserved, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED){
+        perror("mmap error");
+        return -1;
+    }
+
+    stream->base = base;
+    stream->reserved = reserved;
+    stream->committed = 0;
+    stream->length = 0;
+
+    //the cached pages replace the start of the reservation, a failed move simply leaves them unmapped
+    Block *cached = stream_cache_take(reserved);
+    if (cached != NULL){
+        size_t bytes = cached->size + sizeof(Block);
+        if (mremap(cached, bytes, bytes, MREMAP_MAYMOVE | MREMAP_FIXED, base) != MAP_FAILED){
+            stream->committed = bytes;
+            __atomic_add_fetch(&stream_committed_bytes, bytes, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&stream_reused, 1, __ATOMIC_RELAXED);
+        }
+        else{
+            limit_uncharge(bytes);
+            munmap(cached, bytes);
+        }
+    }
+
+    __atomic_add_fetch(&stream_open_count, 1, __ATOMIC_RELAXED);
+
+    return 0;
+
+}
+
+
+
+/**
+ * stream_commit() - makes more of a stream buffer's range readable and writable
+ * 
+ * StreamBuffer *stream: buffer that ran out of committed bytes
+ * 
+ * size_t end: offset from the start of the range that must be committed
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Commits at least STREAM_COMMIT_BYTES more, in whole pages and never past the reservation. The bytes are
+ * charged to the heap limit, and if they do not fit the heap's free memory is handed back to the OS before trying once
+ * more. Returns 0, or -1 if the range is full or the memory cannot be had.
+ * 
+ *           
+ */
+static int stream_commit(StreamBuffer *stream, size_t end){
+
+    if (end > stream->reserved){
+        fprintf(stderr,"stream buffer of %zu bytes is full\n", stream->reserved - sizeof(Block));
+        return -1;
+    }
+
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t target = stream->committed + STREAM_COMMIT_BYTES;
+    if (target < end){
+        target = end;
+    }
+    target = (target + page - 1) & ~(page - 1);
+    if (target > stream->reserved){
+        target = stream->reserved;
+    }
+    size_t bytes = target - stream->committed;
+
+    limit_refused = 0;
+    if (limit_charge(bytes) != 0){
+        heap_release(0);
+        if (limit_charge(bytes) != 0){
+            __atomic_add_fetch(&limit_failures, 1, __ATOMIC_RELAXED);
+            fprintf(stderr,"heap limit of %zu bytes reached\n", limit_bytes);
+            return -1;
+        }
+    }
+
+    if (mprotect(stream->base + stream->committed, bytes, PROT_READ | PROT_WRITE) != 0){
+        perror("mprotect error");
+        limit_uncharge(bytes);
+        return -1;
+    }
+
+#ifdef MADV_POPULATE_WRITE
+    //faulting the pages in with one call is much cheaper than one page fault per page as the buffer fills
+    madvise(stream->base + stream->committed, bytes, MADV_POPULATE_WRITE);
+#endif
+
+    stream->committed = target;
+    __atomic_add_fetch(&stream_committed_bytes, bytes, __ATOMIC_RELAXED);
+
+    return 0;
+
+}
+
+
+
+/**
+ * my_stream_extend() - adds bytes to the end of a stream buffer
+ * 
+ * StreamBuffer *stream: open buffer
+ * 
+ * size_t bytes: number of bytes to add
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Returns a pointer to the new bytes for the caller to fill in, or NULL if the buffer cannot grow. Nothing
+ * already in the buffer moves, so earlier pointers stay valid. The first byte of the buffer is sizeof(Block) aligned.
+ * 
+ *           
+ */
+void *my_stream_extend(StreamBuffer *stream, size_t bytes){
+
+    size_t offset = sizeof(Block) + stream->length;
+    if (bytes > stream->reserved - offset){
+        fprintf(stderr,"stream buffer of %zu bytes is full\n", stream->reserved - sizeof(Block));
+        return NULL;
+    }
+
+    if (offset + bytes > stream->committed && stream_commit(stream, offset + bytes) != 0){
+        return NULL;
+    }
+
+    stream->length += bytes;
+
+    return stream->base + offset;
+
+}
+
+
+
+/**
+ * my_stream_append() - copies data to the end of a stream buffer
+ * 
+ * StreamBuffer *stream: open buffer
+ * 
+ * const void *data: bytes to copy
+ * 
+ * size_t bytes: number of bytes to copy
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: my_stream_extend() followed by memcpy(). Returns 0, or -1 if the buffer cannot grow.
+ * 
+ *           
+ */
+int my_stream_append(StreamBuffer *stream, const void *data, size_t bytes){
+
+    void *tail = my_stream_extend(stream, bytes);
+    if (tail == NULL){
+        return -1;
+    }
+
+    memcpy(tail, data, bytes);
+
+    return 0;
+
+}
+
+
+
+/**
+ * my_stream_seal() - turns a stream buffer into an ordinary allocation
+ * 
+ * StreamBuffer *stream: open buffer, cleared once sealed
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Unmaps the reserved range past the last page the data needs, committed or not, and writes a Block header
+ * of arena ARENA_MAPPED at the start of the range. The result is freed with my_free() and can be resized with
+ * my_realloc(), which moves it into the heap if it has to grow. With MY_MALLOC_CALLSITES set it is counted against the
+ * caller. Returns the data, or NULL if the buffer could not be sealed.
+ * 
+ *           
+ */
+__attribute__((noinline)) void *my_stream_seal(StreamBuffer *stream){
+
+    if (stream->committed < sizeof(Block) && stream_commit(stream, sizeof(Block)) != 0){
+        return NULL;
+    }
+
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t keep = (sizeof(Block) + ALIGN(stream->length) + page - 1) & ~(page - 1);
+    if (keep < stream->reserved){
+        munmap(stream->base + keep, stream->reserved - keep);
+    }
+    if (keep < stream->committed){
+        limit_uncharge(stream->committed - keep);
+        __atomic_sub_fetch(&stream_committed_bytes, stream->committed - keep, __ATOMIC_RELAXED);
+        stream->committed = keep;
+    }
+
+    Block *block = (Block *)stream->base;
+    block->size = stream->committed - sizeof(Block);
+    block->free = 0;
+    block->arena = ARENA_MAPPED;
+    block->site = CALLSITE_UNTRACKED;
+    block_set_next(block, NULL);
+    block_set_prev(block, NULL);
+
+    __atomic_sub_fetch(&stream_open_count, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&stream_sealed_count, 1, __ATOMIC_RELAXED);
+    memset(stream, 0, sizeof(*stream));
+
+    if (tag_enabled){
+        tag_record(block + 1);
+    }
+    if (callsite_enabled){
+        callsite_record(block + 1, __builtin_return_address(0));
+    }
+    stream_register(block);
+
+    return (void *)(block + 1);
+
+}
+
+
+
+/**
+ * lifetime_sample() - starts the sample of a new allocation
+ * 
+ * void *ptr: allocation just handed out
+ * 
+ * unsigned int site: its callsite
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: A sample still in the slot is replaced. If it had already lived past LIFETIME_SHORT_BYTES it counts as
+ * long-lived, which is how allocations that are never freed teach their callsite anything.
+ * 
+ *           
+ */
+static void lifetime_sample(void *ptr, unsigned int site){
+
+    LifetimeSample *slot = lifetime_slot(ptr);
+    size_t clock = __atomic_load_n(&lifetime_clock, __ATOMIC_RELAXED);
+
+    lock_acquire(&lifetime_lock);
+    if (slot->ptr != NULL && clock - slot->clock >= LIFETIME_SHORT_BYTES){
+        lifetime_count(slot->site, 0);
+    }
+    slot->clock = clock;
+    slot->site = site;
+    __atomic_store_n(&slot->ptr, ptr, __ATOMIC_RELAXED);
+    lock_release(&lifetime_lock);
+
+    return;
+
+}
+
+
+
+/**
+ * lifetime_malloc() - allocates from a chunk or the heap depending on the expected lifetime
+ * 
+ * size_t size: requested size in bytes
+ * 
+ * void *caller: callsite of the allocation
+ * 
+ * int lifetime: LIFETIME_SHORT or LIFETIME_LONG as stated by the caller, LIFETIME_UNKNOWN to use the prediction
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: With MY_MALLOC_LIFETIME set the allocation advances the clock, is predicted from its callsite's samples
+ * unless the caller stated its lifetime, and is sampled once every LIFETIME_SAMPLE_RATE allocations. Short-lived ones up
+ * to LIFETIME_MAX_SIZE come from a chunk, everything else and anything a chunk cannot serve from heap_malloc().
+ * 
+ *           
+ */
+static void *lifetime_malloc(size_t size, void *caller, int lifetime){
+
+    size_t aligned_size = ALIGN(size);
+    unsigned int site = CALLSITE_OTHER;
+
+    if (lifetime_enabled){
+        site = callsite_index(caller);
+
+        lifetime_pending += aligned_size;
+        if (lifetime_pending >= LIFETIME_CLOCK_BATCH){
+            __atomic_add_fetch(&lifetime_clock, lifetime_pending, __ATOMIC_RELAXED);
+            lifetime_pending = 0;
+        }
+
+        //short-lived only once nearly every sample of the callsite died young, a wrong guess pins a whole chunk
+        if (lifetime == LIFETIME_UNKNOWN){
+            unsigned int short_lived = __atomic_load_n(&lifetime_sites[site].short_lived, __ATOMIC_RELAXED);
+            unsigned int long_lived = __atomic_load_n(&lifetime_sites[site].long_lived, __ATOMIC_RELAXED);
+            if (short_lived >= LIFETIME_MIN_SAMPLES && long_lived * 16 <= short_lived){
+                lifetime = LIFETIME_SHORT;
+            }
+        }
+    }
+
+    void *ptr = NULL;
+    if (lifetime == LIFETIME_SHORT && aligned_size > 0 && aligned_size <= LIFETIME_MAX_SIZE && tag_admit(size) == 0){
+        allocator_init();
+        ptr = lifetime_chunk_alloc(aligned_size);
+        if (perturb_byte != 0 && ptr != NULL){
+            memset(ptr, perturb_byte ^ 0xFF, size);
+        }
+    }
+    if (ptr == NULL){
+        ptr = heap_malloc(size);
+    }
+
+    if (lifetime_enabled && ptr != NULL && lifetime_countdown-- == 0){
+        lifetime_countdown = LIFETIME_SAMPLE_RATE - 1;
+        lifetime_sample(ptr, site);
+    }
+
+    return ptr;
+
+}
+
+
+
+/**
+ * my_malloc() - allocates and return a pointer to a memory block of requested size
+ * 
+ * size_t size: requested size in bytes from user
+ * -----------------------------------------------------------------------------------  
+ * 
+ * Description: Custom implementation of malloc. Records the requested size in the size histogram and allocates it with
+ * heap_malloc(), which returns a slab slot for small sizes and a Block from the linked list otherwise. If any errors occur
+ * during this process, NULL is returned to the user. With MY_MALLOC_CALLSITES set the allocation is also counted against
+ * the caller's return address. The malloc_entry and malloc_exit probes fire around the whole call.
+ * 
+ *           
+ */
+__attribute__((noinline)) void *my_malloc(size_t size){
+
+    MALLOC_PROBE1(malloc_entry, size);
+
+    DEBUG_CHECK();
+
+    size_histogram_record(size);
+
+    void *ptr = lifetime_enabled ? lifetime_malloc(size, __builtin_return_address(0), LIFETIME_UNKNOWN) : heap_malloc(size);
+
+    //the call is attributed to whoever called my_malloc(), which is why it is never inlined
+    if (tag_enabled && ptr != NULL){
+        tag_record(ptr);
+    }
+    if (callsite_enabled && ptr != NULL){
+        callsite_record(ptr, __builtin_return_address(0));
+    }
+
+    MALLOC_PROBE2(malloc_exit, ptr, size);
+
+    return ptr;
+
+}
+
+
+
+
+/**
+ * my_free() - free's a previously allocated block and marks it reusable
+ * 
+ * void *allocated_block: pointer to a previously allocated block
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Custom implementation of free() that sets the pointer recieved to a resuable block by setting the meta data free variable to 1,
+ * also checks adjecent nodes if they are also free to merge all free adjecent data blocks in the doubly linked list into one block to reduce 
+ * fragmentation. Slab slots go back to their run, and blocks go back to the arena recorded in their header under that arena's lock.
+ * Sealed stream buffers are unmapped and guarded allocations go back to the quarantine. The free probe fires on entry. The arena is trimmed when its free tail reaches the
+ * M_TRIM_THRESHOLD set with my_mallopt(), and with M_PERTURB set the memory is filled before it is reused.
+ * 
+ *           
+ */
+void my_free(void *allocated_block){
+    
+    MALLOC_PROBE1(free, allocated_block);
+
+    DEBUG_CHECK();
+
+    //check if the pointer recieved from the parameter is NULL
+    if (allocated_block == NULL){
+        fprintf(stderr,"invalid memory block\n");
+        return;
+    }
+
+    //a freed guarded slot cannot even be read, so a bad free of one is caught before anything touches its header
+    if (guard_owns(allocated_block)){
+        guard_check_free(allocated_block);
+    }
+
+    //the site and tag are read from the allocation, so they must be taken off their counters before the memory is reused
+    if (tag_enabled){
+        tag_forget(allocated_block);
+    }
+    if (callsite_enabled){
+        callsite_forget(allocated_block);
+    }
+    if (lifetime_enabled){
+        lifetime_forget(allocated_block);
+    }
+
+    //slab slots have no Block header, they go back to the thread's cache and their run's bitmap tracks them from there
+    if (slab_owns(allocated_block)){
+        thread_cache_free(allocated_block);
+        return;
+    }
+
+    //Changing the blocks meta data information, specifically the free variable to 1 since the block is being freed, under the lock of the arena that holds it
+    Block *free_block = (Block *)allocated_block - 1;
+    if (free_block->arena == ARENA_MAPPED){
+        stream_unmap(free_block);
+        return;
+    }
+    if (free_block->arena == ARENA_GUARDED){
+        guard_free(free_block);
+        return;
+    }
+    if (perturb_byte != 0){
+        memset(allocated_block, perturb_byte, free_block->size);
+    }
+    if (free_block->arena == ARENA_CHUNK){
+        lifetime_chunk_free(free_block);
+        return;
+    }
+    Arena *arena = &arenas[free_block->arena];
+
+    lock_acquire(&arena->lock);
+    arena_free(arena, free_block);
+    if (arena->last->free == 1 && arena->last->size >= trim_threshold){
+        arena_trim(arena, trim_top_pad);
+    }
+    lock_release(&arena->lock);
+
+    return;
+
+
+}
+
+
+
+/**
+ * my_calloc() - dynamically allocates a block of memory for an array that has value elements, each with a size amount of bytes, all bytes being initalized to 0.
+ * 
+ * size_t value: number of elements in the array
+ * 
+ * size_t size: size of each element in the array
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Custom implementation of calloc that uses heap_malloc() to dynamically allocate a block of memory in a pointer requested from the user.
+ * Then set each byte in the pointer to 0 so the entire array is initalized to 0. Then the initalized pointer is returned to the user. If any errors occur during this process, 
+ * NULL is returned to the user.
+ * 
+ *           
+ */
+
+__attribute__((noinline)) void *my_calloc(size_t value,size_t size){ 
+
+    //Check for edge cases
+    if (size == 0 || value == 0){
+        return NULL;
+    }
+
+    //check for integer overflow when calculating the size
+    size_t Total_size = size * value;
+    if (Total_size/value != size ){
+        return NULL;
+    }
+
+    size_histogram_record(Total_size);
+
+    //use heap_malloc() to allocate a block of memory to use
+    void *new_pointer = lifetime_enabled ? lifetime_malloc(Total_size, __builtin_return_address(0), LIFETIME_UNKNOWN) : heap_malloc(Total_size);
+
+    //check for any heap_malloc() error
+    if (new_pointer == NULL){
+        fprintf(stderr,"my_calloc failed\n");\
+        return NULL;
+    }
+
+    if (tag_enabled){
+        tag_record(new_pointer);
+    }
+    if (callsite_enabled){
+        callsite_record(new_pointer, __builtin_return_address(0));
+    }
+
+    //dereference the new_pointer to a char type so each byte from the memory address can be initialized to 0
+    char *ptr = (char *)new_pointer;
+
+    for (size_t i = 0; i <Total_size; i++){
+
+        ptr[i] = 0;
+
+    }
+
+    //return the initialized pointer to the user
+    return new_pointer;
+
+}
+
+
+
+/**
+ * my_malloc_hint() - allocates memory whose lifetime the caller knows
+ * 
+ * size_t size: requested size in bytes
+ * 
+ * int lifetime: LIFETIME_SHORT for memory freed soon, such as per-request objects, LIFETIME_LONG for memory kept
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Like my_malloc(), but the stated lifetime replaces the prediction. Short-lived memory comes from a chunk
+ * even without MY_MALLOC_LIFETIME set.
+ * 
+ *           
+ */
+__attribute__((noinline)) void *my_malloc_hint(size_t size, int lifetime){
+
+    size_histogram_record(size);
+
+    void *ptr = lifetime_malloc(size, __builtin_return_address(0), lifetime);
+
+    if (tag_enabled && ptr != NULL){
+        tag_record(ptr);
+    }
+    if (callsite_enabled && ptr != NULL){
+        callsite_record(ptr, __builtin_return_address(0));
+    }
+
+    return ptr;
+
+}
+
+
+
+/**
+ * my_malloc_site() - allocates memory on behalf of a numbered callsite
+ * 
+ * size_t size: requested size in bytes
+ * 
+ * unsigned int site: number that stands for the real callsite, below 65535
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Like my_malloc(), but the allocation is predicted and accounted under the given number instead of the
+ * return address. Allocation wrappers and pools that serve many callers from one place pass their own site numbers, and
+ * trace replay passes the site recorded in the trace. The number is used as an address below the first page, which no
+ * code lives at.
+ * 
+ *           
+ */
+void *my_malloc_site(size_t size, unsigned int site){
+
+    void *caller = (void *)(uintptr_t)((site < 0xFFFF) ? site + 1 : 0xFFFF);
+
+    size_histogram_record(size);
+
+    void *ptr = lifetime_malloc(size, caller, LIFETIME_UNKNOWN);
+
+    if (tag_enabled && ptr != NULL){
+        tag_record(ptr);
+    }
+    if (callsite_enabled && ptr != NULL){
+        callsite_record(ptr, caller);
+    }
+
+    return ptr;
+
+}
+
+
+
+/**
+ * heap_realloc() - dynamically resizes a previously allocated block of memory.
+ * 
+ * void *ptr: previously allocated block of memory
+ * 
+ * size_t size: new size value to resize void *ptr
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Custom implementation of realloc that takes in a previously allocated block of memory. It first checks if the change in size is to shrink the block,
+ * then the block of memory meta data 'size' is changed to the new size value. If the size value is larger than the meta data 'size' value then the function
+ * uses heap_malloc() to create a new block of memory of the requested size change and then copy's *ptr memory into the block using memcpy(). After copying the *ptr block
+ * is then freed and the new larger block of memory with the copyed values of *ptr is returned to the user. If any errors occur during this process, NULL is returned to the user.
+ * A resize fires the realloc_in_place or the realloc_move probe depending on which of the two happened.
+ * 
+ *           
+ */
+static void *heap_realloc(void *ptr,size_t size){
+
+
+    size_t aligned_size = ALIGN(size);//align size to ensure it is rounded to nearest 8-byte for correct memory alignment
+    if (ptr == NULL){
+        size_histogram_record(size);
+        return heap_malloc(size);
+    }
+
+    if (size != 0){
+        size_histogram_record(size);
+    }
+
+    //if the user wants the block to have a size of 0 then the block is freed
+    if (size == 0){
+        my_free(ptr);
+        return NULL;
+    }
+
+    //a slab slot can grow in place up to its slot size, anything larger moves to a new allocation
+    if (slab_owns(ptr)){
+        size_t slot_size = slab_run_of(ptr)->slot_size;
+        if (aligned_size <= slot_size){
+            MALLOC_PROBE2(realloc_in_place, ptr, size);
+            return ptr;
+        }
+
+        void *new_ptr = heap_malloc(aligned_size);
+        if (new_ptr == NULL){
+            fprintf(stderr,"realoc error\n");
+            return NULL;
+        }
+
+        memcpy(new_ptr, ptr, slot_size);
+        my_free(ptr);
+        MALLOC_PROBE3(realloc_move, ptr, new_ptr, size);
+        return new_ptr;
+    }
+
+    //Dereference the block and subtract the ptr by 1 to access the meta data in the address
+    Block *current = (Block *)ptr -1;
+
+    //sealed stream buffers, chunk objects and guarded allocations shrink in place and move into the heap to grow
+    if (current->arena == ARENA_MAPPED || current->arena == ARENA_CHUNK || current->arena == ARENA_GUARDED){
+        if (aligned_size <= current->size){
+            MALLOC_PROBE2(realloc_in_place, ptr, size);
+            return ptr;
+        }
+
+        void *new_ptr = heap_malloc(aligned_size);
+        if (new_ptr == NULL){
+            fprintf(stderr,"realoc error\n");
+            return NULL;
+        }
+
+        memcpy(new_ptr, ptr, current->size);
+        my_free(ptr);
+        MALLOC_PROBE3(realloc_move, ptr, new_ptr, size);
+        return new_ptr;
+    }
+
+    //first check if the change in size is less than the original size of the current block, if it is less then only change the meta data information on the size of the block
+    if (current->size >= aligned_size){
+
+        //the neighbours of the block belong to its arena, so the split happens under the arena's lock
+        Arena *arena = &arenas[current->arena];
+        lock_acquire(&arena->lock);
+
+        //After changing the orginal size, check if the left over remaining memory is enough to create a block of atleast 8 bytes
+        if (current->size >= aligned_size + sizeof(Block) + ALIGNMENT){
+
+            //Creating a block with the unused memory and ensure it is adjacent to the current block
+            Block *new_block = (Block *)((char *)(current + 1) + aligned_size);
+            new_block->free = 1;
+            new_block->arena = current->arena;
+            block_set_prev(new_block, current);
+            block_set_next(new_block, block_next(current));
+            
+            new_block ->size = current->size - aligned_size - sizeof(Block);
+            if (block_next(current) != NULL){
+                block_set_prev(block_next(current), new_block);
+            }
+            else{
+                arena->last = new_block;
+            }
+            
+            block_set_next(current, new_block);
+
+            //merge the unused memory with the next block if that one is free too, so no two free blocks are left side by side
+            Block *next = block_next(new_block);
+            if (next != NULL && next->free == 1 && block_touches_next(new_block, next)){
+                new_block->size += sizeof(Block) + next->size;
+                block_set_next(new_block, block_next(next));
+                if (block_next(next) != NULL){
+                    block_set_prev(block_next(next), new_block);
+                }
+                else{
+                    arena->last = new_block;
+                }
+            }
+
+            //setting the size to the new size, without a split the leftover bytes stay part of the block
+            current->size = aligned_size;
+        }
+
+        lock_release(&arena->lock);
+
+        MALLOC_PROBE2(realloc_in_place, ptr, size);
+
+        return ptr;
+
+    }
+
+    //If the size is larger than the current size, then a new block is created with the heap_malloc function
+    else if(current->size < aligned_size ){
+        void *new_ptr = heap_malloc(aligned_size);
+
+        //check for any heap_malloc() errors
+        if (new_ptr == NULL){
+            fprintf(stderr,"realoc error\n");
+            return NULL;
+        }
+
+        //copy memory of the old block to the new block
+        memcpy(new_ptr, ptr,current->size);
+
+        //after copying, free the old block of memory
+        my_free(ptr);
+
+        MALLOC_PROBE3(realloc_move, ptr, new_ptr, size);
+
+        return new_ptr;
+
+    }
+
+    //If the memory address is invalid
+    else{
+        fprintf(stderr,"invalid ptr\n");
+        return NULL;
+    }
+    
+}
+
+
+/**
+ * my_realloc() - dynamically resizes a previously allocated block of memory.
+ * 
+ * void *ptr: previously allocated block of memory
+ * 
+ * size_t size: new size value to resize void *ptr
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Custom implementation of realloc, the resizing itself is done by heap_realloc(). With MY_MALLOC_CALLSITES
+ * set the old allocation is taken off its callsite first, since a block resized in place changes its size, and the
+ * resized allocation is counted against the caller's return address whether it moved or not. With MY_MALLOC_TAGS set
+ * the old allocation is credited back to its tag the same way and the resized one charged to the calling thread's tag,
+ * which may refuse the new size.
+ * 
+ *           
+ */
+__attribute__((noinline)) void *my_realloc(void *ptr,size_t size){
+
+    if (!callsite_enabled && !tag_enabled){
+        return heap_realloc(ptr, size);
+    }
+
+    if (ptr != NULL && tag_enabled){
+        tag_forget(ptr);
+    }
+    if (ptr != NULL && callsite_enabled){
+        callsite_forget(ptr);
+    }
+
+    //the old allocation is already off its tag, so only the new size counts against the limit
+    void *new_ptr = (size != 0 && tag_admit(size) != 0) ? NULL : heap_realloc(ptr, size);
+
+    //a failed resize leaves the old allocation live, it is counted again against this caller
+    void *live = (new_ptr == NULL && size != 0) ? ptr : new_ptr;
+    if (live != NULL && tag_enabled){
+        tag_record(live);
+    }
+    if (live != NULL && callsite_enabled){
+        callsite_record(live, __builtin_return_address(0));
+    }
+
+    return new_ptr;
+
+}
+
+
+
+/**
+ * halloc() - allocates memory that is reached through a handle and may be moved by compaction
+ * 
+ * size_t size: requested size in bytes
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Allocates like my_malloc() and records the new allocation in an entry of the handle table. The memory is
+ * only reachable through hlock(). Sizes served by the slab classes never move, only Block list blocks are compacted.
+ * Returns HANDLE_NONE if the memory or the table entry could not be allocated.
+ * 
+ *           
+ */
+__attribute__((noinline)) Handle halloc(size_t size){
+
+    DEBUG_CHECK();
+
+    size_histogram_record(size);
+
+    void *ptr = heap_malloc(size);
+    if (ptr == NULL){
+        return HANDLE_NONE;
+    }
+
+    if (tag_enabled){
+        tag_record(ptr);
+    }
+    if (callsite_enabled){
+        callsite_record(ptr, __builtin_return_address(0));
+    }
+
+    lock_acquire(&handle_lock);
+    Handle handle = handle_entry_new();
+    if (handle != HANDLE_NONE){
+        handle_table[handle].ptr = ptr;
+        handle_table[handle].size = size;
+        handle_table[handle].locks = 0;
+        handle_live++;
+    }
+    lock_release(&handle_lock);
+
+    if (handle == HANDLE_NONE){
+        my_free(ptr);
+    }
+
+    return handle;
+
+}
+
+
+
+/**
+ * hlock() - pins the memory of a handle and returns its address
+ * 
+ * Handle handle: handle returned by halloc()
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: The address stays valid until the matching hunlock(), locks nest. Returns NULL for an invalid handle.
+ * 
+ *           
+ */
+void *hlock(Handle handle){
+
+    void *ptr = NULL;
+
+    lock_acquire(&handle_lock);
+    HandleEntry *entry = handle_entry_of(handle);
+    if (entry != NULL){
+        entry->locks++;
+        ptr = entry->ptr;
+    }
+    lock_release(&handle_lock);
+
+    return ptr;
+
+}
+
+
+
+/**
+ * hunlock() - lets compaction move the memory of a handle again
+ * 
+ * Handle handle: handle locked with hlock()
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Undoes one hlock(). Addresses returned by hlock() must not be used after the last hunlock().
+ * 
+ *           
+ */
+void hunlock(Handle handle){
+
+    lock_acquire(&handle_lock);
+    HandleEntry *entry = handle_entry_of(handle);
+    if (entry != NULL){
+        if (entry->locks == 0){
+            fprintf(stderr,"hunlock of unlocked handle %u\n", handle);
+        }
+        else{
+            entry->locks--;
+        }
+    }
+    lock_release(&handle_lock);
+
+    return;
+
+}
+
+
+
+/**
+ * my_heap_compact() - runs one incremental compaction step over the handles
+ * 
+ * size_t max_handles: handles to look at in this step
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Goes round the handle table from where the last step stopped. An unlocked handle whose Block has a free
+ * block large enough before it in its arena is copied into the first such block and its old block is freed, which
+ * merges it with its free neighbours. Repeated steps slide handle memory towards the start of every arena and gather the
+ * free space at the end, which arena_trim() then hands back to the OS. Blocks from my_malloc() never move, they simply
+ * stay where they are, and neither do handles that were mapped, put in a lifetime chunk or guarded. Returns the number
+ * of blocks moved.
+ * 
+ *           
+ */
+size_t my_heap_compact(size_t max_handles){
+
+    size_t moved = 0;
+
+    lock_acquire(&handle_lock);
+
+    for (size_t n = 0; n < max_handles && n < handle_capacity; n++){
+
+        Handle handle = handle_cursor;
+        handle_cursor = (handle_cursor + 1 >= handle_capacity) ? HANDLE_NONE + 1 : handle_cursor + 1;
+
+        HandleEntry *entry = &handle_table[handle];
+        if (entry->ptr == NULL || entry->locks > 0 || slab_owns(entry->ptr)){
+            continue;
+        }
+
+        //mapped, chunk and guarded blocks have no arena list to move into
+        Block *old = (Block *)entry->ptr - 1;
+        if (old->arena >= ARENA_COUNT){
+            continue;
+        }
+        Arena *arena = &arenas[old->arena];
+
+        lock_acquire(&arena->lock);
+        void *new_ptr = arena_fit(arena, old->size, old);
+        if (new_ptr != NULL){
+            memcpy(new_ptr, entry->ptr, old->size);
+            if (tag_enabled){
+                tag_move(entry->ptr, new_ptr);
+            }
+            if (callsite_enabled){
+                callsite_move(entry->ptr, new_ptr);
+            }
+            handle_moved_bytes += old->size;
+            arena_free(arena, old);
+            entry->ptr = new_ptr;
+            moved++;
+        }
+        lock_release(&arena->lock);
+
+    }
+
+    handle_moves += moved;
+
+    //whatever the moves freed at the end of each arena goes back to the OS
+    for (int i = 0; i < ARENA_COUNT; i++){
+        lock_acquire(&arenas[i].lock);
+        handle_trimmed_bytes += arena_trim(&arenas[i], 0);
+        lock_release(&arenas[i].lock);
+    }
+
+    lock_release(&handle_lock);
+
+    return moved;
+
+}
+
+
+
+/**
+ * hfree() - frees the memory of a handle and the handle itself
+ * 
+ * Handle handle: handle returned by halloc(), not locked
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Locked handles are refused, someone is still using their memory. The entry goes back on the free list
+ * before the memory is freed with my_free(). Every HANDLE_COMPACT_FREES calls a compaction step of HANDLE_COMPACT_STEP
+ * handles runs, so a program that never calls my_heap_compact() still compacts little by little.
+ * 
+ *           
+ */
+void hfree(Handle handle){
+
+    void *ptr = NULL;
+    int compact = 0;
+
+    lock_acquire(&handle_lock);
+    HandleEntry *entry = handle_entry_of(handle);
+    if (entry != NULL && entry->locks > 0){
+        fprintf(stderr,"hfree of locked handle %u\n", handle);
+    }
+    else if (entry != NULL){
+        ptr = entry->ptr;
+        entry->ptr = NULL;
+        entry->next_free = handle_free_list;
+        handle_free_list = handle;
+        handle_live--;
+        handle_frees++;
+        compact = (handle_frees % HANDLE_COMPACT_FREES == 0);
+    }
+    lock_release(&handle_lock);
+
+    if (ptr != NULL){
+        my_free(ptr);
+    }
+
+    if (compact){
+        my_heap_compact(HANDLE_COMPACT_STEP);
+    }
+
+    return;
+
+}
+
+
+
+/**
+ * epoch_attach() - claims an epoch record for the calling thread
+ * 
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Takes the first unused record and registers thread_exit() so the record is released again. Returns -1,
+ * after printing why, if every record is owned.
+ * 
+ *           
+ */
+static int epoch_attach(void){
+
+    allocator_init();
+
+    for (int i = 0; i < EPOCH_THREADS; i++){
+        int expected = 0;
+        if (__atomic_load_n(&epoch_records[i].used, __ATOMIC_RELAXED) == 0
+                && __atomic_compare_exchange_n(&epoch_records[i].used, &expected, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)){
+            epoch_slot = i;
+            thread_exit_register();
+            return 0;
+        }
+    }
+
+    fprintf(stderr,"epoch error: more than %d threads\n", EPOCH_THREADS);
+
+    return -1;
+
+}
+
+
+
+/**
+ * my_epoch_enter() - begins a read-side critical section
+ * 
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Publishes the global epoch in the thread's record. The full fence makes the record visible before any
+ * shared pointer is read, which is what keeps the epoch from advancing twice under the reader. Sections nest, only the
+ * outermost one publishes. Returns 0, or -1 if the thread could not get a record, in which case nothing is protected.
+ * 
+ *           
+ */
+int my_epoch_enter(void){
+
+    if (epoch_slot < 0 && epoch_attach() != 0){
+        return -1;
+    }
+
+    EpochRecord *record = &epoch_records[epoch_slot];
+    unsigned int active = __atomic_load_n(&record->active, __ATOMIC_RELAXED);
+    if (active == 0){
+        __atomic_store_n(&record->epoch, __atomic_load_n(&epoch_global, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+        __atomic_store_n(&record->active, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    }
+    else{
+        __atomic_store_n(&record->active, active + 1, __ATOMIC_RELAXED);
+    }
+
+    return 0;
+
+}
+
+
+
+/**
+ * my_epoch_exit() - ends a read-side critical section
+ * 
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Once the outermost section ends, the thread no longer holds the epoch back. The release store keeps every
+ * read of the section before it.
+ * 
+ *           
+ */
+void my_epoch_exit(void){
+
+    unsigned int active = (epoch_slot < 0) ? 0 : __atomic_load_n(&epoch_records[epoch_slot].active, __ATOMIC_RELAXED);
+    if (active == 0){
+        fprintf(stderr,"my_epoch_exit without my_epoch_enter\n");
+        return;
+    }
+
+    __atomic_store_n(&epoch_records[epoch_slot].active, active - 1, __ATOMIC_RELEASE);
+
+    return;
+
+}
+
+
+
+/**
+ * epoch_try_advance() - moves the global epoch forward if every reader has caught up
+ * 
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Any thread inside a critical section that started in an older epoch keeps the epoch where it is. Returns
+ * the global epoch after the attempt.
+ * 
+ *           
+ */
+static size_t epoch_try_advance(void){
+
+    size_t epoch = __atomic_load_n(&epoch_global, __ATOMIC_SEQ_CST);
+
+    for (int i = 0; i < EPOCH_THREADS; i++){
+        if (__atomic_load_n(&epoch_records[i].used, __ATOMIC_ACQUIRE) && __atomic_load_n(&epoch_records[i].active, __ATOMIC_SEQ_CST) > 0
+                && __atomic_load_n(&epoch_records[i].epoch, __ATOMIC_SEQ_CST) != epoch){
+            return epoch;
+        }
+    }
+
+    __atomic_compare_exchange_n(&epoch_global, &epoch, epoch + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+
+    return __atomic_load_n(&epoch_global, __ATOMIC_SEQ_CST);
+
+}
+
+
+
+/**
+ * epoch_free_chunks() - frees every pointer of a list of chunks and keeps the chunks for reuse
+ * 
+ * RetireChunk *chunks: chunks whose epoch is at least two behind the global epoch
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: The pointers go through my_free() like any other free, so the slab ones land in the thread cache. No lock
+ * is held while they are freed.
+ * 
+ *           
+ */
+static void epoch_free_chunks(RetireChunk *chunks){
+
+    if (chunks == NULL){
+        return;
+    }
+
+    size_t freed = 0;
+    RetireChunk *last = chunks;
+    for (RetireChunk *chunk = chunks; chunk != NULL; chunk = chunk->next){
+        for (size_t i = 0; i < chunk->count; i++){
+            my_free(chunk->ptrs[i]);
+        }
+        freed += chunk->count;
+        last = chunk;
+    }
+
+    __atomic_sub_fetch(&epoch_pending, freed, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&epoch_reclaimed, freed, __ATOMIC_RELAXED);
+
+    lock_acquire(&epoch_lock);
+    last->next = epoch_spare;
+    epoch_spare = chunks;
+    lock_release(&epoch_lock);
+
+    return;
+
+}
+
+
+
+/**
+ * epoch_split_old() - takes the chunks that are safe to free off a list
+ * 
+ * RetireChunk **list: list of chunks to search, left with only the chunks still in their grace period
+ * 
+ * size_t epoch: current global epoch
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: A chunk is safe once its epoch is two or more behind. Returns the chunks taken off, in a list of their own.
+ * 
+ *           
+ */
+static RetireChunk *epoch_split_old(RetireChunk **list, size_t epoch){
+
+    RetireChunk *old = NULL;
+
+    while (*list != NULL){
+        RetireChunk *chunk = *list;
+        if (chunk->epoch + 2 <= epoch){
+            *list = chunk->next;
+            chunk->next = old;
+            old = chunk;
+        }
+        else{
+            list = &chunk->next;
+        }
+    }
+
+    return old;
+
+}
+
+
+
+/**
+ * my_epoch_reclaim() - frees whatever retired memory has passed its grace period
+ * 
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Tries to advance the epoch, then frees the calling thread's old chunks and the old chunks left by exited
+ * threads. my_retire() calls it every EPOCH_RETIRE_BATCH retires, a thread can also call it when it goes idle. Returns
+ * the number of allocations still waiting to be freed across all threads.
+ * 
+ *           
+ */
+size_t my_epoch_reclaim(void){
+
+    size_t epoch = epoch_try_advance();
+
+    epoch_free_chunks(epoch_split_old(&epoch_retired, epoch));
+
+    RetireChunk *orphans = NULL;
+    if (__atomic_load_n(&epoch_orphans, __ATOMIC_RELAXED) != NULL){
+        lock_acquire(&epoch_lock);
+        orphans = epoch_split_old(&epoch_orphans, epoch);
+        lock_release(&epoch_lock);
+    }
+    epoch_free_chunks(orphans);
+
+    return __atomic_load_n(&epoch_pending, __ATOMIC_RELAXED);
+
+}
+
+
+
+/**
+ * my_retire() - frees memory once no reader can still be using it
+ * 
+ * void *ptr: allocation already unlinked from every shared structure
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Adds the pointer to the thread's chunk for the current epoch, starting a new chunk, from the spare list or
+ * mapped with mmap(), when the epoch changed or the chunk is full. Every EPOCH_RETIRE_BATCH calls the thread reclaims
+ * what it can. If no chunk can be mapped the pointer is leaked rather than freed too early.
+ * 
+ *           
+ */
+void my_retire(void *ptr){
+
+    if (ptr == NULL){
+        return;
+    }
+
+    size_t epoch = __atomic_load_n(&epoch_global, __ATOMIC_SEQ_CST);
+    RetireChunk *chunk = epoch_retired;
+
+    if (chunk == NULL || chunk->epoch != epoch || chunk->count == EPOCH_CHUNK_PTRS){
+
+        lock_acquire(&epoch_lock);
+        chunk = epoch_spare;
+        if (chunk != NULL){
+            epoch_spare = chunk->next;
+        }
+        lock_release(&epoch_lock);
+
+        if (chunk == NULL){
+            chunk = mmap(NULL, sizeof(RetireChunk), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (chunk == MAP_FAILED){
+                fprintf(stderr,"my_retire error: no memory for the retire list\n");
+                return;
+            }
+        }
+
+        chunk->epoch = epoch;
+        chunk->count = 0;
+        chunk->next = epoch_retired;
+        epoch_retired = chunk;
+        thread_exit_register();
+
+    }
+
+    chunk->ptrs[chunk->count++] = ptr;
+    __atomic_add_fetch(&epoch_pending, 1, __ATOMIC_RELAXED);
+
+    if (++epoch_retire_calls % EPOCH_RETIRE_BATCH == 0){
+        my_epoch_reclaim();
+    }
+
+    return;
+
+}
+
+
+/**
+ * my_malloc_stats() - displays stats on all the dynamically allocated memory occurring in the program
+ * 
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: displays in the terminal the total amount of memory blocks, free memory blocks, used memory blocks, amount of bytes used, and amount of bytes freed.
+ * In addition it also outputs the fragmentation occuring in the memory which is the percentage of free bytes from the total bytes dynamically allocated.
+ * Every lock of the allocator is held while the numbers are gathered so they describe one moment of the heap.
+ * The contention counters of each arena lock, and of the slab locks added together, are printed last.
+ * 
+ *           
+ */
+void my_malloc_stats(){
+
+    //Information on the current heap space
+    size_t total_blocks = 0;
+
+    size_t free_blocks = 0;
+
+    size_t used_blocks = 0;
+
+    size_t used_bytes = 0;
+
+    size_t free_bytes = 0;
+
+    allocator_lock_all();
+
+    //loop through the linked list of every arena to update the variables recording the heap space information
+    for (int i = 0; i < ARENA_COUNT; i++){
+
+        Block *current = arenas[i].head;
+
+        while (current != NULL){
+
+            total_blocks++;
+
+            if (current->free == 0){
+                used_blocks++;
+                used_bytes += current->size;
+            }
+
+            else if (current->free == 1){
+                free_blocks++;
+                free_bytes += current->size;
+            }
+
+            current = block_next(current);
+
+        }
+
+    }
+
+    //output information to the terminal
+    printf("\n============Malloc Stats==============\n");
+    printf("Total Blocks:               %zu\n", total_blocks);
+    printf("Used Blocks:                %zu\n", used_blocks);
+    printf("Free Blocks:                %zu\n", free_blocks);
+    printf("Used Memory (B):            %zu\n", used_bytes);
+    printf("Free Memory (B):            %zu\n", free_bytes);
+    printf("Total Memory (B):           %zu\n", used_bytes + free_bytes);
+
+    //checking if any memory is allocated before doing fragmentation calculation
+    if ((used_bytes + free_bytes)>0){
+
+        //calculate the fragmentation in the heap and output to the terminal
+        float fragmentation = 100.0f *((float)(free_bytes)/(float)(free_bytes + used_bytes));
+        printf("fragmentation               %.2f%%\n", fragmentation);
+
+    }
+
+    //If no memory is allocated
+    else{
+        
+        printf("fragmentation           N/A\n");
+    }
+
+    //per class accounting comes straight from the run counters
+    printf("------------Slab Classes--------------\n");
+    printf("Class (B)   Runs   Used Slots   Free Slots   Batch   Transfer   Utilization\n");
+    for (unsigned int i = 0; i < slab_class_count; i++){
+        SlabClass *cls = &slab_classes[i];
+        if (cls->runs == 0){
+            continue;
+        }
+        TransferCache *tc = &transfer_caches[i];
+        unsigned int transfer = 0;
+        for (unsigned int b = 0; b < tc->used; b++){
+            transfer += tc->counts[b];
+        }
+        float utilization = 100.0f * ((float)cls->used_slots / (float)cls->total_slots);
+        printf("%-11zu %-6zu %-12zu %-12zu %-7u %-10u %.2f%%\n", slab_class_size[i], cls->runs, cls->used_slots, cls->total_slots - cls->used_slots, tc->batch_size, transfer, utilization);
+    }
+    printf("Empty Runs:                 %zu\n", slab_free_run_count);
+    printf("Purged Memory (B):          %zu\n", slab_purged_bytes);
+
+    //thread cache budgets, only the calling thread's own cache can be read
+    size_t unclaimed = __atomic_load_n(&thread_budget_unclaimed, __ATOMIC_RELAXED);
+    printf("------------Thread Caches-------------\n");
+    printf("Cache Cap (B):              %zu\n", (size_t)THREAD_CACHE_TOTAL_MAX);
+    printf("Claimed Budget (B):         %zu\n", (size_t)THREAD_CACHE_TOTAL_MAX - unclaimed);
+    printf("This Thread Cached (B):     %zu\n", thread_cache.bytes);
+    printf("This Thread Budget (B):     %zu\n", thread_cache.budget != NULL ? __atomic_load_n(thread_cache.budget, __ATOMIC_RELAXED) : 0);
+    printf("Arena Owners:              ");
+    for (int i = 0; i < ARENA_COUNT; i++){
+        printf(" %u", __atomic_load_n(&arenas[i].owners, __ATOMIC_RELAXED));
+    }
+    printf("\n");
+
+    //handles and what compaction has done with them
+    printf("------------Handles-------------------\n");
+    printf("Live Handles:               %zu\n", handle_live);
+    printf("Compaction Moves:           %zu\n", handle_moves);
+    printf("Moved Memory (B):           %zu\n", handle_moved_bytes);
+    printf("Trimmed Memory (B):         %zu\n", handle_trimmed_bytes);
+
+    //the heap limit and how close the heap is to it
+    printf("------------Limit---------------------\n");
+    printf("Limit Source:               %s\n", limit_source_names[limit_source]);
+    if (limit_bytes != 0){
+        printf("Limit (B):                  %zu\n", limit_bytes);
+        printf("Headroom (B):               %zu\n", (limit_footprint < limit_bytes) ? limit_bytes - limit_footprint : 0);
+    }
+    printf("Footprint (B):              %zu\n", limit_footprint);
+    printf("Refused Growths:            %zu\n", limit_refusals);
+    printf("Soft Limit Releases:        %zu\n", limit_soft_releases);
+    printf("Pressure Callbacks:         %zu\n", limit_callbacks);
+    printf("Failed Allocations:         %zu\n", limit_failures);
+
+    //stream buffers, open ones and sealed ones not freed yet
+    printf("------------Stream Buffers------------\n");
+    printf("Open Buffers:               %zu\n", stream_open_count);
+    printf("Sealed Buffers:             %zu\n", stream_sealed_count);
+    printf("Committed Memory (B):       %zu\n", stream_committed_bytes);
+    printf("Cached Memory (B):          %zu\n", stream_cached_bytes);
+    printf("Reused Mappings:            %zu\n", stream_reused);
+
+    //lifetime prediction and the chunks of short-lived allocations
+    size_t short_sites = 0;
+    for (int i = 0; i < CALLSITE_SITES; i++){
+        if (lifetime_sites[i].short_lived >= LIFETIME_MIN_SAMPLES && lifetime_sites[i].long_lived * 16 <= lifetime_sites[i].short_lived){
+            short_sites++;
+        }
+    }
+    printf("------------Lifetimes-----------------\n");
+    printf("Prediction:                 %s\n", lifetime_enabled ? "on" : "off");
+    printf("Short-Lived Callsites:      %zu\n", short_sites);
+    printf("Chunk Allocations:          %zu\n", lifetime_chunk_objects);
+    printf("Chunks In Use:              %zu\n", lifetime_chunks_carved - lifetime_free_count);
+    printf("Chunk Resets:               %zu\n", lifetime_chunk_resets);
+
+    //allocation tags, the per-tag counters are printed by my_malloc_dump_tags()
+    size_t used_tags = 0, tag_refusals = 0;
+    for (int i = 0; i < TAG_COUNT; i++){
+        if (tag_counts[i].total_bytes != 0){
+            used_tags++;
+        }
+        tag_refusals += tag_counts[i].refused;
+    }
+    printf("------------Tags----------------------\n");
+    printf("Tagging:                    %s\n", tag_enabled ? "on" : "off");
+    printf("Tags Used:                  %zu\n", used_tags);
+    printf("Tags With Limits:           %zu\n", tag_limits);
+    printf("Refused Allocations:        %zu\n", tag_refusals);
+
+    //guarded sampling, the allocations in the pool and the ones that did not get a slot
+    printf("------------Guarded Sampling----------\n");
+    printf("Sampling:                   %s\n", guard_enabled ? "on" : "off");
+    if (guard_enabled){
+        printf("Sample Rate:                1 in %u\n", guard_rate);
+    }
+    printf("Guarded Allocations:        %zu\n", guard_allocations);
+    printf("Guarded Live:               %zu\n", guard_live);
+    printf("Missed Samples:             %zu\n", guard_misses);
+
+    //deferred frees of the epoch-based reclamation
+    printf("------------Epochs--------------------\n");
+    printf("Global Epoch:               %zu\n", epoch_global);
+    printf("Retired, Pending:           %zu\n", epoch_pending);
+    printf("Retired, Reclaimed:         %zu\n", epoch_reclaimed);
+
+    //lock contention, the acquisitions made by this function itself are included
+    printf("------------Lock Contention-----------\n");
+    printf("Lock        Taken        Contended    Spins        Sleeps\n");
+    for (int i = 0; i < ARENA_COUNT; i++){
+        AllocLock *lock = &arenas[i].lock;
+        printf("arena %-5d %-12zu %-12zu %-12zu %zu\n", i, lock->acquisitions, lock->contended, lock->spins, lock->sleeps);
+    }
+    AllocLock slab_total = slab_region_lock;
+    for (int i = 0; i < SLAB_MAX_CLASSES; i++){
+        slab_total.acquisitions += slab_classes[i].lock.acquisitions;
+        slab_total.contended += slab_classes[i].lock.contended;
+        slab_total.spins += slab_classes[i].lock.spins;
+        slab_total.sleeps += slab_classes[i].lock.sleeps;
+    }
+    printf("slab        %-12zu %-12zu %-12zu %zu\n", slab_total.acquisitions, slab_total.contended, slab_total.spins, slab_total.sleeps);
+
+    printf("=====================================\n\n");
+
+    allocator_unlock_all();
+
+    return;
+}
+
+
+
+/*
+ * ---------------------------------------------------------------------------------------------
+ * Heap fragmentation analysis
+ * ---------------------------------------------------------------------------------------------
+ * my_malloc_stats() only says how much of the heap is free, not whether that free space can be used. The analysis
+ * copies the address, size and state of every Block into a snapshot first, then computes everything from the copy,
+ * so the heap itself is only walked once and for as short a time as possible.
+ */
+
+#define ANALYSIS_HISTOGRAM_BUCKETS 20//free block sizes are counted in power of two buckets starting at ALIGNMENT bytes
+
+typedef struct block_snapshot_type{
+    char *address;//address of the Block header
+
+    size_t size;//payload size of the block
+
+    unsigned int free;//1 if the block was free when the snapshot was taken
+
+}BlockSnapshot;
+
+typedef struct heap_analysis_type{
+    size_t heap_bytes;//bytes covered by the Block list, headers included
+
+    size_t used_blocks;//Block list blocks in use
+
+    size_t free_blocks;//Block list blocks that are free
+
+    size_t used_bytes;//payload bytes of used blocks
+
+    size_t free_bytes;//payload bytes of free blocks
+
+    size_t largest_free;//payload size of the largest free block
+
+    size_t free_histogram[ANALYSIS_HISTOGRAM_BUCKETS];//number of free blocks with a size in [8 << i, 8 << (i + 1))
+
+    float unusable_free_index;//1 - largest_free / free_bytes, 0 means all free space is one block
+
+    size_t metadata_bytes;//Block headers plus run headers and bitmaps
+
+    float metadata_overhead;//metadata_bytes as a fraction of all memory managed by the allocator
+
+    size_t heap_pages;//pages touched by the Block list
+
+    size_t heap_free_pages;//whole pages that lie inside free block payloads and hold no live data
+
+    size_t slab_runs;//runs currently owned by a size class
+
+    size_t slab_pages;//pages of those runs
+
+    size_t slab_free_pages;//pages of those runs that hold no used slot
+
+    size_t slab_used_bytes;//bytes of slots handed out to the user
+
+    size_t slab_free_bytes;//bytes of free slots in runs owned by a size class
+
+}HeapAnalysis;
+
+
+
+/**
+ * histogram_bucket() - finds the histogram bucket of a free block size
+ * 
+ * size_t size: payload size of a free block
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Returns floor(log2(size / ALIGNMENT)), clamped to the last bucket.
+ * 
+ * 
+ */
+static unsigned int histogram_bucket(size_t size){
+
+    unsigned int bucket = 0;
+
+    while (size >= (size_t)ALIGNMENT << (bucket + 1) && bucket < ANALYSIS_HISTOGRAM_BUCKETS - 1){
+        bucket++;
+    }
+
+    return bucket;
+
+}
+
+
+
+/**
+ * run_free_pages() - counts the pages of a run that hold no used slot
+ * 
+ * Run *run: run owned by a size class
+ * 
+ * size_t page: page size in bytes
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: A page counts as free when every slot that overlaps it is marked free in the bitmap. The page holding the
+ * run header is never free.
+ * 
+ * 
+ */
+static size_t run_free_pages(Run *run, size_t page){
+
+    size_t free_pages = 0;
+    size_t header = (size_t)(run->slots - (char *)run);
+
+    for (size_t start = page; start < RUN_SIZE; start += page){
+
+        //slots overlapping [start, start + page)
+        if (start + page <= header){
+            continue;
+        }
+        size_t first = (start > header) ? (start - header) / run->slot_size : 0;
+        size_t end = (start + page - header + run->slot_size - 1) / run->slot_size;
+        if (end > run->total_slots){
+            end = run->total_slots;
+        }
+
+        int page_free = 1;
+        for (size_t slot = first; slot < end && page_free; slot++){
+            if (((run->bitmap[slot / 64] >> (slot % 64)) & 1) == 0){
+                page_free = 0;
+            }
+        }
+
+        free_pages += page_free;
+
+    }
+
+    return free_pages;
+
+}
+
+
+
+/**
+ * my_malloc_analyze() - measures how fragmented the heap is
+ * 
+ * HeapAnalysis *analysis: filled in with the results
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Copies the Blocks of each arena into a snapshot taken with mmap() so the analysis does not allocate from the
+ * heap it is measuring and only holds the arena's lock while copying, then computes from the copies the largest free block, a histogram of free block sizes, the unusable free index,
+ * the metadata overhead and how many pages of the Block list and the slab runs hold no live data. Runs are read straight
+ * from their headers under the slab locks since their counters are already maintained. Returns 0 on success and -1 if the snapshot could not be
+ * taken.
+ * 
+ * 
+ */
+int my_malloc_analyze(HeapAnalysis *analysis){
+
+    memset(analysis, 0, sizeof(*analysis));
+
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+
+    for (int a = 0; a < ARENA_COUNT; a++){
+
+        //take the snapshot of the arena, only this part holds the arena's lock
+        Arena *arena = &arenas[a];
+        lock_acquire(&arena->lock);
+
+        size_t count = 0;
+        for (Block *current = arena->head; current != NULL; current = block_next(current)){
+            count++;
+        }
+
+        BlockSnapshot *snapshot = NULL;
+        size_t snapshot_bytes = count * sizeof(BlockSnapshot);
+        if (count > 0){
+            snapshot = mmap(NULL, snapshot_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (snapshot == MAP_FAILED){
+                lock_release(&arena->lock);
+                perror("mmap error");
+                return -1;
+            }
+
+            size_t i = 0;
+            for (Block *current = arena->head; current != NULL; current = block_next(current), i++){
+                snapshot[i].address = (char *)current;
+                snapshot[i].size = current->size;
+                snapshot[i].free = current->free;
+            }
+        }
+
+        lock_release(&arena->lock);
+
+        //everything below works on the copy
+        for (size_t i = 0; i < count; i++){
+
+            analysis->heap_bytes += sizeof(Block) + snapshot[i].size;
+            analysis->metadata_bytes += sizeof(Block);
+
+            if (snapshot[i].free == 0){
+                analysis->used_blocks++;
+                analysis->used_bytes += snapshot[i].size;
+                continue;
+            }
+
+            analysis->free_blocks++;
+            analysis->free_bytes += snapshot[i].size;
+            analysis->free_histogram[histogram_bucket(snapshot[i].size)]++;
+            if (snapshot[i].size > analysis->largest_free){
+                analysis->largest_free = snapshot[i].size;
+            }
+
+            //whole pages inside the payload could be handed back to the OS without moving anything
+            uintptr_t payload = (uintptr_t)(snapshot[i].address + sizeof(Block));
+            uintptr_t first_page = (payload + page - 1) & ~(uintptr_t)(page - 1);
+            uintptr_t end_page = (payload + snapshot[i].size) & ~(uintptr_t)(page - 1);
+            if (end_page > first_page){
+                analysis->heap_free_pages += (end_page - first_page) / page;
+            }
+
+        }
+
+        if (snapshot != NULL){
+            munmap(snapshot, snapshot_bytes);
+        }
+
+    }
+
+    analysis->heap_pages = (analysis->heap_bytes + page - 1) / page;
+
+    if (analysis->free_bytes > 0){
+        analysis->unusable_free_index = 1.0f - (float)analysis->largest_free / (float)analysis->free_bytes;
+    }
+
+    //runs are laid out back to back from slab_base, every run below slab_next_run has a valid header
+    size_t run_header = (sizeof(Run) + RUN_SLOT_ALIGN - 1) & ~(size_t)(RUN_SLOT_ALIGN - 1);
+    slab_lock_all();
+    for (char *address = slab_base; address != NULL && address < slab_next_run; address += RUN_SIZE){
+
+        Run *run = (Run *)address;
+        if (run->free_slots == run->total_slots){
+            continue;
+        }
+
+        analysis->slab_runs++;
+        analysis->slab_pages += RUN_SIZE / page;
+        analysis->slab_free_pages += run_free_pages(run, page);
+        analysis->slab_used_bytes += (size_t)(run->total_slots - run->free_slots) * run->slot_size;
+        analysis->slab_free_bytes += (size_t)run->free_slots * run->slot_size;
+        analysis->metadata_bytes += run_header;
+
+    }
+    slab_unlock_all();
+
+    size_t managed = analysis->heap_bytes + analysis->slab_runs * RUN_SIZE;
+    if (managed > 0){
+        analysis->metadata_overhead = (float)analysis->metadata_bytes / (float)managed;
+    }
+
+    return 0;
+
+}
+
+
+
+/**
+ * my_malloc_print_analysis() - displays the results of my_malloc_analyze()
+ * 
+ * const HeapAnalysis *analysis: results to display
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Prints the heap analysis in the same layout as my_malloc_stats(), with one histogram line per non-empty bucket.
+ * 
+ * 
+ */
+void my_malloc_print_analysis(const HeapAnalysis *analysis){
+
+    printf("\n============Heap Analysis=============\n");
+    printf("Heap Size (B):              %zu\n", analysis->heap_bytes);
+    printf("Used Blocks:                %zu\n", analysis->used_blocks);
+    printf("Free Blocks:                %zu\n", analysis->free_blocks);
+    printf("Free Memory (B):            %zu\n", analysis->free_bytes);
+    printf("Largest Free Block (B):     %zu\n", analysis->largest_free);
+    printf("Unusable Free Index:        %.4f\n", analysis->unusable_free_index);
+    printf("Metadata (B):               %zu\n", analysis->metadata_bytes);
+    printf("Metadata Overhead:          %.2f%%\n", 100.0f * analysis->metadata_overhead);
+    printf("Heap Pages:                 %zu\n", analysis->heap_pages);
+    printf("Heap Free Pages:            %zu\n", analysis->heap_free_pages);
+    printf("Slab Runs:                  %zu\n", analysis->slab_runs);
+    printf("Slab Pages:                 %zu\n", analysis->slab_pages);
+    printf("Slab Free Pages:            %zu\n", analysis->slab_free_pages);
+    printf("Slab Used Memory (B):       %zu\n", analysis->slab_used_bytes);
+    printf("Slab Free Memory (B):       %zu\n", analysis->slab_free_bytes);
+
+    printf("------------Free Block Sizes----------\n");
+    for (unsigned int i = 0; i < ANALYSIS_HISTOGRAM_BUCKETS; i++){
+        if (analysis->free_histogram[i] == 0){
+            continue;
+        }
+        if (i == ANALYSIS_HISTOGRAM_BUCKETS - 1){
+            printf("%-10zu + %-10s  %zu\n", (size_t)ALIGNMENT << i, "", analysis->free_histogram[i]);
+        }
+        else{
+            printf("%-10zu - %-10zu  %zu\n", (size_t)ALIGNMENT << i, ((size_t)ALIGNMENT << (i + 1)) - 1, analysis->free_histogram[i]);
+        }
+    }
+
+    printf("=====================================\n\n");
+
+    return;
+
+}
+
+
+
+/*
+ * ---------------------------------------------------------------------------------------------
+ * Heap snapshots
+ * ---------------------------------------------------------------------------------------------
+ * my_malloc_snapshot() writes every live allocation to a file with its address, usable size, callsite and tag. Two
+ * snapshots taken hours apart are compared by "my_malloc snapshot-diff", which shows the size classes and callsites
+ * that grew in between. Blocks are read from each arena's list under that arena's lock and slab slots from the bitmaps
+ * of their runs under the slab locks, so every allocation is seen, not a sample. Records are binary and go through a
+ * buffer taken with mmap() straight to write(), so the snapshot never allocates from the heap it describes and runs
+ * about as fast as the disk. Callsites are stored by name, which stays the same between runs of one program. A slab
+ * slot waiting in a thread cache or a transfer cache still looks allocated to its run but is free memory to the program,
+ * so it is left out: slots in the transfer caches and the calling thread's cache are looked up under the slab locks,
+ * and slots in other threads' caches carry the double free mark, except 8-byte slots, which have no room for it and
+ * still count. Objects of lifetime chunks are read from the chunks in use, guarded allocations from the pool's slots and
+ * sealed stream buffers from the set kept of them, since none of them is on an arena list.
+ */
+
+#define SNAPSHOT_MAGIC "MYSNAP1\n"//first 8 bytes of a snapshot file
+
+#define SNAPSHOT_BUFFER_BYTES (1024 * 1024)//bytes collected before each write()
+
+#define SNAPSHOT_SMALL_KEYS (SLAB_MAX_SIZE / ALIGNMENT + 1)//size groups of the diff with one exact size each
+
+#define SNAPSHOT_SIZE_KEYS (SNAPSHOT_SMALL_KEYS + ANALYSIS_HISTOGRAM_BUCKETS)//exact sizes, then one group per power of two
+
+typedef struct snapshot_header_type{
+    char magic[8];//SNAPSHOT_MAGIC
+
+    uint32_t sites;//callsite names that follow the header
+
+    uint32_t record_bytes;//size of a SnapshotRecord for the program that wrote the file
+
+}SnapshotHeader;
+
+typedef struct snapshot_record_type{
+    uint64_t address;//address handed to the program
+
+    uint64_t size;//usable size
+
+    uint16_t site;//callsite table entry, CALLSITE_UNTRACKED without MY_MALLOC_CALLSITES
+
+    uint16_t tag;//tag it is charged to, TAG_UNTRACKED without MY_MALLOC_TAGS
+
+    uint32_t unused;//keeps records 8-byte aligned
+
+}SnapshotRecord;
+
+typedef struct snapshot_writer_type{
+    int fd;//file being written
+
+    char *buffer;//SNAPSHOT_BUFFER_BYTES taken with mmap()
+
+    size_t used;//bytes waiting in the buffer
+
+    int failed;//1 once a write() failed
+
+}SnapshotWriter;
+
+typedef struct snapshot_file_type{
+    void *map;//whole file mapped read-only
+
+    size_t bytes;//size of the file
+
+    const SnapshotRecord *records;//records after the names
+
+    size_t count;//number of records
+
+    const char *names[CALLSITE_SITES];//name of each callsite entry, NULL if the file has none
+
+    uint16_t name_lengths[CALLSITE_SITES];//length of each name, without a terminating zero
+
+}SnapshotFile;
+
+typedef struct snapshot_group_type{
+    const char *name;//callsite name, NULL for sizes and for allocations without a callsite
+
+    size_t name_length;//length of name
+
+    size_t key;//size key of a size group
+
+    size_t count[2];//allocations in the first and second snapshot
+
+    size_t bytes[2];//usable bytes in the first and second snapshot
+
+}SnapshotGroup;
+
+
+
+/**
+ * snapshot_flush() - writes out the buffered bytes
+ * 
+ * SnapshotWriter *writer: snapshot being written
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Retries short writes and EINTR, and marks the writer failed on any other error.
+ * 
+ *           
+ */
+static void snapshot_flush(SnapshotWriter *writer){
+
+    size_t done = 0;
+
+    while (done < writer->used && !writer->failed){
+        ssize_t written = write(writer->fd, writer->buffer + done, writer->used - done);
+        if (written < 0 && errno == EINTR){
+            continue;
+        }
+        if (written <= 0){
+            perror("snapshot write error");
+            writer->failed = 1;
+            break;
+        }
+        done += (size_t)written;
+    }
+
+    writer->used = 0;
+
+    return;
+
+}
+
+
+
+/**
+ * snapshot_write() - adds bytes to a snapshot
+ * 
+ * SnapshotWriter *writer: snapshot being written
+ * 
+ * const void *data: bytes to add
+ * 
+ * size_t bytes: number of bytes, at most SNAPSHOT_BUFFER_BYTES
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Copies the bytes into the buffer, writing the buffer out first when they do not fit.
+ * 
+ *           
+ */
+static inline void snapshot_write(SnapshotWriter *writer, const void *data, size_t bytes){
+
+    if (writer->used + bytes > SNAPSHOT_BUFFER_BYTES){
+        snapshot_flush(writer);
+    }
+
+    memcpy(writer->buffer + writer->used, data, bytes);
+    writer->used += bytes;
+
+    return;
+
+}
+
+
+
+/**
+ * snapshot_allocation() - adds one live allocation to a snapshot
+ * 
+ * SnapshotWriter *writer: snapshot being written
+ * 
+ * void *ptr: the allocation
+ * 
+ * size_t size: its usable size
+ * 
+ * unsigned short site: its callsite entry
+ * 
+ * unsigned short tag: its tag
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Writes one SnapshotRecord.
+ * 
+ *           
+ */
+static inline void snapshot_allocation(SnapshotWriter *writer, void *ptr, size_t size, unsigned short site, unsigned short tag){
+
+    SnapshotRecord record = {(uint64_t)(uintptr_t)ptr, size, site, tag, 0};
+
+    snapshot_write(writer, &record, sizeof(record));
+
+    return;
+
+}
+
+
+
+/**
+ * snapshot_mark_cached() - marks the slots of a cached list in a bitmap of the slab region
+ * 
+ * uint64_t *cached: one bit per ALIGNMENT bytes of the slab region
+ * 
+ * void *list: slots linked through their first word
+ * 
+ * unsigned int count: slots in the list
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: The list must not change while it is read, so it has to be a transfer cache batch under the slab locks or
+ * the calling thread's own cache.
+ * 
+ *           
+ */
+static void snapshot_mark_cached(uint64_t *cached, void *list, unsigned int count){
+
+    for (unsigned int i = 0; i < count && list != NULL; i++, list = *(void **)list){
+        size_t index = (size_t)((char *)list - slab_base) / ALIGNMENT;
+        cached[index / 64] |= (uint64_t)1 << (index % 64);
+    }
+
+    return;
+
+}
+
+
+
+/**
+ * snapshot_block() - adds one live allocation with a Block header outside the arena lists to a snapshot
+ * 
+ * SnapshotWriter *writer: snapshot being written
+ * 
+ * Block *block: header of the allocation
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: The callsite and tag are written into the header only after the allocation is handed out, so like a slab
+ * slot without shadow entries an allocation that has none yet is left out.
+ * 
+ *           
+ */
+static void snapshot_block(SnapshotWriter *writer, Block *block){
+
+    unsigned short site = callsite_enabled ? block->site : CALLSITE_UNTRACKED;
+    unsigned short tag = tag_enabled ? block->tag : TAG_UNTRACKED;
+    if ((tag_enabled && tag == TAG_UNTRACKED) || (callsite_enabled && site == CALLSITE_UNTRACKED)){
+        return;
+    }
+
+    snapshot_allocation(writer, block + 1, block->size, site, tag);
+
+    return;
+
+}
+
+
+
+/**
+ * snapshot_chunks() - adds the live objects of every lifetime chunk to a snapshot
+ * 
+ * SnapshotWriter *writer: snapshot being written
+ * 
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: A chunk in use is held with a reference of its own while its objects are read, so it cannot be reset and
+ * reused under the walk. Objects are found one after the other from the start of the chunk, empty chunks are skipped.
+ * 
+ *           
+ */
+static void snapshot_chunks(SnapshotWriter *writer){
+
+    lock_acquire(&lifetime_lock);
+    char *base = lifetime_base;
+    char *end = lifetime_next;
+    lock_release(&lifetime_lock);
+
+    for (char *address = base; address != NULL && address < end; address += LIFETIME_CHUNK_SIZE){
+
+        LifetimeChunk *chunk = (LifetimeChunk *)address;
+        size_t live = __atomic_load_n(&chunk->live, __ATOMIC_ACQUIRE);
+        while (live != 0 && !__atomic_compare_exchange_n(&chunk->live, &live, live + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)){
+        }
+        if (live == 0){
+            continue;
+        }
+
+        size_t used = __atomic_load_n(&chunk->used, __ATOMIC_ACQUIRE);
+        for (size_t offset = ALIGN(sizeof(LifetimeChunk)); offset < used; ){
+            Block *block = (Block *)(address + offset);
+            offset += sizeof(Block) + block->size;
+            if (__atomic_load_n(&block->free, __ATOMIC_RELAXED) == 0){
+                snapshot_block(writer, block);
+            }
+        }
+
+        lifetime_chunk_put(chunk);
+
+    }
+
+    return;
+
+}
+
+
+
+/**
+ * my_malloc_snapshot() - writes every live allocation to a file
+ * 
+ * const char *path: file to create or replace
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Writes a SnapshotHeader, the name of every callsite entry in use, then one SnapshotRecord per live Block,
+ * allocated slab slot that is not cached, lifetime chunk object, guarded allocation and sealed stream buffer. Each
+ * arena, the slab region, every chunk, the guarded pool and the sealed buffer set are only held while their own
+ * allocations are written, so the snapshot is not one instant of a busy program, but every allocation that stays live
+ * throughout is in it exactly once. Returns 0 on success and -1 if the file could not be written.
+ * 
+ *           
+ */
+int my_malloc_snapshot(const char *path){
+
+    static void *addresses[CALLSITE_SITES];
+
+    SnapshotWriter writer = {-1, NULL, 0, 0};
+
+    writer.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (writer.fd < 0){
+        perror("snapshot error");
+        return -1;
+    }
+
+    writer.buffer = mmap(NULL, SNAPSHOT_BUFFER_BYTES, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (writer.buffer == MAP_FAILED){
+        perror("mmap error");
+        close(writer.fd);
+        return -1;
+    }
+
+    //the table only grows, a copy keeps the count in the header and the names written after it the same
+    uint32_t sites = 0;
+    for (unsigned int i = CALLSITE_OTHER; i < CALLSITE_SITES; i++){
+        addresses[i] = callsite_enabled ? __atomic_load_n(&callsite_addresses[i], __ATOMIC_RELAXED) : NULL;
+        sites += (addresses[i] != NULL || (callsite_enabled && i == CALLSITE_OTHER));
+    }
+
+    SnapshotHeader header = {SNAPSHOT_MAGIC, sites, sizeof(SnapshotRecord)};
+    snapshot_write(&writer, &header, sizeof(header));
+
+    size_t written = sizeof(header);
+    for (unsigned int i = CALLSITE_OTHER; i < CALLSITE_SITES && callsite_enabled; i++){
+
+        if (addresses[i] == NULL && i != CALLSITE_OTHER){
+            continue;
+        }
+
+        char name[CALLSITE_NAME_BYTES];
+        callsite_name(addresses[i], name, sizeof(name));
+        uint16_t entry[2] = {(uint16_t)i, (uint16_t)strlen(name)};
+        snapshot_write(&writer, entry, sizeof(entry));
+        snapshot_write(&writer, name, entry[1]);
+        written += sizeof(entry) + entry[1];
+
+    }
+
+    //records start 8-byte aligned so the diff can read them in place
+    static const char padding[8];
+    snapshot_write(&writer, padding, (8 - written % 8) % 8);
+
+    for (int a = 0; a < ARENA_COUNT; a++){
+
+        Arena *arena = &arenas[a];
+        lock_acquire(&arena->lock);
+        for (Block *current = arena->head; current != NULL; current = block_next(current)){
+            if (current->free == 0){
+                snapshot_allocation(&writer, current + 1, current->size, callsite_enabled ? current->site : CALLSITE_UNTRACKED,
+                        tag_enabled ? current->tag : TAG_UNTRACKED);
+            }
+        }
+        lock_release(&arena->lock);
+
+    }
+
+    //taken before the locks, only the pages for the runs in use are ever touched
+    uint64_t *cached = mmap(NULL, SLAB_REGION_SIZE / ALIGNMENT / 8, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (cached == MAP_FAILED){
+        perror("mmap error");
+        cached = NULL;
+    }
+
+    slab_lock_all();
+    for (unsigned int i = 0; i < slab_class_count && cached != NULL; i++){
+        TransferCache *tc = &transfer_caches[i];
+        for (unsigned int b = 0; b < tc->used; b++){
+            snapshot_mark_cached(cached, tc->batches[b], tc->counts[b]);
+        }
+        snapshot_mark_cached(cached, thread_cache.bins[i].head, thread_cache.bins[i].count);
+    }
+
+    for (char *address = slab_base; address != NULL && address < slab_next_run; address += RUN_SIZE){
+
+        Run *run = (Run *)address;
+        if (run->free_slots == run->total_slots){
+            continue;
+        }
+
+        for (unsigned int w = 0; w * 64 < run->total_slots; w++){
+
+            //a clear bit is a slot taken from the run, bits past the last slot are clear too
+            uint64_t taken = ~run->bitmap[w];
+            if (run->total_slots - w * 64 < 64){
+                taken &= ((uint64_t)1 << (run->total_slots - w * 64)) - 1;
+            }
+
+            while (taken != 0){
+
+                unsigned int slot = w * 64 + (unsigned int)__builtin_ctzll(taken);
+                taken &= taken - 1;
+
+                char *ptr = run->slots + (size_t)slot * run->slot_size;
+                size_t index = (size_t)(ptr - slab_base) / ALIGNMENT;
+                if ((cached != NULL && (cached[index / 64] >> (index % 64) & 1))
+                        || (run->slot_size >= 2 * sizeof(void *) && ((uintptr_t *)ptr)[1] == thread_cache_key)){
+                    continue;
+                }
+                unsigned short site = callsite_enabled ? callsite_shadow[index] : CALLSITE_UNTRACKED;
+                unsigned short tag = tag_enabled ? tag_shadow[index] : TAG_UNTRACKED;
+                if ((tag_enabled && tag == TAG_UNTRACKED) || (callsite_enabled && site == CALLSITE_UNTRACKED)){
+                    continue;
+                }
+
+                snapshot_allocation(&writer, ptr, run->slot_size, site, tag);
+
+            }
+
+        }
+
+    }
+    slab_unlock_all();
+
+    if (cached != NULL){
+        munmap(cached, SLAB_REGION_SIZE / ALIGNMENT / 8);
+    }
+
+    snapshot_chunks(&writer);
+
+    lock_acquire(&guard_lock);
+    for (unsigned int i = 0; i < guard_unused; i++){
+        if (guard_slots[i].state == GUARD_LIVE){
+            snapshot_block(&writer, (Block *)guard_slots[i].ptr - 1);
+        }
+    }
+    lock_release(&guard_lock);
+
+    lock_acquire(&stream_lock);
+    for (size_t i = 0; i < stream_sealed_capacity; i++){
+        if (stream_sealed[i] != NULL){
+            snapshot_block(&writer, stream_sealed[i]);
+        }
+    }
+    lock_release(&stream_lock);
+
+    snapshot_flush(&writer);
+    munmap(writer.buffer, SNAPSHOT_BUFFER_BYTES);
+    if (close(writer.fd) != 0 && !writer.failed){
+        perror("snapshot error");
+        writer.failed = 1;
+    }
+
+    return writer.failed ? -1 : 0;
+
+}
+
+
+
+/**
+ * snapshot_load() - maps a snapshot file and finds its names and records
+ * 
+ * const char *path: snapshot written by my_malloc_snapshot()
+ * 
+ * SnapshotFile *file: filled in, release it with munmap() of file->map
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: The file is mapped rather than read so the records of a large heap are only paged in as the diff goes
+ * through them. Returns 0 on success and -1 if the file cannot be read or is not a snapshot.
+ * 
+ *           
+ */
+static int snapshot_load(const char *path, SnapshotFile *file){
+
+    memset(file, 0, sizeof(*file));
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0){
+        perror("snapshot error");
+        return -1;
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(SnapshotHeader)){
+        fprintf(stderr,"%s is not a heap snapshot\n", path);
+        close(fd);
+        return -1;
+    }
+
+    file->bytes = (size_t)info.st_size;
+    file->map = mmap(NULL, file->bytes, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (file->map == MAP_FAILED){
+        perror("mmap error");
+        return -1;
+    }
+
+    const char *base = file->map;
+    const SnapshotHeader *header = file->map;
+    if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0 || header->record_bytes != sizeof(SnapshotRecord)){
+        fprintf(stderr,"%s is not a heap snapshot\n", path);
+        munmap(file->map, file->bytes);
+        return -1;
+    }
+
+    size_t offset = sizeof(SnapshotHeader);
+    for (uint32_t i = 0; i < header->sites; i++){
+
+        uint16_t entry[2];
+        if (offset + sizeof(entry) > file->bytes){
+            break;
+        }
+        memcpy(entry, base + offset, sizeof(entry));
+        offset += sizeof(entry);
+
+        if (entry[0] < CALLSITE_SITES && offset + entry[1] <= file->bytes){
+            file->names[entry[0]] = base + offset;
+            file->name_lengths[entry[0]] = entry[1];
+        }
+        offset += entry[1];
+
+    }
+
+    offset = (offset + 7) & ~(size_t)7;
+    file->records = (const SnapshotRecord *)(base + offset);
+    file->count = (offset < file->bytes) ? (file->bytes - offset) / sizeof(SnapshotRecord) : 0;
+
+    return 0;
+
+}
+
+
+
+/**
+ * snapshot_size_key() - finds the size group of an allocation
+ * 
+ * size_t size: usable size
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Sizes up to SLAB_MAX_SIZE, which are slab classes for slab slots, each get their own group, larger ones
+ * are grouped by power of two like histogram_bucket().
+ * 
+ *           
+ */
+static size_t snapshot_size_key(size_t size){
+
+    if (size <= SLAB_MAX_SIZE){
+        return size / ALIGNMENT;
+    }
+
+    return SNAPSHOT_SMALL_KEYS + histogram_bucket(size);
+
+}
+
+
+
+/**
+ * snapshot_group_compare() - orders groups by growth in bytes, largest first
+ * 
+ * const void *a: first SnapshotGroup
+ * 
+ * const void *b: second SnapshotGroup
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: qsort() comparison, ties are broken by the bytes in the second snapshot.
+ * 
+ *           
+ */
+static int snapshot_group_compare(const void *a, const void *b){
+
+    const SnapshotGroup *x = (const SnapshotGroup *)a, *y = (const SnapshotGroup *)b;
+    long long x_change = (long long)x->bytes[1] - (long long)x->bytes[0];
+    long long y_change = (long long)y->bytes[1] - (long long)y->bytes[0];
+
+    if (x_change != y_change){
+        return (x_change < y_change) ? 1 : -1;
+    }
+    if (x->bytes[1] != y->bytes[1]){
+        return (x->bytes[1] < y->bytes[1]) ? 1 : -1;
+    }
+
+    return 0;
+
+}
+
+
+
+/**
+ * my_malloc_snapshot_diff() - prints what grew between two snapshots
+ * 
+ * const char *before: older snapshot
+ * 
+ * const char *after: newer snapshot
+ * 
+ * FILE *out: stream to print to
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Adds up the allocations of both snapshots by size group and by callsite name, then prints both tables
+ * sorted by the growth in bytes, so the sizes and callsites that leak or creep come first. Callsites of the two files
+ * are matched by name, allocations without a callsite form one group. Returns 0 on success and -1 if either file cannot
+ * be read.
+ * 
+ *           
+ */
+int my_malloc_snapshot_diff(const char *before, const char *after, FILE *out){
+
+    static SnapshotFile files[2];
+    static SnapshotGroup sizes[SNAPSHOT_SIZE_KEYS];
+    static SnapshotGroup sites[2 * CALLSITE_SITES + 1];
+    static unsigned int site_groups[CALLSITE_SITES];
+
+    if (snapshot_load(before, &files[0]) != 0){
+        return -1;
+    }
+    if (snapshot_load(after, &files[1]) != 0){
+        munmap(files[0].map, files[0].bytes);
+        return -1;
+    }
+
+    memset(sizes, 0, sizeof(sizes));
+    memset(sites, 0, sizeof(sites));
+    for (size_t k = 0; k < SNAPSHOT_SIZE_KEYS; k++){
+        sizes[k].key = k;
+    }
+
+    //group 0 holds the allocations without a callsite, the others are one per distinct name
+    size_t site_count = 1;
+    size_t totals[2][2] = {{0, 0}, {0, 0}};
+
+    for (int f = 0; f < 2; f++){
+
+        const SnapshotFile *file = &files[f];
+
+        for (unsigned int i = 0; i < CALLSITE_SITES; i++){
+
+            site_groups[i] = 0;
+            if (file->names[i] == NULL){
+                continue;
+            }
+
+            size_t g = 1;
+            while (g < site_count && (sites[g].name_length != file->name_lengths[i]
+                    || memcmp(sites[g].name, file->names[i], sites[g].name_length) != 0)){
+                g++;
+            }
+            if (g == site_count){
+                sites[g].name = file->names[i];
+                sites[g].name_length = file->name_lengths[i];
+                site_count++;
+            }
+            site_groups[i] = (unsigned int)g;
+
+        }
+
+        for (size_t r = 0; r < file->count; r++){
+
+            const SnapshotRecord *record = &file->records[r];
+            SnapshotGroup *size = &sizes[snapshot_size_key(record->size)];
+            SnapshotGroup *site = &sites[record->site < CALLSITE_SITES ? site_groups[record->site] : 0];
+
+            size->count[f]++;
+            size->bytes[f] += record->size;
+            site->count[f]++;
+            site->bytes[f] += record->size;
+            totals[f][0]++;
+            totals[f][1] += record->size;
+
+        }
+
+    }
+
+    qsort(sizes, SNAPSHOT_SIZE_KEYS, sizeof(SnapshotGroup), snapshot_group_compare);
+    qsort(sites, site_count, sizeof(SnapshotGroup), snapshot_group_compare);
+
+    fprintf(out, "\n============Snapshot Diff=============\n");
+    fprintf(out, "Before:                     %zu allocations, %zu B\n", totals[0][0], totals[0][1]);
+    fprintf(out, "After:                      %zu allocations, %zu B\n", totals[1][0], totals[1][1]);
+
+    fprintf(out, "------------By Size-------------------\n");
+    fprintf(out, "Change (B)   Change   After (B)    After    Size (B)\n");
+    for (size_t i = 0; i < SNAPSHOT_SIZE_KEYS; i++){
+
+        const SnapshotGroup *g = &sizes[i];
+        if (g->count[0] == 0 && g->count[1] == 0){
+            continue;
+        }
+
+        fprintf(out, "%-12lld %-8lld %-12zu %-8zu ", (long long)g->bytes[1] - (long long)g->bytes[0],
+                (long long)g->count[1] - (long long)g->count[0], g->bytes[1], g->count[1]);
+        if (g->key < SNAPSHOT_SMALL_KEYS){
+            fprintf(out, "%zu\n", g->key * ALIGNMENT);
+        }
+        else if (g->key == SNAPSHOT_SIZE_KEYS - 1){
+            fprintf(out, "%zu +\n", (size_t)ALIGNMENT << (g->key - SNAPSHOT_SMALL_KEYS));
+        }
+        else{
+            fprintf(out, "%zu - %zu\n", (size_t)ALIGNMENT << (g->key - SNAPSHOT_SMALL_KEYS),
+                    ((size_t)ALIGNMENT << (g->key - SNAPSHOT_SMALL_KEYS + 1)) - 1);
+        }
+
+    }
+
+    fprintf(out, "------------By Callsite---------------\n");
+    fprintf(out, "Change (B)   Change   After (B)    After    Callsite\n");
+    for (size_t i = 0; i < site_count; i++){
+
+        const SnapshotGroup *g = &sites[i];
+        if (g->count[0] == 0 && g->count[1] == 0){
+            continue;
+        }
+
+        fprintf(out, "%-12lld %-8lld %-12zu %-8zu ", (long long)g->bytes[1] - (long long)g->bytes[0],
+                (long long)g->count[1] - (long long)g->count[0], g->bytes[1], g->count[1]);
+        if (g->name == NULL){
+            fprintf(out, "(no callsite, set MY_MALLOC_CALLSITES)\n");
+        }
+        else{
+            fprintf(out, "%.*s\n", (int)g->name_length, g->name);
+        }
+
+    }
+
+    fprintf(out, "=====================================\n\n");
+
+    munmap(files[0].map, files[0].bytes);
+    munmap(files[1].map, files[1].bytes);
+
+    return 0;
+
+}
+
+
+
+/*
+ * ---------------------------------------------------------------------------------------------
+ * glibc compatibility
+ * ---------------------------------------------------------------------------------------------
+ * Tools written for glibc read the heap through mallinfo2() and the XML of malloc_info(), tune it with mallopt() and
+ * hand memory back with malloc_trim(). The my_ versions answer from the allocator's own lists and counters: every arena
+ * is one <heap> of malloc_info(), the slab region is one more, and free slab slots stand in for glibc's fastbin chunks
+ * since they are the small, cached free memory of this allocator. Built with -DMY_MALLOC_GLIBC_NAMES the functions are
+ * also defined under glibc's names, which take the place of glibc's own in the program, so dashboards and tuning scripts
+ * that call them work unchanged.
+ */
+
+typedef struct heap_info_type{
+    size_t fast_count;//free slab slots
+
+    size_t fast_bytes;//bytes of the free slab slots
+
+    size_t rest_count;//free Blocks, or backed empty runs for the slab region
+
+    size_t rest_bytes;//bytes of the free Blocks or of the backed empty runs
+
+    size_t used_bytes;//bytes of Blocks and slab slots that are not free
+
+    size_t top_bytes;//size of a free last Block that arena_trim() could give back
+
+    size_t current;//bytes currently held from the OS
+
+    size_t max;//most bytes held from the OS at once
+
+    size_t sizes_count[ANALYSIS_HISTOGRAM_BUCKETS];//free Blocks per power of two bucket
+
+    size_t sizes_bytes[ANALYSIS_HISTOGRAM_BUCKETS];//bytes of the free Blocks per power of two bucket
+
+}HeapInfo;
+
+
+
+/**
+ * heap_info_arena() - adds up the free and used Blocks of an arena
+ * 
+ * Arena *arena: arena to read, its lock must be held
+ * 
+ * HeapInfo *info: zeroed, filled in
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Walks the arena's list once. The arena's peak is os_peak, which arena_trim() does not lower.
+ * 
+ *           
+ */
+static void heap_info_arena(Arena *arena, HeapInfo *info){
+
+    for (Block *current = arena->head; current != NULL; current = block_next(current)){
+        if (current->free == 1){
+            unsigned int bucket = histogram_bucket(current->size);
+            info->sizes_count[bucket]++;
+            info->sizes_bytes[bucket] += current->size;
+            info->rest_count++;
+            info->rest_bytes += current->size;
+        }
+        else{
+            info->used_bytes += current->size;
+        }
+    }
+
+    if (arena->last != NULL && arena->last->free == 1){
+        info->top_bytes = arena->last->size;
+    }
+
+    info->current = arena->os_bytes;
+    info->max = arena->os_peak;
+
+    return;
+
+}
+
+
+
+/**
+ * heap_info_slab() - adds up the slots and runs of the slab region
+ * 
+ * HeapInfo *info: zeroed, filled in
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Every slab lock must be held. Slots waiting in a thread or transfer cache count as used, like glibc's
+ * tcache chunks. An empty run that was purged only keeps its header page, the region's peak is every run ever carved.
+ * 
+ *           
+ */
+static void heap_info_slab(HeapInfo *info){
+
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+
+    for (unsigned int i = 0; i < slab_class_count; i++){
+        SlabClass *cls = &slab_classes[i];
+        info->fast_count += cls->total_slots - cls->used_slots;
+        info->fast_bytes += (cls->total_slots - cls->used_slots) * slab_class_size[i];
+        info->used_bytes += cls->used_slots * slab_class_size[i];
+    }
+
+    info->max = (slab_base != NULL) ? (size_t)(slab_next_run - slab_base) : 0;
+    info->current = info->max;
+    for (Run *run = slab_free_runs; run != NULL; run = run->next){
+        if (run->purged){
+            info->current -= RUN_SIZE - page;
+        }
+        else{
+            info->rest_count++;
+            info->rest_bytes += RUN_SIZE - page;
+        }
+    }
+
+    return;
+
+}
+
+
+
+/**
+ * my_mallinfo2() - returns the heap totals in glibc's struct mallinfo2
+ * 
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: arena is what the arenas and the slab region hold from the OS, hblks and hblkhd are the open and sealed
+ * stream buffers, which have a mapping of their own, and keepcost is the free tail of every arena. Every lock of the allocator is held
+ * while the numbers are gathered, as in my_malloc_stats().
+ * 
+ *           
+ */
+struct mallinfo2 my_mallinfo2(void){
+
+    struct mallinfo2 result;
+    memset(&result, 0, sizeof(result));
+
+    allocator_init();
+    allocator_lock_all();
+
+    HeapInfo info;
+    for (int i = 0; i <= ARENA_COUNT; i++){
+
+        memset(&info, 0, sizeof(info));
+        if (i < ARENA_COUNT){
+            heap_info_arena(&arenas[i], &info);
+        }
+        else{
+            heap_info_slab(&info);
+        }
+
+        result.arena += info.current;
+        result.ordblks += info.rest_count;
+        result.smblks += info.fast_count;
+        result.fsmblks += info.fast_bytes;
+        result.uordblks += info.used_bytes;
+        result.fordblks += info.fast_bytes + info.rest_bytes;
+        result.keepcost += info.top_bytes;
+
+    }
+
+    result.hblks = stream_open_count + stream_sealed_count;
+    result.hblkhd = stream_committed_bytes;
+
+    allocator_unlock_all();
+
+    return result;
+
+}
+
+
+
+/**
+ * my_malloc_info() - writes the state of the heap as glibc's malloc_info() XML
+ * 
+ * int options: must be 0
+ * 
+ * FILE *stream: stream to write to
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Writes one <heap> per arena, its free Blocks grouped by power of two, then one for the slab region with
+ * the free slots of every size class, then the totals. Returns 0, or -1 with errno set to EINVAL if options is not 0.
+ * 
+ *           
+ */
+int my_malloc_info(int options, FILE *stream){
+
+    if (options != 0){
+        errno = EINVAL;
+        return -1;
+    }
+
+    allocator_init();
+    allocator_lock_all();
+
+    HeapInfo info, total;
+    memset(&total, 0, sizeof(total));
+
+    fprintf(stream, "<malloc version=\"1\">\n");
+    for (int i = 0; i <= ARENA_COUNT; i++){
+
+        memset(&info, 0, sizeof(info));
+        fprintf(stream, "<heap nr=\"%d\">\n<sizes>\n", i);
+        if (i < ARENA_COUNT){
+            heap_info_arena(&arenas[i], &info);
+            for (unsigned int b = 0; b < ANALYSIS_HISTOGRAM_BUCKETS; b++){
+                if (info.sizes_count[b] != 0){
+                    fprintf(stream, "  <size from=\"%zu\" to=\"%zu\" total=\"%zu\" count=\"%zu\"/>\n", (size_t)ALIGNMENT << b,
+                            (b == ANALYSIS_HISTOGRAM_BUCKETS - 1) ? SIZE_MAX : ((size_t)ALIGNMENT << (b + 1)) - 1,
+                            info.sizes_bytes[b], info.sizes_count[b]);
+                }
+            }
+        }
+        else{
+            heap_info_slab(&info);
+            for (unsigned int c = 0; c < slab_class_count; c++){
+                size_t free_slots = slab_classes[c].total_slots - slab_classes[c].used_slots;
+                if (free_slots != 0){
+                    fprintf(stream, "  <size from=\"%zu\" to=\"%zu\" total=\"%zu\" count=\"%zu\"/>\n", slab_class_size[c],
+                            slab_class_size[c], free_slots * slab_class_size[c], free_slots);
+                }
+            }
+        }
+        fprintf(stream, "</sizes>\n");
+        fprintf(stream, "<total type=\"fast\" count=\"%zu\" size=\"%zu\"/>\n", info.fast_count, info.fast_bytes);
+        fprintf(stream, "<total type=\"rest\" count=\"%zu\" size=\"%zu\"/>\n", info.rest_count, info.rest_bytes);
+        fprintf(stream, "<system type=\"current\" size=\"%zu\"/>\n", info.current);
+        fprintf(stream, "<system type=\"max\" size=\"%zu\"/>\n", info.max);
+        fprintf(stream, "<aspace type=\"total\" size=\"%zu\"/>\n", info.current);
+        fprintf(stream, "<aspace type=\"mprotect\" size=\"%zu\"/>\n", info.current);
+        fprintf(stream, "</heap>\n");
+
+        total.fast_count += info.fast_count;
+        total.fast_bytes += info.fast_bytes;
+        total.rest_count += info.rest_count;
+        total.rest_bytes += info.rest_bytes;
+        total.current += info.current;
+        total.max += info.max;
+
+    }
+
+    fprintf(stream, "<total type=\"fast\" count=\"%zu\" size=\"%zu\"/>\n", total.fast_count, total.fast_bytes);
+    fprintf(stream, "<total type=\"rest\" count=\"%zu\" size=\"%zu\"/>\n", total.rest_count, total.rest_bytes);
+    fprintf(stream, "<total type=\"mmap\" count=\"%zu\" size=\"%zu\"/>\n", stream_open_count + stream_sealed_count, stream_committed_bytes);
+    fprintf(stream, "<system type=\"current\" size=\"%zu\"/>\n", total.current);
+    fprintf(stream, "<system type=\"max\" size=\"%zu\"/>\n", total.max);
+    fprintf(stream, "<aspace type=\"total\" size=\"%zu\"/>\n", total.current);
+    fprintf(stream, "<aspace type=\"mprotect\" size=\"%zu\"/>\n", total.current);
+    fprintf(stream, "</malloc>\n");
+
+    allocator_unlock_all();
+
+    return 0;
+
+}
+
+
+
+/**
+ * my_mallopt() - changes an allocator setting the way glibc's mallopt() does
+ * 
+ * int param: M_TRIM_THRESHOLD, M_TOP_PAD, M_ARENA_MAX, M_PERTURB, or a parameter that is accepted without effect
+ * 
+ * int value: new value
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Sets up the allocator first, so a setting made before the first allocation is not replaced by the
+ * MALLOC_*_ environment variables afterwards. See mallopt_set(). Returns 1 on success and 0 on error.
+ * 
+ *           
+ */
+int my_mallopt(int param, int value){
+
+    allocator_init();
+
+    return mallopt_set(param, value);
+
+}
+
+
+
+/**
+ * my_malloc_trim() - hands free memory back to the OS
+ * 
+ * size_t pad: bytes to keep at the free end of every arena
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Does everything heap_release() does, keeping pad bytes of each arena's free tail, then also gives back the
+ * whole pages inside every free Block with madvise(), like glibc's malloc_trim(). This covers a free tail that could not
+ * be cut off because something else moved the program break. Those pages stay part of their Block and are zero filled
+ * when touched again. Returns 1 if any memory was handed back and 0 otherwise.
+ * 
+ *           
+ */
+int my_malloc_trim(size_t pad){
+
+    allocator_init();
+
+    size_t released = heap_release(pad);
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+
+    for (int i = 0; i < ARENA_COUNT; i++){
+
+        Arena *arena = &arenas[i];
+        lock_acquire(&arena->lock);
+        for (Block *current = arena->head; current != NULL; current = block_next(current)){
+
+            if (current->free != 1){
+                continue;
+            }
+
+            size_t keep = (current == arena->last) ? pad : 0;
+            char *start = (char *)(((uintptr_t)(current + 1) + keep + page - 1) & ~(uintptr_t)(page - 1));
+            char *end = (char *)(((uintptr_t)(current + 1) + current->size) & ~(uintptr_t)(page - 1));
+            if (start < end && madvise(start, (size_t)(end - start), MADV_DONTNEED) == 0){
+                released += (size_t)(end - start);
+            }
+
+        }
+        lock_release(&arena->lock);
+
+    }
+
+    return released != 0;
+
+}
+
+
+
+#ifdef MY_MALLOC_GLIBC_NAMES
+struct mallinfo2 mallinfo2(void){
+    return my_mallinfo2();
+}
+
+int malloc_info(int options, FILE *stream){
+    return my_malloc_info(options, stream);
+}
+
+int mallopt(int param, int value){
+    return my_mallopt(param, value);
+}
+
+int malloc_trim(size_t pad){
+    return my_malloc_trim(pad);
+}
+#endif
+
+
+
+/*
+ * ---------------------------------------------------------------------------------------------
+ * Heap layout visualization
+ * ---------------------------------------------------------------------------------------------
+ * The Block list is drawn in list order as a strip of cells, each cell covering the same number of bytes and taking
+ * the kind of byte (header, used payload or free payload) that fills most of it. The ASCII dump prints the strip to a
+ * stream, the PPM dump writes it as an image with one pixel per N bytes for heaps too large to read as text.
+ */
+
+#define LAYOUT_HEADER 0//cell is mostly Block headers
+
+#define LAYOUT_USED 1//cell is mostly payload of used blocks
+
+#define LAYOUT_FREE 2//cell is mostly payload of free blocks
+
+#define LAYOUT_EMPTY 3//cell lies past the end of the heap
+
+#define PPM_WIDTH 512//width in pixels of a PPM heap dump
+
+static const char layout_chars[] = {'H', '#', '.', ' '};//ASCII cell for each LAYOUT_ kind
+
+static const unsigned char layout_colors[][3] = {{40, 90, 220}, {220, 50, 40}, {40, 200, 80}, {0, 0, 0}};//PPM colour for each LAYOUT_ kind
+
+
+
+/**
+ * layout_render() - walks the Block list of every arena and calls a function for every cell of the strip
+ * 
+ * size_t bytes_per_cell: number of heap bytes that one cell covers
+ * 
+ * void (*emit)(int kind, void *context): called once per cell, in order, with the LAYOUT_ kind of the cell
+ * 
+ * void *context: passed through to emit
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Splits every block into its header and payload, adds up how many bytes of each kind fall into the current
+ * cell, and emits the cell with the kind that covers the most bytes once it is full. The arenas follow each other in the
+ * strip. The caller holds every arena lock. Returns the number of cells emitted.
+ * 
+ * 
+ */
+static size_t layout_render(size_t bytes_per_cell, void (*emit)(int kind, void *context), void *context){
+
+    size_t cell_bytes[3] = {0, 0, 0};
+    size_t filled = 0, cells = 0;
+
+    for (int a = 0; a < ARENA_COUNT; a++){
+        for (Block *current = arenas[a].head; current != NULL; current = block_next(current)){
+
+            size_t span[2] = {sizeof(Block), current->size};
+            int kind[2] = {LAYOUT_HEADER, current->free == 1 ? LAYOUT_FREE : LAYOUT_USED};
+
+            for (int part = 0; part < 2; part++){
+                size_t remaining = span[part];
+                while (remaining > 0){
+                    size_t take = bytes_per_cell - filled;
+                    if (take > remaining){
+                        take = remaining;
+                    }
+                    cell_bytes[kind[part]] += take;
+                    filled += take;
+                    remaining -= take;
+
+                    //the cell is full, emit the kind that covers most of it
+                    if (filled == bytes_per_cell){
+                        int dominant = LAYOUT_HEADER;
+                        for (int k = 1; k < 3; k++){
+                            if (cell_bytes[k] > cell_bytes[dominant]){
+                                dominant = k;
+                            }
+                        }
+                        emit(dominant, context);
+                        cells++;
+                        cell_bytes[0] = cell_bytes[1] = cell_bytes[2] = 0;
+                        filled = 0;
+                    }
+                }
+            }
+
+        }
+    }
+
+    //emit the last, partly covered cell
+    if (filled > 0){
+        int dominant = LAYOUT_HEADER;
+        for (int k = 1; k < 3; k++){
+            if (cell_bytes[k] > cell_bytes[dominant]){
+                dominant = k;
+            }
+        }
+        emit(dominant, context);
+        cells++;
+    }
+
+    return cells;
+
+}
+
+
+
+typedef struct ascii_strip_type{
+    FILE *out;//stream the strip is printed to
+
+    size_t width;//cells per line
+
+    size_t column;//cells already printed on the current line
+
+}AsciiStrip;
+
+
+
+/**
+ * ascii_emit() - prints one cell of the ASCII strip
+ * 
+ * int kind: LAYOUT_ kind of the cell
+ * 
+ * void *context: the AsciiStrip being printed
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Prints the character for the cell and starts a new line every width cells.
+ * 
+ * 
+ */
+static void ascii_emit(int kind, void *context){
+
+    AsciiStrip *strip = (AsciiStrip *)context;
+
+    fputc(layout_chars[kind], strip->out);
+    strip->column++;
+    if (strip->column == strip->width){
+        fputc('\n', strip->out);
+        strip->column = 0;
+    }
+
+    return;
+
+}
+
+
+
+/**
+ * my_malloc_dump_ascii() - prints the heap layout as an ASCII strip
+ * 
+ * FILE *out: stream to print to
+ * 
+ * size_t width: number of characters per line
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Draws the Block list with one character per cell, 'H' for headers, '#' for used payload and '.' for free
+ * payload, sizing the cells so the whole heap fits in four lines. Each slab run is then drawn as one character giving how
+ * full it is in tenths, from '0' to '9', with '*' for a full run and '_' for an empty one.
+ * 
+ * 
+ */
+void my_malloc_dump_ascii(FILE *out, size_t width){
+
+    if (width == 0){
+        width = 64;
+    }
+
+    allocator_lock_all();
+
+    size_t heap_bytes = 0;
+    for (int a = 0; a < ARENA_COUNT; a++){
+        for (Block *current = arenas[a].head; current != NULL; current = block_next(current)){
+            heap_bytes += sizeof(Block) + current->size;
+        }
+    }
+
+    size_t bytes_per_cell = (heap_bytes + 4 * width - 1) / (4 * width);
+    if (bytes_per_cell < ALIGNMENT){
+        bytes_per_cell = ALIGNMENT;
+    }
+
+    fprintf(out, "\n============Heap Layout===============\n");
+    fprintf(out, "Heap: %zu B, 1 char = %zu B (H header, # used, . free)\n", heap_bytes, bytes_per_cell);
+
+    AsciiStrip strip = {out, width, 0};
+    layout_render(bytes_per_cell, ascii_emit, &strip);
+    if (strip.column != 0){
+        fputc('\n', out);
+    }
+
+    fprintf(out, "Slab runs (0-9 tenths full, * full, _ empty):\n");
+    size_t runs = 0;
+    for (char *address = slab_base; address != NULL && address < slab_next_run; address += RUN_SIZE){
+        Run *run = (Run *)address;
+        unsigned int used = run->total_slots - run->free_slots;
+        char c = (used == 0) ? '_' : (run->free_slots == 0) ? '*' : (char)('0' + used * 10 / run->total_slots);
+        fputc(c, out);
+        runs++;
+        if (runs % width == 0){
+            fputc('\n', out);
+        }
+    }
+    if (runs % width != 0){
+        fputc('\n', out);
+    }
+
+    fprintf(out, "=====================================\n\n");
+
+    allocator_unlock_all();
+
+    return;
+
+}
+
+
+
+typedef struct ppm_image_type{
+    unsigned char *pixels;//RGB bytes, PPM_WIDTH pixels per row
+
+    size_t count;//pixels written so far
+
+}PpmImage;
+
+
+
+/**
+ * ppm_emit() - writes one cell of the strip as a pixel
+ * 
+ * int kind: LAYOUT_ kind of the cell
+ * 
+ * void *context: the PpmImage being drawn
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Copies the colour of the cell kind into the next pixel of the image.
+ * 
+ * 
+ */
+static void ppm_emit(int kind, void *context){
+
+    PpmImage *image = (PpmImage *)context;
+
+    memcpy(image->pixels + image->count * 3, layout_colors[kind], 3);
+    image->count++;
+
+    return;
+
+}
+
+
+
+/**
+ * my_malloc_dump_ppm() - writes the heap layout as a PPM image
+ * 
+ * const char *path: file to write
+ * 
+ * size_t bytes_per_pixel: number of heap bytes each pixel covers
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Draws the Block list row by row, PPM_WIDTH pixels wide, in blue for headers, red for used payload and green
+ * for free payload. The rows after the end of the heap stay black. The pixel buffer is mapped with mmap() so drawing does
+ * not change the heap being drawn. Returns 0 on success and -1 if the image could not be written.
+ * 
+ * 
+ */
+int my_malloc_dump_ppm(const char *path, size_t bytes_per_pixel){
+
+    if (bytes_per_pixel < ALIGNMENT){
+        bytes_per_pixel = ALIGNMENT;
+    }
+
+    allocator_lock_all();
+
+    size_t heap_bytes = 0;
+    for (int a = 0; a < ARENA_COUNT; a++){
+        for (Block *current = arenas[a].head; current != NULL; current = block_next(current)){
+            heap_bytes += sizeof(Block) + current->size;
+        }
+    }
+
+    size_t pixels = (heap_bytes + bytes_per_pixel - 1) / bytes_per_pixel;
+    size_t height = (pixels + PPM_WIDTH - 1) / PPM_WIDTH;
+    if (height == 0){
+        height = 1;
+    }
+
+    size_t image_bytes = PPM_WIDTH * height * 3;
+    PpmImage image;
+    image.pixels = mmap(NULL, image_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    image.count = 0;
+    if (image.pixels == MAP_FAILED){
+        allocator_unlock_all();
+        perror("mmap error");
+        return -1;
+    }
+
+    layout_render(bytes_per_pixel, ppm_emit, &image);
+
+    allocator_unlock_all();
+
+    int result = -1;
+    FILE *out = fopen(path, "wb");
+    if (out == NULL){
+        perror("ppm error");
+    }
+    else{
+        fprintf(out, "P6\n%d %zu\n255\n", PPM_WIDTH, height);
+        if (fwrite(image.pixels, 1, image_bytes, out) == image_bytes){
+            result = 0;
+        }
+        fclose(out);
+    }
+
+    munmap(image.pixels, image_bytes);
+
+    return result;
+
+}
+
+
+
+/*
+ * ---------------------------------------------------------------------------------------------
+ * Hardware performance counters
+ * ---------------------------------------------------------------------------------------------
+ * The benchmarks read CPU counters with perf_event_open() around each run and report them per operation, so a slower
+ * path can be told apart as more instructions, more cache or TLB misses or more mispredicted branches. Each counter is
+ * opened on its own and inherited by the threads a run creates. A counter the CPU, the kernel or perf_event_paranoid
+ * does not allow is reported as n/a and the others still work.
+ */
+
+#define PERF_COUNTERS 7//events read around every benchmark run
+
+typedef struct perf_event_info_type{
+    uint32_t type;//PERF_TYPE_ of the event
+
+    uint64_t config;//event within that type
+
+    const char *name;//column and line label
+
+}PerfEvent;
+
+typedef struct perf_counters_type{
+    int fds[PERF_COUNTERS];//one perf_event_open() descriptor per event, -1 if it could not be opened
+
+    uint64_t values[PERF_COUNTERS];//counts of the last run
+
+}PerfCounters;
+
+#define PERF_CACHE_MISS(cache) ((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+static const PerfEvent perf_events[PERF_COUNTERS] = {
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, "Cycles"},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, "Instr"},
+    {PERF_TYPE_HW_CACHE, PERF_CACHE_MISS(PERF_COUNT_HW_CACHE_L1D), "L1D Miss"},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, "LLC Miss"},
+    {PERF_TYPE_HW_CACHE, PERF_CACHE_MISS(PERF_COUNT_HW_CACHE_DTLB), "dTLB Miss"},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, "Br Miss"},
+    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS, "Faults"},
+};
+
+
+
+/**
+ * perf_counters_open() - opens every counter for the calling thread and the threads it creates
+ * 
+ * PerfCounters *counters: filled in with one descriptor per event
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Counts user space only, which is all an unprivileged process may count under the default
+ * perf_event_paranoid. The counters start disabled. Events that cannot be opened keep a descriptor of -1.
+ * 
+ *           
+ */
+static void perf_counters_open(PerfCounters *counters){
+
+    for (int i = 0; i < PERF_COUNTERS; i++){
+
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = perf_events[i].type;
+        attr.config = perf_events[i].config;
+        attr.disabled = 1;
+        attr.inherit = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+
+        counters->fds[i] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        counters->values[i] = 0;
+
+    }
+
+    return;
+
+}
+
+
+
+/**
+ * perf_counters_start() - zeroes and enables every open counter
+ * 
+ * PerfCounters *counters: counters opened with perf_counters_open()
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Called right before the measured run.
+ * 
+ *           
+ */
+static void perf_counters_start(PerfCounters *counters){
+
+    for (int i = 0; i < PERF_COUNTERS; i++){
+        if (counters->fds[i] >= 0){
+            ioctl(counters->fds[i], PERF_EVENT_IOC_RESET, 0);
+            ioctl(counters->fds[i], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+
+    return;
+
+}
+
+
+
+/**
+ * perf_counters_stop() - disables every open counter and reads it
+ * 
+ * PerfCounters *counters: counters started with perf_counters_start()
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Called right after the measured run, once its threads are joined so their counts have been added to the
+ * inherited counters.
+ * 
+ *           
+ */
+static void perf_counters_stop(PerfCounters *counters){
+
+    for (int i = 0; i < PERF_COUNTERS; i++){
+        if (counters->fds[i] < 0){
+            continue;
+        }
+        ioctl(counters->fds[i], PERF_EVENT_IOC_DISABLE, 0);
+        if (read(counters->fds[i], &counters->values[i], sizeof(uint64_t)) != sizeof(uint64_t)){
+            counters->values[i] = 0;
+        }
+    }
+
+    return;
+
+}
+
+
+
+/**
+ * perf_counters_close() - closes every open counter
+ * 
+ * PerfCounters *counters: counters opened with perf_counters_open()
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: The last values read stay in the structure.
+ * 
+ *           
+ */
+static void perf_counters_close(PerfCounters *counters){
+
+    for (int i = 0; i < PERF_COUNTERS; i++){
+        if (counters->fds[i] >= 0){
+            close(counters->fds[i]);
+            counters->fds[i] = -1;
+        }
+    }
+
+    return;
+
+}
+
+
+
+/**
+ * perf_counters_header() - prints the column labels of perf_counters_columns()
+ * 
+ * FILE *out: stream to print to
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: One 10 character column per event, without a line break.
+ * 
+ *           
+ */
+static void perf_counters_header(FILE *out){
+
+    for (int i = 0; i < PERF_COUNTERS; i++){
+        fprintf(out, "%-10s", perf_events[i].name);
+    }
+
+    return;
+
+}
+
+
+
+/**
+ * perf_counters_columns() - prints the counts of the last run per operation as table columns
+ * 
+ * FILE *out: stream to print to
+ * 
+ * const PerfCounters *counters: counters read by perf_counters_stop()
+ * 
+ * double ops: operations the run made
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: One 10 character column per event, n/a for the events that could not be opened, without a line break.
+ * 
+ *           
+ */
+static void perf_counters_columns(FILE *out, const PerfCounters *counters, double ops){
+
+    for (int i = 0; i < PERF_COUNTERS; i++){
+        if (counters->fds[i] < 0 || ops <= 0){
+            fprintf(out, "%-10s", "n/a");
+        }
+        else{
+            fprintf(out, "%-10.2f", (double)counters->values[i] / ops);
+        }
+    }
+
+    return;
+
+}
+
+
+
+/**
+ * perf_counters_print() - prints the counts of the last run per operation, one per line
+ * 
+ * FILE *out: stream to print to
+ * 
+ * const PerfCounters *counters: counters read by perf_counters_stop()
+ * 
+ * double ops: operations the run made
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Uses the label layout of my_malloc_stats(), for reports that are a list of values rather than a table.
+ * 
+ *           
+ */
+static void perf_counters_print(FILE *out, const PerfCounters *counters, double ops){
+
+    for (int i = 0; i < PERF_COUNTERS; i++){
+        int width = 22 - (int)strlen(perf_events[i].name);
+        if (counters->fds[i] < 0 || ops <= 0){
+            fprintf(out, "%s / Op:%*sn/a\n", perf_events[i].name, width, "");
+        }
+        else{
+            fprintf(out, "%s / Op:%*s%.2f\n", perf_events[i].name, width, "", (double)counters->values[i] / ops);
+        }
+    }
+
+    return;
+
+}
+
+
+
+/*
+ * ---------------------------------------------------------------------------------------------
+ * Trace replay
+ * ---------------------------------------------------------------------------------------------
+ * A trace is a text file with one operation per line, ids name the allocation an operation works on:
+ * 
+ *     m <id> <size>            my_malloc(size)
+ *     m <id> <size> <site>     my_malloc_site(size, site), the allocation as made from callsite number <site>
+ *     c <id> <count> <size>    my_calloc(count, size)
+ *     r <id> <size>            my_realloc(ptr of id, size)
+ *     f <id>                   my_free(ptr of id)
+ * 
+ * Blank lines and lines starting with '#' are skipped.
+ */
+
+#define REPLAY_MAX_IDS ((size_t)1 << 24)//largest id + 1 a trace may use
+
+#define REPLAY_RSS_INTERVAL 1024//operations between resident set size samples
+
+typedef struct replay_options_type{
+    const char *frame_prefix;//heap layout frames are written to <frame_prefix>-<number>.ppm, NULL for no frames
+
+    size_t frame_interval;//operations between two frames
+
+    size_t bytes_per_pixel;//heap bytes covered by one pixel of a frame
+
+    const char *histogram_path;//the requested size histogram is written here after the replay, NULL for none
+
+    size_t check_interval;//operations between two my_malloc_check() runs, 0 for none
+
+    const char *snapshot_path;//the allocations still live at the end are written here with my_malloc_snapshot(), NULL for none
+
+}ReplayOptions;
+
+
+
+/**
+ * current_rss() - reads the resident set size of the process
+ * 
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Reads the resident page count from /proc/self/statm with plain read() so the measurement itself does not
+ * allocate, and returns it in bytes. Returns 0 if the file could not be read.
+ * 
+ *           
+ */
+static size_t current_rss(void){
+
+    char buffer[128];
+    size_t total_pages = 0, resident_pages = 0;
+
+    int fd = open("/proc/self/statm", O_RDONLY);
+    if (fd < 0){
+        return 0;
+    }
+
+    ssize_t length = read(fd, buffer, sizeof(buffer) - 1);
+    close(fd);
+    if (length <= 0){
+        return 0;
+    }
+    buffer[length] = '\0';
+
+    if (sscanf(buffer, "%zu %zu", &total_pages, &resident_pages) != 2){
+        return 0;
+    }
+
+    return resident_pages * (size_t)sysconf(_SC_PAGESIZE);
+
+}
+
+
+
+/**
+ * my_malloc_replay() - replays an allocation trace and reports the memory it used
+ * 
+ * const char *path: path of the trace file
+ * 
+ * const ReplayOptions *options: heap layout frame, size histogram, heap check and snapshot settings, or NULL for none
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Runs every operation of the trace through the custom allocator, writing to each allocation so its pages are
+ * really backed. The resident set size is sampled every REPLAY_RSS_INTERVAL operations and the peak, the final value and the
+ * slab policy in use are printed at the end, so the same trace can be compared across policies. When a frame prefix is set,
+ * a PPM heap layout is written every frame_interval operations, and the numbered frames can be joined into an animation
+ * of the fragmentation over the trace. When a check interval is set, my_malloc_check() runs every check_interval operations
+ * and each failure is reported with the operation that preceded it. The hardware counters are read around the whole trace
+ * and reported per operation, parsing of the trace included. When a snapshot path is set, the allocations the trace
+ * leaves live are written there. Returns 0 on success and -1 if the trace could not be read.
+ * 
+ *           
+ */
+int my_malloc_replay(const char *path, const ReplayOptions *options){
+
+    FILE *trace = fopen(path, "r");
+    if (trace == NULL){
+        perror("trace error");
+        return -1;
+    }
+
+    //the id table lives outside the custom heap so it does not disturb what is being measured
+    void **live = mmap(NULL, REPLAY_MAX_IDS * sizeof(void *), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (live == MAP_FAILED){
+        perror("mmap error");
+        fclose(trace);
+        return -1;
+    }
+
+    char line[256];
+    size_t ops = 0, bad_lines = 0, peak_rss = 0, frames = 0, check_failures = 0;
+    char frame_path[4096];
+    size_t id, a, b;
+
+    PerfCounters counters;
+    perf_counters_open(&counters);
+    perf_counters_start(&counters);
+
+    while (fgets(line, sizeof(line), trace) != NULL){
+
+        if (line[0] == '#' || line[0] == '\n'){
+            continue;
+        }
+
+        int fields = sscanf(line + 1, "%zu %zu %zu", &id, &a, &b);
+        if (fields < 1 || id >= REPLAY_MAX_IDS){
+            bad_lines++;
+            continue;
+        }
+
+        switch (line[0]){
+
+            case 'm':
+                if (fields < 2){
+                    bad_lines++;
+                    continue;
+                }
+                live[id] = (fields == 3) ? my_malloc_site(a, (unsigned int)b) : my_malloc(a);
+                if (live[id] != NULL){
+                    memset(live[id], 0xa5, a);
+                }
+                break;
+
+            case 'c':
+                if (fields < 3){
+                    bad_lines++;
+                    continue;
+                }
+                live[id] = my_calloc(a, b);
+                break;
+
+            case 'r':
+                if (fields < 2){
+                    bad_lines++;
+                    continue;
+                }
+                live[id] = my_realloc(live[id], a);
+                if (live[id] != NULL){
+                    memset(live[id], 0xa5, a);
+                }
+                break;
+
+            case 'f':
+                if (live[id] != NULL){
+                    my_free(live[id]);
+                    live[id] = NULL;
+                }
+                break;
+
+            default:
+                bad_lines++;
+                continue;
+        }
+
+        ops++;
+
+        if (ops % REPLAY_RSS_INTERVAL == 0){
+            size_t rss = current_rss();
+            if (rss > peak_rss){
+                peak_rss = rss;
+            }
+        }
+
+        if (options != NULL && options->check_interval > 0 && ops % options->check_interval == 0 && my_malloc_check() != 0){
+            fprintf(stderr,"heap check failed after operation %zu: %s", ops, line);
+            check_failures++;
+        }
+
+        if (options != NULL && options->frame_prefix != NULL && options->frame_interval > 0 && ops % options->frame_interval == 0){
+            snprintf(frame_path, sizeof(frame_path), "%s-%06zu.ppm", options->frame_prefix, frames);
+            if (my_malloc_dump_ppm(frame_path, options->bytes_per_pixel) == 0){
+                frames++;
+            }
+        }
+
+    }
+
+    perf_counters_stop(&counters);
+
+    size_t final_rss = current_rss();
+    if (final_rss > peak_rss){
+        peak_rss = final_rss;
+    }
+
+    printf("\n============Trace Replay==============\n");
+    printf("Slab Policy:                %s\n", slab_policy == SLAB_POLICY_NAIVE ? "naive" : "fullest");
+    printf("Operations:                 %zu\n", ops);
+    printf("Skipped Lines:              %zu\n", bad_lines);
+    printf("Peak RSS (B):               %zu\n", peak_rss);
+    printf("Final RSS (B):              %zu\n", final_rss);
+    if (frames > 0){
+        printf("Layout Frames:              %zu\n", frames);
+    }
+    if (options != NULL && options->check_interval > 0){
+        printf("Failed Heap Checks:         %zu\n", check_failures);
+    }
+    perf_counters_print(stdout, &counters, (double)ops);
+    printf("=====================================\n\n");
+
+    perf_counters_close(&counters);
+
+    my_malloc_stats();
+
+    HeapAnalysis analysis;
+    if (my_malloc_analyze(&analysis) == 0){
+        my_malloc_print_analysis(&analysis);
+    }
+
+    if (options != NULL && options->histogram_path != NULL){
+        FILE *histogram = fopen(options->histogram_path, "w");
+        if (histogram == NULL){
+            perror("histogram error");
+        }
+        else{
+            my_malloc_dump_size_histogram(histogram);
+            fclose(histogram);
+        }
+    }
+
+    if (options != NULL && options->snapshot_path != NULL){
+        my_malloc_snapshot(options->snapshot_path);
+    }
+
+    munmap(live, REPLAY_MAX_IDS * sizeof(void *));
+    fclose(trace);
+
+    return 0;
+
+}
+
+
+
+/*
+ * ---------------------------------------------------------------------------------------------
+ * Size class tuning
+ * ---------------------------------------------------------------------------------------------
+ * Derives a size class table from a recorded size histogram or a trace. Every aligned size up to SLAB_MAX_SIZE gets
+ * a weight, the number of requests that round to it, and the table is chosen with dynamic programming to minimize the
+ * total bytes lost to rounding requests up to their class.
+ */
+
+#define TUNE_SIZES (SLAB_MAX_SIZE / ALIGNMENT)//aligned sizes ALIGNMENT, 2 * ALIGNMENT, ... SLAB_MAX_SIZE
+
+
+
+/**
+ * tune_add() - counts requests of one size toward the tuning weights
+ * 
+ * size_t *weights: weight of every aligned size, index k is size k * ALIGNMENT
+ * 
+ * size_t size: requested size
+ * 
+ * size_t count: number of requests of that size
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Sizes larger than SLAB_MAX_SIZE are ignored since they never use a size class, and size 0 counts as the
+ * smallest class.
+ * 
+ *           
+ */
+static void tune_add(size_t *weights, size_t size, size_t count){
+
+    if (size > SLAB_MAX_SIZE){
+        return;
+    }
+
+    size_t k = ALIGN(size) / ALIGNMENT;
+    weights[k == 0 ? 1 : k] += count;
+
+    return;
+
+}
+
+
+
+/**
+ * tune_waste() - bytes lost when a table serves the weighted sizes
+ * 
+ * const size_t *weights: weight of every aligned size
+ * 
+ * const size_t *classes: size class table
+ * 
+ * unsigned int count: number of classes in the table
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Rounds every aligned size up to the smallest class that fits it and adds up the difference times its weight.
+ * 
+ *           
+ */
+static size_t tune_waste(const size_t *weights, const size_t *classes, unsigned int count){
+
+    size_t waste = 0;
+    unsigned int c = 0;
+
+    for (size_t k = 1; k <= TUNE_SIZES; k++){
+        while (c < count && classes[c] < k * ALIGNMENT){
+            c++;
+        }
+        if (c < count){
+            waste += weights[k] * (classes[c] - k * ALIGNMENT);
+        }
+    }
+
+    return waste;
+
+}
+
+
+
+/**
+ * my_malloc_tune_classes() - derives a size class table from a histogram or a trace
+ * 
+ * const char *path: file written by my_malloc_dump_size_histogram() or a trace in the replay format
+ * 
+ * unsigned int max_classes: largest number of classes the table may have
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Reads the request sizes, then for every number of classes m and every aligned size j finds the cheapest
+ * table of m classes whose last class is j, where a class j after class i serves every size in (i, j]. The smallest table
+ * that reaches the lowest waste is printed to stdout as a comma separated list, ready to be used as a MY_MALLOC_CLASSES file
+ * or as -DSLAB_CLASS_TABLE, and the waste of the current and the tuned table are printed to stderr. A histogram bucket wider
+ * than one byte has its count spread evenly over its sizes. Returns 0 on success and -1 if the file could not be read.
+ * 
+ *           
+ */
+int my_malloc_tune_classes(const char *path, unsigned int max_classes){
+
+    FILE *input = fopen(path, "r");
+    if (input == NULL){
+        perror("tune error");
+        return -1;
+    }
+
+    if (max_classes == 0 || max_classes > SLAB_MAX_CLASSES){
+        max_classes = SLAB_MAX_CLASSES;
+    }
+
+    size_t weights[TUNE_SIZES + 1] = {0};
+    size_t requests = 0;
+    char line[256];
+    size_t a, b, c;
+
+    while (fgets(line, sizeof(line), input) != NULL){
+
+        //histogram lines are "<lower> <upper> <count>", the count is spread evenly over the sizes of the bucket
+        if (line[0] >= '0' && line[0] <= '9'){
+            if (sscanf(line, "%zu %zu %zu", &a, &b, &c) == 3 && a <= b && a <= SLAB_MAX_SIZE){
+                size_t sizes = b - a + 1;
+                for (size_t size = a; size <= b && size <= SLAB_MAX_SIZE; size++){
+                    tune_add(weights, size, c / sizes + (size == b ? c % sizes : 0));
+                }
+                requests += c;
+            }
+            continue;
+        }
+
+        //trace lines start with their operation
+
+        int fields = sscanf(line + 1, "%zu %zu %zu", &a, &b, &c);
+        if ((line[0] == 'm' || line[0] == 'r') && fields >= 2){
+            tune_add(weights, b, 1);
+            requests++;
+        }
+        else if (line[0] == 'c' && fields >= 3 && (c == 0 || b <= SIZE_MAX / c)){
+            tune_add(weights, b * c, 1);
+            requests++;
+        }
+
+    }
+
+    fclose(input);
+
+    //cost[i][j] is the waste of one class of size j serving every size in (i, j]
+    static size_t cost[TUNE_SIZES + 1][TUNE_SIZES + 1];
+    for (size_t i = 0; i < TUNE_SIZES; i++){
+        size_t waste = 0, weight = 0;
+        for (size_t j = i + 1; j <= TUNE_SIZES; j++){
+            waste += weight * ALIGNMENT;//every size already covered moves one step further from the class
+            weight += weights[j];
+            cost[i][j] = waste;
+        }
+    }
+
+    //best[m][j] is the least waste of m classes covering (0, j] with j as the last class, from[m][j] its previous class
+    static size_t best[SLAB_MAX_CLASSES + 1][TUNE_SIZES + 1];
+    static size_t from[SLAB_MAX_CLASSES + 1][TUNE_SIZES + 1];
+    for (unsigned int m = 0; m <= max_classes; m++){
+        for (size_t j = 0; j <= TUNE_SIZES; j++){
+            best[m][j] = SIZE_MAX;
+        }
+    }
+    best[0][0] = 0;
+
+    for (unsigned int m = 1; m <= max_classes; m++){
+        for (size_t j = 1; j <= TUNE_SIZES; j++){
+            for (size_t i = 0; i < j; i++){
+                if (best[m - 1][i] != SIZE_MAX && best[m - 1][i] + cost[i][j] < best[m][j]){
+                    best[m][j] = best[m - 1][i] + cost[i][j];
+                    from[m][j] = i;
+                }
+            }
+        }
+    }
+
+    //the last class is always SLAB_MAX_SIZE, pick the fewest classes that reach the lowest waste
+    unsigned int chosen = max_classes;
+    for (unsigned int m = 1; m <= max_classes; m++){
+        if (best[m][TUNE_SIZES] == best[max_classes][TUNE_SIZES]){
+            chosen = m;
+            break;
+        }
+    }
+
+    size_t classes[SLAB_MAX_CLASSES];
+    size_t j = TUNE_SIZES;
+    for (unsigned int m = chosen; m > 0; m--){
+        classes[m - 1] = j * ALIGNMENT;
+        j = from[m][j];
+    }
+
+    for (unsigned int m = 0; m < chosen; m++){
+        printf("%s%zu", m == 0 ? "" : ", ", classes[m]);
+    }
+    printf("\n");
+
+    size_t current = tune_waste(weights, slab_class_size, slab_class_count);
+    fprintf(stderr, "small requests:   %zu\n", requests);
+    fprintf(stderr, "current classes:  %u, %zu bytes wasted\n", slab_class_count, current);
+    fprintf(stderr, "tuned classes:    %u, %zu bytes wasted\n", chosen, best[chosen][TUNE_SIZES]);
+
+    return 0;
+
+}
+
+
+
+/*
+ * ---------------------------------------------------------------------------------------------
+ * Differential fuzz harness
+ * ---------------------------------------------------------------------------------------------
+ * LLVMFuzzerTestOneInput() turns its input into a sequence of my_malloc(), my_calloc(), my_realloc() and my_free()
+ * calls and repeats every one of them on glibc's allocator as a shadow model. After each call the contents of the
+ * custom allocation must match the shadow copy, calloc memory must read as zero, pointers must be aligned, and
+ * my_malloc_check() must find a consistent heap. Any difference aborts, which both libFuzzer and AFL report as a crash.
+ * 
+ *     libFuzzer: clang -g -O1 -fsanitize=fuzzer -DMY_MALLOC_FUZZ -o my_malloc_fuzz Main.c
+ *     AFL:       afl-clang-fast -o my_malloc Main.c, then afl-fuzz -i seeds -o findings -- ./my_malloc fuzz @@
+ * 
+ * Each operation takes FUZZ_OP_BYTES bytes of input: operation, slot, then a 16 bit size.
+ */
+
+#define FUZZ_SLOTS 64//allocations a single input can keep alive at once
+
+#define FUZZ_OP_BYTES 4//input bytes consumed per operation
+
+#define FUZZ_MAX_OPS 512//operations run per input at most, longer inputs are cut
+
+#define FUZZ_RANDOM_INPUTS 500//inputs generated by "my_malloc fuzz" when it is given no files
+
+typedef struct fuzz_slot_type{
+    unsigned char *ptr;//pointer from the custom allocator, NULL when the slot is empty
+
+    unsigned char *shadow;//glibc copy of the same allocation
+
+    size_t size;//requested size of the allocation
+
+}FuzzSlot;
+
+
+
+/**
+ * fuzz_fail() - reports a difference from the shadow model and aborts
+ * 
+ * const char *what: description of the difference
+ * 
+ * size_t op: index of the operation that exposed it
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Prints the failure and aborts so the fuzzer saves the input that caused it.
+ * 
+ *           
+ */
+static void fuzz_fail(const char *what, size_t op){
+
+    fprintf(stderr,"fuzz failure at operation %zu: %s\n", op, what);
+    abort();
+
+}
+
+
+
+/**
+ * fuzz_size() - turns two input bytes into a request size
+ * 
+ * unsigned char scale: selects small, Block list or large sizes
+ * 
+ * const uint8_t *bytes: the two size bytes of the operation
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Spreads sizes over the slab classes, the Block list and allocations of a few hundred KiB so every path of the
+ * allocator is reached from short inputs.
+ * 
+ *           
+ */
+static size_t fuzz_size(unsigned char scale, const uint8_t *bytes){
+
+    size_t value = (size_t)bytes[0] | ((size_t)bytes[1] << 8);
+
+    switch (scale % 3){
+        case 0:
+            return value % (SLAB_MAX_SIZE + 1);
+        case 1:
+            return value % 8192;
+        default:
+            return value * 8;
+    }
+
+}
+
+
+
+/**
+ * fuzz_fill() - writes a pattern into an allocation and its shadow
+ * 
+ * FuzzSlot *slot: allocation to fill
+ * 
+ * size_t from: first byte to write
+ * 
+ * unsigned char seed: varies the pattern between writes
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Writes the same bytes to both copies from the given offset to the end of the allocation.
+ * 
+ *           
+ */
+static void fuzz_fill(FuzzSlot *slot, size_t from, unsigned char seed){
+
+    for (size_t i = from; i < slot->size; i++){
+        slot->ptr[i] = slot->shadow[i] = (unsigned char)(seed + i * 31);
+    }
+
+    return;
+
+}
+
+
+
+/**
+ * fuzz_release() - frees an allocation and its shadow
+ * 
+ * FuzzSlot *slot: allocation to free, may be empty
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Frees both copies and empties the slot.
+ * 
+ *           
+ */
+static void fuzz_release(FuzzSlot *slot){
+
+    if (slot->ptr != NULL){
+        my_free(slot->ptr);
+        free(slot->shadow);
+    }
+
+    slot->ptr = NULL;
+    slot->shadow = NULL;
+    slot->size = 0;
+
+    return;
+
+}
+
+
+
+/**
+ * fuzz_store() - keeps a new allocation and makes its shadow copy
+ * 
+ * FuzzSlot *slot: empty slot to fill
+ * 
+ * void *ptr: pointer returned by the custom allocator
+ * 
+ * size_t size: requested size
+ * 
+ * size_t op: index of the operation
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Checks that the pointer is aligned and allocates the glibc shadow with the same contents. A NULL pointer is
+ * only accepted for a size of 0, any other request this small must succeed.
+ * 
+ *           
+ */
+static void fuzz_store(FuzzSlot *slot, void *ptr, size_t size, size_t op){
+
+    if (ptr == NULL){
+        if (size != 0){
+            fuzz_fail("allocation returned NULL", op);
+        }
+        return;
+    }
+
+    if ((uintptr_t)ptr % ALIGNMENT != 0){
+        fuzz_fail("pointer is not aligned", op);
+    }
+
+    slot->ptr = ptr;
+    slot->size = size;
+    slot->shadow = malloc(size == 0 ? 1 : size);
+    if (slot->shadow == NULL){
+        fuzz_fail("shadow allocation failed", op);
+    }
+    memcpy(slot->shadow, ptr, size);
+
+    return;
+
+}
+
+
+
+/**
+ * LLVMFuzzerTestOneInput() - runs one fuzz input against the custom allocator and the glibc shadow
+ * 
+ * const uint8_t *data: fuzz input
+ * 
+ * size_t size: length of the input
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Decodes the input into at most FUZZ_MAX_OPS operations on FUZZ_SLOTS slots, checking every allocation touched
+ * against its shadow and the whole heap with my_malloc_check() after each one. Everything still alive is freed at the end
+ * so inputs do not affect each other. Returns 0 as libFuzzer expects.
+ * 
+ *           
+ */
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size){
+
+    FuzzSlot slots[FUZZ_SLOTS];
+    memset(slots, 0, sizeof(slots));
+
+    size_t ops = size / FUZZ_OP_BYTES;
+    if (ops > FUZZ_MAX_OPS){
+        ops = FUZZ_MAX_OPS;
+    }
+
+    for (size_t op = 0; op < ops; op++){
+
+        const uint8_t *bytes = data + op * FUZZ_OP_BYTES;
+        FuzzSlot *slot = &slots[bytes[1] % FUZZ_SLOTS];
+        size_t request = fuzz_size(bytes[0] >> 2, bytes + 2);
+
+        //every existing allocation must still hold what was written to it
+        if (slot->ptr != NULL && memcmp(slot->ptr, slot->shadow, slot->size) != 0){
+            fuzz_fail("contents changed", op);
+        }
+
+        switch (bytes[0] & 3){
+
+            case 0:
+                fuzz_release(slot);
+                fuzz_store(slot, my_malloc(request), request, op);
+                if (slot->ptr != NULL){
+                    fuzz_fill(slot, 0, bytes[2]);
+                }
+                break;
+
+            case 1:{
+                fuzz_release(slot);
+                size_t count = (bytes[2] % 16) + 1;
+                size_t element = request / count;
+                void *ptr = my_calloc(count, element);
+                fuzz_store(slot, ptr, count * element, op);
+                for (size_t i = 0; i < slot->size; i++){
+                    if (slot->ptr[i] != 0){
+                        fuzz_fail("calloc memory is not zero", op);
+                    }
+                }
+                break;
+            }
+
+            case 2:{
+                if (slot->ptr == NULL){
+                    fuzz_store(slot, my_realloc(NULL, request), request, op);
+                    if (slot->ptr != NULL){
+                        fuzz_fill(slot, 0, bytes[3]);
+                    }
+                    break;
+                }
+
+                size_t old_size = slot->size;
+                unsigned char *ptr = my_realloc(slot->ptr, request);
+                if (request == 0){
+                    if (ptr != NULL){
+                        fuzz_fail("realloc to 0 did not free", op);
+                    }
+                    free(slot->shadow);
+                    slot->ptr = NULL;
+                    slot->shadow = NULL;
+                    slot->size = 0;
+                    break;
+                }
+                if (ptr == NULL){
+                    fuzz_fail("realloc returned NULL", op);
+                }
+                if ((uintptr_t)ptr % ALIGNMENT != 0){
+                    fuzz_fail("realloc pointer is not aligned", op);
+                }
+
+                unsigned char *shadow = realloc(slot->shadow, request);
+                if (shadow == NULL){
+                    fuzz_fail("shadow realloc failed", op);
+                }
+                size_t kept = old_size < request ? old_size : request;
+                if (memcmp(ptr, shadow, kept) != 0){
+                    fuzz_fail("realloc lost contents", op);
+                }
+
+                slot->ptr = ptr;
+                slot->shadow = shadow;
+                slot->size = request;
+                fuzz_fill(slot, kept, bytes[3]);
+                break;
+            }
+
+            default:
+                fuzz_release(slot);
+                break;
+        }
+
+        if (my_malloc_check() != 0){
+            fuzz_fail("heap check failed", op);
+        }
+
+    }
+
+    for (size_t i = 0; i < FUZZ_SLOTS; i++){
+        if (slots[i].ptr != NULL && memcmp(slots[i].ptr, slots[i].shadow, slots[i].size) != 0){
+            fuzz_fail("contents changed", ops);
+        }
+        fuzz_release(&slots[i]);
+    }
+
+    return 0;
+
+}
+
+
+
+/**
+ * my_malloc_fuzz() - runs the fuzz harness without libFuzzer
+ * 
+ * int count: number of input files
+ * 
+ * char *paths[]: input files, each is run as one input
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Runs LLVMFuzzerTestOneInput() on every file, which is how AFL drives the harness. With no files it runs
+ * FUZZ_RANDOM_INPUTS inputs made with rand() as a quick smoke test. Returns 0 when every input passed, a failing input aborts.
+ * 
+ *           
+ */
+int my_malloc_fuzz(int count, char *paths[]){
+
+    static uint8_t input[FUZZ_MAX_OPS * FUZZ_OP_BYTES];
+
+    if (count == 0){
+        srand(1);
+        for (int n = 0; n < FUZZ_RANDOM_INPUTS; n++){
+            size_t length = (size_t)rand() % sizeof(input);
+            for (size_t i = 0; i < length; i++){
+                input[i] = (uint8_t)rand();
+            }
+            LLVMFuzzerTestOneInput(input, length);
+        }
+        printf("fuzz: %d random inputs passed\n", FUZZ_RANDOM_INPUTS);
+        return 0;
+    }
+
+    for (int n = 0; n < count; n++){
+        FILE *file = fopen(paths[n], "rb");
+        if (file == NULL){
+            perror("fuzz input error");
+            return -1;
+        }
+        size_t length = fread(input, 1, sizeof(input), file);
+        fclose(file);
+        LLVMFuzzerTestOneInput(input, length);
+    }
+
+    return 0;
+
+}
+
+
+
+/*
+ * ---------------------------------------------------------------------------------------------
+ * Fork stress test
+ * ---------------------------------------------------------------------------------------------
+ * Worker threads allocate and free in a loop while the main thread forks over and over. If a fork caught any allocator
+ * lock held by a worker, the child would block forever on its first allocation, so every child is given a few seconds
+ * by alarm() to allocate, free and pass my_malloc_check() before it is killed and reported as deadlocked.
+ */
+
+#define FORK_STRESS_SLOTS 256//allocations each worker thread keeps alive at once
+
+#define FORK_STRESS_TIMEOUT 5//seconds a child gets before it counts as deadlocked
+
+static volatile int fork_stress_stop = 0;//set by the main thread to end the workers
+
+
+
+/**
+ * fork_stress_worker() - allocates and frees until told to stop
+ * 
+ * void *arg: seed for the worker's random sizes
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Keeps FORK_STRESS_SLOTS allocations of random sizes alive, replacing a random one on every step, so the
+ * slab and arena locks are taken and released constantly while the main thread forks.
+ * 
+ *           
+ */
+static void *fork_stress_worker(void *arg){
+
+    unsigned int seed = (unsigned int)(uintptr_t)arg;
+    void *slots[FORK_STRESS_SLOTS] = {NULL};
+
+    while (!__atomic_load_n(&fork_stress_stop, __ATOMIC_RELAXED)){
+        unsigned int slot = (unsigned int)rand_r(&seed) % FORK_STRESS_SLOTS;
+        if (slots[slot] != NULL){
+            my_free(slots[slot]);
+        }
+        size_t size = 1 + (size_t)rand_r(&seed) % ((rand_r(&seed) & 1) ? SLAB_MAX_SIZE : 8192);
+        slots[slot] = my_malloc(size);
+        if (slots[slot] != NULL){
+            memset(slots[slot], (int)slot, size);
+        }
+    }
+
+    for (unsigned int slot = 0; slot < FORK_STRESS_SLOTS; slot++){
+        if (slots[slot] != NULL){
+            my_free(slots[slot]);
+        }
+    }
+
+    return NULL;
+
+}
+
+
+
+/**
+ * fork_stress_child() - what every forked child runs
+ * 
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Allocates and frees from both the slabs and the arenas, then checks the heap. Exits with 0 when the heap
+ * is consistent and 1 otherwise, and is killed by SIGALRM if any of it blocks on a lock.
+ * 
+ *           
+ */
+static void fork_stress_child(void){
+
+    alarm(FORK_STRESS_TIMEOUT);
+
+    void *small = my_malloc(64);
+    void *large = my_malloc(4096);
+    if (small == NULL || large == NULL){
+        _exit(1);
+    }
+    memset(small, 1, 64);
+    memset(large, 2, 4096);
+    my_free(small);
+    my_free(large);
+
+    _exit(my_malloc_check() == 0 ? 0 : 1);
+
+}
+
+
+
+/**
+ * my_malloc_fork_stress() - forks repeatedly while other threads allocate
+ * 
+ * int threads: number of worker threads
+ * 
+ * int forks: number of children to fork
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Starts the workers, forks the children one after another and waits for each, counting children that
+ * exit with a bad heap and children killed by the timeout. Returns 0 when every child passed and -1 otherwise.
+ * 
+ *           
+ */
+int my_malloc_fork_stress(int threads, int forks){
+
+    pthread_t workers[64];
+    if (threads < 1){
+        threads = 1;
+    }
+    if (threads > 64){
+        threads = 64;
+    }
+
+    fork_stress_stop = 0;
+    for (int i = 0; i < threads; i++){
+        if (pthread_create(&workers[i], NULL, fork_stress_worker, (void *)(uintptr_t)(i + 1)) != 0){
+            perror("pthread_create error");
+            threads = i;
+            break;
+        }
+    }
+
+    int failed = 0, deadlocked = 0;
+    for (int n = 0; n < forks; n++){
+
+        pid_t pid = fork();
+        if (pid < 0){
+            perror("fork error");
+            failed++;
+            break;
+        }
+        if (pid == 0){
+            fork_stress_child();
+        }
+
+        int status;
+        if (waitpid(pid, &status, 0) < 0){
+            perror("waitpid error");
+            failed++;
+        }
+        else if (WIFSIGNALED(status) && WTERMSIG(status) == SIGALRM){
+            deadlocked++;
+        }
+        else if (!WIFEXITED(status) || WEXITSTATUS(status) != 0){
+            failed++;
+        }
+
+    }
+
+    __atomic_store_n(&fork_stress_stop, 1, __ATOMIC_RELAXED);
+    for (int i = 0; i < threads; i++){
+        pthread_join(workers[i], NULL);
+    }
+
+    printf("\n============Fork Stress===============\n");
+    printf("Threads:                    %d\n", threads);
+    printf("Forks:                      %d\n", forks);
+    printf("Failed Children:            %d\n", failed);
+    printf("Deadlocked Children:        %d\n", deadlocked);
+    printf("=====================================\n\n");
+
+    if (my_malloc_check() != 0){
+        failed++;
+    }
+
+    return (failed == 0 && deadlocked == 0) ? 0 : -1;
+
+}
+
+
+
+/*
+ * ---------------------------------------------------------------------------------------------
+ * Guarded sampling test
+ * ---------------------------------------------------------------------------------------------
+ * Runs with every allocation guarded. A child process is forked for each kind of bug, makes it on purpose, and has its
+ * standard error read back through a pipe, so the test checks both that the child was stopped by the right signal and
+ * that the report names the bug. The parent then allocates, resizes and frees allocations of many sizes through the
+ * pool, and through handles that compaction has to skip, to show that correct programs are unaffected.
+ */
+
+#define GUARD_TEST_KINDS 3//overflow, use after free, double free
+
+typedef struct guard_test_case_type{
+    const char *name;//bug made by the child
+
+    int signal;//signal the child must die of
+
+    const char *report;//text the report must contain
+
+}GuardTestCase;
+
+static const GuardTestCase guard_test_cases[GUARD_TEST_KINDS] = {
+    {"overflow", SIGSEGV, "heap-buffer-overflow"},
+    {"use after free", SIGSEGV, "heap-use-after-free"},
+    {"double free", SIGABRT, "double-free"},
+};
+
+
+
+/**
+ * guard_test_child() - makes one kind of memory error in a guarded allocation
+ * 
+ * int kind: index into guard_test_cases
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Never returns, the error should end the process, and exits with 1 if it did not.
+ * 
+ *           
+ */
+static void guard_test_child(int kind){
+
+    volatile char *ptr = my_malloc(40);
+
+    switch (kind){
+
+        case 0:
+            ptr[40] = 1;
+            break;
+
+        case 1:
+            my_free((void *)ptr);
+            ptr[0] = 1;
+            break;
+
+        default:
+            my_free((void *)ptr);
+            my_free((void *)ptr);
+            break;
+
+    }
+
+    _exit(1);
+
+}
+
+
+
+/**
+ * my_malloc_guard_test() - checks that guarded sampling catches memory errors
+ * 
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Sets MY_MALLOC_GUARD to 1 before the first allocation, so it only works in a process that has not
+ * allocated yet. Returns 0 if every error was caught and reported and the heap passes my_malloc_check() afterwards, -1
+ * otherwise.
+ * 
+ *           
+ */
+int my_malloc_guard_test(void){
+
+    setenv("MY_MALLOC_GUARD", "1", 1);
+    allocator_init();
+    if (!guard_enabled){
+        fprintf(stderr,"guarded sampling is not available\n");
+        return -1;
+    }
+
+    int failed = 0;
+    printf("\n============Guarded Sampling Test=====\n");
+
+    for (int kind = 0; kind < GUARD_TEST_KINDS; kind++){
+
+        const GuardTestCase *test = &guard_test_cases[kind];
+        int pipe_fds[2];
+        if (pipe(pipe_fds) != 0){
+            perror("pipe error");
+            return -1;
+        }
+
+        pid_t pid = fork();
+        if (pid < 0){
+            perror("fork error");
+            return -1;
+        }
+        if (pid == 0){
+            close(pipe_fds[0]);
+            dup2(pipe_fds[1], STDERR_FILENO);
+            guard_test_child(kind);
+        }
+
+        close(pipe_fds[1]);
+        char report[8192];
+        size_t length = 0;
+        ssize_t got;
+        while (length < sizeof(report) - 1 && (got = read(pipe_fds[0], report + length, sizeof(report) - 1 - length)) > 0){
+            length += (size_t)got;
+        }
+        report[length] = '\0';
+        close(pipe_fds[0]);
+
+        int status;
+        waitpid(pid, &status, 0);
+        int caught = WIFSIGNALED(status) && WTERMSIG(status) == test->signal && strstr(report, test->report) != NULL;
+        failed += !caught;
+        printf("%-28s%s\n", test->name, caught ? "caught" : "MISSED");
+
+    }
+
+    //correct use of guarded memory must behave like the heap
+    void *ptrs[64];
+    for (int round = 0; round < 8; round++){
+        for (int i = 0; i < 64; i++){
+            size_t size = 1 + (size_t)(i * 61 + round * 17) % 3000;
+            ptrs[i] = my_malloc(size);
+            if (ptrs[i] != NULL){
+                memset(ptrs[i], i, size);
+                ptrs[i] = my_realloc(ptrs[i], size / 2 + 1);
+            }
+        }
+        for (int i = 0; i < 64; i++){
+            if (ptrs[i] != NULL){
+                failed += (((unsigned char *)ptrs[i])[0] != (unsigned char)i);
+                my_free(ptrs[i]);
+            }
+        }
+    }
+
+    //handles may land in the pool too, compaction must leave them where they are
+    Handle handles[8];
+    for (int i = 0; i < 8; i++){
+        handles[i] = halloc(100);
+        if (handles[i] != HANDLE_NONE){
+            memset(hlock(handles[i]), i, 100);
+            hunlock(handles[i]);
+        }
+    }
+    my_heap_compact(64);
+    for (int i = 0; i < 8; i++){
+        if (handles[i] != HANDLE_NONE){
+            failed += (((unsigned char *)hlock(handles[i]))[99] != (unsigned char)i);
+            hunlock(handles[i]);
+            hfree(handles[i]);
         }
+    }
 
-        //continue going through each block in the linked list
-        current = current->next;
+    printf("Guarded Allocations:        %zu\n", guard_allocations);
+    printf("=====================================\n\n");
 
+    if (my_malloc_check() != 0){
+        failed++;
     }
 
-    //after looping through the linked list, if none of the previously freed blocks has enough space to be reused, a new block will be created with new memory requested from the OS 
-    //using sbrk() to add to the heap. This block is returned to the user and is set at the end of the linked list.
-    
-    void *mem_block = sbrk(aligned_size + sizeof(Block));
-    if (mem_block == (void *)-1){
-        perror("sbrk error");
-        return NULL;
-    }
+    return (failed == 0) ? 0 : -1;
 
-    Block *allocated_block = (Block *)mem_block;
+}
 
-    allocated_block->free = 0;
-    allocated_block->size = aligned_size;
-    allocated_block->next = NULL;
-    allocated_block->prev = NULL;
 
-    //If the block created is the first block in the linked list
-    if (head == NULL){
-        head = allocated_block;
-        last = allocated_block;
-    }
 
-    //Place the block at the end of the linked list if it is not the first block
-    else{
-        allocated_block ->prev = last;
-        last->next = allocated_block;
-        last = allocated_block;
-    }
-    
-    //the + 1 ensures that the user only recieves space from the heap that is not apart of the meta data, since the + 1 skips past all the bytes that contain the meta data in the memory address.
-    return ((void *)(allocated_block + 1));
+/*
+ * ---------------------------------------------------------------------------------------------
+ * Lock benchmark
+ * ---------------------------------------------------------------------------------------------
+ * Compares AllocLock with a pthread mutex on the same workload: every thread repeatedly takes the lock, does a short
+ * piece of work inside it the size of a free list update, and then some work outside it, like the arena slow paths do
+ * between two allocations. The run is repeated for doubling thread counts up to the number asked for.
+ */
 
-}
+#define LOCK_BENCH_INSIDE 32//loop iterations done while holding the lock
+
+#define LOCK_BENCH_OUTSIDE 128//loop iterations done between two acquisitions
+
+typedef struct lock_bench_type{
+    AllocLock alloc_lock;//lock used when use_mutex is 0
+
+    pthread_mutex_t mutex;//lock used when use_mutex is 1
 
+    int use_mutex;//which of the two locks the threads take
+
+    size_t iterations;//acquisitions per thread
+
+    volatile size_t shared;//changed inside the lock so the work cannot be optimized away
+
+}LockBench;
 
 
 
 /**
- * my_free() - free's a previously allocated block and marks it reusable
+ * lock_bench_worker() - takes the benchmarked lock in a loop
  * 
- * void *allocated_block: pointer to a previously allocated block
+ * void *arg: the LockBench being run
  * ------------------------------------------------------------------------------------  
  * 
- * Description: Custom implementation of free() that sets the pointer recieved to a resuable block by setting the meta data free variable to 1,
- * also checks adjecent nodes if they are also free to merge all free adjecent data blocks in the doubly linked list into one block to reduce 
- * fragmentation.
+ * Description: Takes and releases the lock the given number of times, doing LOCK_BENCH_INSIDE iterations of work while
+ * holding it and LOCK_BENCH_OUTSIDE iterations outside of it.
  * 
  *           
  */
-void my_free(void *allocated_block){
-    
-    //check if the pointer recieved from the parameter is NULL
-    if (allocated_block == NULL){
-        fprintf(stderr,"invalid memory block\n");
-        return;
-    }
-
-    //Changing the blocks meta data information, specifically the free variable to 1 since the block is being freed
-    Block *free_block = (Block *)allocated_block - 1;
-    free_block->free = 1;
-
-    //Continue looping through any adjecent blocks that are also free to the given block and combine the size so all adjcent blocks can be treated as one large block.
-    Block *current_fwd = free_block->next;
-    while (current_fwd != NULL && current_fwd->free == 1){
-        free_block->size += (sizeof(Block) + current_fwd->size);
-        current_fwd  = current_fwd ->next;
-    }
+static void *lock_bench_worker(void *arg){
 
-    free_block->next = current_fwd;
+    LockBench *bench = (LockBench *)arg;
+    volatile size_t local = 0;
 
-    if (current_fwd != NULL){
-        current_fwd ->prev = free_block;
-    }
+    for (size_t n = 0; n < bench->iterations; n++){
 
+        if (bench->use_mutex){
+            pthread_mutex_lock(&bench->mutex);
+        }
+        else{
+            lock_acquire(&bench->alloc_lock);
+        }
 
-    //continue looping through blocks adjacent to the given block in the left direction or previous direction, for each adjacent block, update the size to include all free adjacent blocks size in the right direction of the block.
-    //Continue doing this until there is no more free blocks, combining adjacent blocks into one large block for more reusability.
-    Block *current_bck = free_block->prev;
-    while (current_bck != NULL && current_bck->free == 1){
+        for (int i = 0; i < LOCK_BENCH_INSIDE; i++){
+            bench->shared++;
+        }
 
-        current_bck->size += sizeof(Block)+free_block->size;
-        current_bck->next = free_block->next;
-        
-        if (free_block->next != NULL){
-            free_block->next->prev = current_bck;
+        if (bench->use_mutex){
+            pthread_mutex_unlock(&bench->mutex);
+        }
+        else{
+            lock_release(&bench->alloc_lock);
         }
 
-        free_block = current_bck;
-        current_bck = current_bck->prev;
+        for (int i = 0; i < LOCK_BENCH_OUTSIDE; i++){
+            local++;
+        }
 
     }
 
-    return;
-
+    return NULL;
 
 }
 
 
 
 /**
- * my_calloc() - dynamically allocates a block of memory for an array that has value elements, each with a size amount of bytes, all bytes being initalized to 0.
+ * lock_bench_run() - times one run of the benchmark
  * 
- * size_t value: number of elements in the array
+ * LockBench *bench: benchmark settings, the lock to use and the iterations per thread
  * 
- * size_t size: size of each element in the array
+ * int threads: number of threads to run
+ * 
+ * PerfCounters *counters: read around the run, the workers inherit them
  * ------------------------------------------------------------------------------------  
  * 
- * Description: Custom implementation of calloc that uses my_malloc() to dynamically allocate a block of memory in a pointer requested from the user.
- * Then set each byte in the pointer to 0 so the entire array is initalized to 0. Then the initalized pointer is returned to the user. If any errors occur during this process, 
- * NULL is returned to the user.
+ * Description: Starts the threads, waits for all of them and returns the wall clock time per acquisition in nanoseconds,
+ * or -1 if a thread could not be started.
  * 
  *           
  */
+static double lock_bench_run(LockBench *bench, int threads, PerfCounters *counters){
 
-void *my_calloc(size_t value,size_t size){ 
-
-    //Check for edge cases
-    if (size == 0 || value == 0){
-        return NULL;
-    }
+    pthread_t workers[64];
+    struct timespec start, end;
 
-    //check for integer overflow when calculating the size
-    size_t Total_size = size * value;
-    if (Total_size/value != size ){
-        return NULL;
+    perf_counters_start(counters);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < threads; i++){
+        if (pthread_create(&workers[i], NULL, lock_bench_worker, bench) != 0){
+            perror("pthread_create error");
+            for (int j = 0; j < i; j++){
+                pthread_join(workers[j], NULL);
+            }
+            perf_counters_stop(counters);
+            return -1;
+        }
     }
-
-    //use my_malloc() to allocate a block of memory to use
-    void *new_pointer = my_malloc(Total_size);
-
-    //check for any my_malloc() error
-    if (new_pointer == NULL){
-        fprintf(stderr,"my_calloc failed\n");\
-        return NULL;
+    for (int i = 0; i < threads; i++){
+        pthread_join(workers[i], NULL);
     }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    perf_counters_stop(counters);
 
-    //dereference the new_pointer to a char type so each byte from the memory address can be initialized to 0
-    char *ptr = (char *)new_pointer;
-
-    for (size_t i = 0; i <Total_size; i++){
-
-        ptr[i] = 0;
-
-    }
+    double elapsed = (double)(end.tv_sec - start.tv_sec) * 1e9 + (double)(end.tv_nsec - start.tv_nsec);
 
-    //return the initialized pointer to the user
-    return new_pointer;
+    return elapsed / ((double)bench->iterations * threads);
 
 }
 
 
 
 /**
- * my_realloc() - dynamically resizes a previously allocated block of memory.
+ * my_malloc_lock_bench() - compares AllocLock with a pthread mutex
  * 
- * void *ptr: previously allocated block of memory
+ * int max_threads: highest thread count to run
  * 
- * size_t size: new size value to resize void *ptr
+ * size_t iterations: acquisitions made by each thread in every run
  * ------------------------------------------------------------------------------------  
  * 
- * Description: Custom implementation of realloc that takes in a previously allocated block of memory. It first checks if the change in size is to shrink the block,
- * then the block of memory meta data 'size' is changed to the new size value. If the size value is larger than the meta data 'size' value then the function
- * uses my_malloc() to create a new block of memory of the requested size change and then copy's *ptr memory into the block using memcpy(). After copying the *ptr block
- * is then freed and the new larger block of memory with the copyed values of *ptr is returned to the user. If any errors occur during this process, NULL is returned to the user.
+ * Description: Runs the benchmark for 1, 2, 4, ... threads up to max_threads, once with each lock, and prints the time
+ * per acquisition of both together with how often AllocLock was contended, how many spins it used and how often it slept.
+ * A second table gives the hardware counters of every run per acquisition. Returns 0 on success and -1 if a run could not
+ * start its threads.
  * 
  *           
  */
-void *my_realloc(void *ptr,size_t size){
+int my_malloc_lock_bench(int max_threads, size_t iterations){
 
+    static LockBench bench;
+    PerfCounters counters, alloc_counters[8], mutex_counters[8];
+    int rows = 0, row_threads[8];
 
-    size_t aligned_size = ALIGN(size);//align size to ensure it is rounded to nearest 8-byte for correct memory alignment
-    if (ptr == NULL){
-        return my_malloc(size);
+    if (max_threads < 1){
+        max_threads = 1;
     }
-
-    //if the user wants the block to have a size of 0 then the block is freed
-    if (size == 0){
-        my_free(ptr);
-        return NULL;
+    if (max_threads > 64){
+        max_threads = 64;
     }
 
-    //Dereference the block and subtract the ptr by 1 to access the meta data in the address
-    Block *current = (Block *)ptr -1;
+    printf("\n============Lock Benchmark============\n");
+    printf("Threads  AllocLock (ns)  Mutex (ns)  Contended    Spins        Sleeps\n");
 
-    //first check if the change in size is less than the original size of the current block, if it is less then only change the meta data information on the size of the block
-    if (current->size >= aligned_size){
+    perf_counters_open(&counters);
 
-        //After changing the orginal size, check if the left over remaining memory is enough to create a block of atleast 8 bytes
-        if (current->size >= aligned_size + sizeof(Block) + ALIGNMENT){
+    for (int threads = 1; ; threads *= 2){
 
-            //Creating a block with the unused memory and ensure it is adjacent to the current block
-            Block *new_block = (Block *)((char *)(current + 1) + aligned_size);
-            new_block->free = 1;
-            new_block->prev = current;
-            new_block->next = current->next;
-            
-            new_block ->size = current->size - aligned_size - sizeof(Block);
-            if (current->next != NULL){
-                current->next->prev = new_block;
-            }
-            
-            current->next = new_block;
+        if (threads > max_threads){
+            threads = max_threads;
         }
 
-        //setting the size to the new size
-        current->size = aligned_size;
-
-        return ptr;
+        bench.iterations = iterations;
 
-    }
+        AllocLock fresh = ALLOC_LOCK_INITIALIZER;
+        bench.alloc_lock = fresh;
+        bench.use_mutex = 0;
+        double alloc_ns = lock_bench_run(&bench, threads, &counters);
+        alloc_counters[rows] = counters;
 
-    //If the size is larger than the current size, then a new block is created with the my_malloc function
-    else if(current->size < aligned_size ){
-        void *new_ptr = my_malloc(aligned_size);
+        pthread_mutex_init(&bench.mutex, NULL);
+        bench.use_mutex = 1;
+        double mutex_ns = lock_bench_run(&bench, threads, &counters);
+        pthread_mutex_destroy(&bench.mutex);
+        mutex_counters[rows] = counters;
+        row_threads[rows++] = threads;
 
-        //check for any my_malloc() errors
-        if (new_ptr == NULL){
-            fprintf(stderr,"realoc error\n");
-            return NULL;
+        if (alloc_ns < 0 || mutex_ns < 0){
+            perf_counters_close(&counters);
+            return -1;
         }
 
-        //copy memory of the old block to the new block
-        memcpy(new_ptr, ptr,current->size);
-
-        //after copying, free the old block of memory
-        my_free(ptr);
+        printf("%-8d %-15.1f %-11.1f %-12zu %-12zu %zu\n", threads, alloc_ns, mutex_ns, bench.alloc_lock.contended, bench.alloc_lock.spins, bench.alloc_lock.sleeps);
 
-        return new_ptr;
+        if (threads == max_threads){
+            break;
+        }
 
     }
 
-    //If the memory address is invalid
-    else{
-        fprintf(stderr,"invalid ptr\n");
-        return NULL;
+    perf_counters_close(&counters);
+
+    //counts per acquisition, over all threads of the run
+    printf("------------Counters per Acquisition--\n");
+    printf("%-8s %-10s", "Threads", "Lock");
+    perf_counters_header(stdout);
+    printf("\n");
+    for (int r = 0; r < rows; r++){
+        double acquisitions = (double)iterations * row_threads[r];
+        printf("%-8d %-10s", row_threads[r], "AllocLock");
+        perf_counters_columns(stdout, &alloc_counters[r], acquisitions);
+        printf("\n%-8d %-10s", row_threads[r], "Mutex");
+        perf_counters_columns(stdout, &mutex_counters[r], acquisitions);
+        printf("\n");
     }
-    
+
+    printf("=====================================\n\n");
+
+    return 0;
+
 }
 
 
+
+/*
+ * ---------------------------------------------------------------------------------------------
+ * Allocation benchmark
+ * ---------------------------------------------------------------------------------------------
+ * Times each allocation engine on the same churn: a fixed set of live allocations where every operation frees a random
+ * one and allocates a new one of a random size in its place. Small sizes go through the thread cache and slab runs,
+ * larger ones through the first-fit walk of the Block list, and glibc's malloc runs the same sizes as a reference. The
+ * hardware counters of every run are reported per operation next to its time.
+ */
+
+#define ALLOC_BENCH_SLOTS 1024//allocations kept alive during a run
+
+typedef struct alloc_bench_engine_type{
+    const char *name;//row label
+
+    size_t min_size;//smallest size requested
+
+    size_t max_size;//largest size requested
+
+    int use_libc;//1 to run glibc's malloc and free instead of my_malloc and my_free
+
+}AllocBenchEngine;
+
+static const AllocBenchEngine alloc_bench_engines[] = {
+    {"slab", 8, SLAB_MAX_SIZE, 0},
+    {"Block list", SLAB_MAX_SIZE + ALIGNMENT, 4096, 0},
+    {"glibc small", 8, SLAB_MAX_SIZE, 1},
+    {"glibc large", SLAB_MAX_SIZE + ALIGNMENT, 4096, 1},
+};
+
+
+
 /**
- * my_malloc_stats() - displays stats on all the dynamically allocated memory occurring in the program
+ * alloc_bench_run() - times one engine on the churn
+ * 
+ * const AllocBenchEngine *engine: engine and size range to run
+ * 
+ * size_t ops: frees and allocations to make, one of each per operation
+ * 
+ * void **slots: ALLOC_BENCH_SLOTS entries, kept outside the heap being measured
  * 
+ * PerfCounters *counters: read around the churn
  * ------------------------------------------------------------------------------------  
  * 
- * Description: displays in the terminal the total amount of memory blocks, free memory blocks, used memory blocks, amount of bytes used, and amount of bytes freed.
- * In addition it also outputs the fragmentation occuring in the memory which is the percentage of free bytes from the total bytes dynamically allocated.
+ * Description: Fills every slot first so the churn starts from a heap in steady state, then measures only the churn,
+ * and frees every slot at the end. Sizes and slots come from a xorshift generator with a fixed seed so every engine
+ * sees the same sequence. Every allocation has its first byte written, like a caller would. Returns nanoseconds per
+ * operation.
  * 
  *           
  */
-void my_malloc_stats(){
+static double alloc_bench_run(const AllocBenchEngine *engine, size_t ops, void **slots, PerfCounters *counters){
 
-    //Information on the current heap space
-    size_t total_blocks = 0;
+    uint64_t seed = 0x2545F4914F6CDD1DULL;
+    size_t range = engine->max_size - engine->min_size + 1;
 
-    size_t free_blocks = 0;
+    for (int i = 0; i < ALLOC_BENCH_SLOTS; i++){
+        seed ^= seed << 13; seed ^= seed >> 7; seed ^= seed << 17;
+        size_t size = engine->min_size + seed % range;
+        slots[i] = engine->use_libc ? malloc(size) : my_malloc(size);
+    }
 
-    size_t used_blocks = 0;
+    struct timespec start, end;
+    perf_counters_start(counters);
+    clock_gettime(CLOCK_MONOTONIC, &start);
 
-    size_t used_bytes = 0;
+    for (size_t n = 0; n < ops; n++){
 
-    size_t free_bytes = 0;
+        seed ^= seed << 13; seed ^= seed >> 7; seed ^= seed << 17;
+        size_t slot = seed % ALLOC_BENCH_SLOTS;
+        size_t size = engine->min_size + (seed >> 16) % range;
 
-    Block *current = head;
+        if (engine->use_libc){
+            free(slots[slot]);
+            slots[slot] = malloc(size);
+        }
+        else{
+            my_free(slots[slot]);
+            slots[slot] = my_malloc(size);
+        }
+        *(volatile char *)slots[slot] = 1;
 
-    //loop through the linked list to update the variables recording the heap space information
-    while (current != NULL){
+    }
 
-        total_blocks++;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    perf_counters_stop(counters);
 
-        if (current->free == 0){
-            used_blocks++;
-            used_bytes = current->size;
+    for (int i = 0; i < ALLOC_BENCH_SLOTS; i++){
+        if (engine->use_libc){
+            free(slots[i]);
         }
-
-        else if (current->free == 1){
-            free_blocks++;
-            free_bytes = current->size;
+        else{
+            my_free(slots[i]);
         }
+    }
 
-        current = current->next;
+    double elapsed = (double)(end.tv_sec - start.tv_sec) * 1e9 + (double)(end.tv_nsec - start.tv_nsec);
 
-    }
+    return elapsed / (double)ops;
 
-    //output information to the terminal
-    printf("\n============Malloc Stats==============\n");
-    printf("Total Blocks:               %zu\n", total_blocks);
-    printf("Used Blocks:                %zu\n", used_blocks);
-    printf("Free Blocks:                %zu\n", free_blocks);
-    printf("Used Memory (B):            %zu\n", used_bytes);
-    printf("Free Memory (B):            %zu\n", free_bytes);
-    printf("Total Memory (B):           %zu\n", used_bytes + free_bytes);
+}
 
-    //checking if any memory is allocated before doing fragmentation calculation
-    if ((used_bytes + free_bytes)>0){
 
-        //calculate the fragmentation in the heap and output to the terminal
-        float fragmentation = 100.0f *((float)(free_bytes)/(float)(free_bytes + used_bytes));
-        printf("fragmentation               %.2f%%\n", fragmentation);
 
+/**
+ * my_malloc_alloc_bench() - compares the allocation engines with hardware counters
+ * 
+ * size_t ops: operations made by every engine
+ * ------------------------------------------------------------------------------------  
+ * 
+ * Description: Runs every engine of alloc_bench_engines[] in turn and prints one row per engine with the time and each
+ * hardware counter per operation, an operation being one free and one allocation. Returns 0 on success and -1 if the
+ * slot array could not be mapped.
+ * 
+ *           
+ */
+int my_malloc_alloc_bench(size_t ops){
+
+    if (ops == 0){
+        ops = 1;
     }
 
-    //If no memory is allocated
-    else{
-        
-        printf("fragmentation           N/A\n");
+    void **slots = mmap(NULL, ALLOC_BENCH_SLOTS * sizeof(void *), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (slots == MAP_FAILED){
+        perror("mmap error");
+        return -1;
+    }
+
+    PerfCounters counters;
+    perf_counters_open(&counters);
+
+    printf("\n============Allocation Benchmark======\n");
+    printf("%zu live allocations, %zu operations, counts per operation\n", (size_t)ALLOC_BENCH_SLOTS, ops);
+    printf("%-13s%-10s", "Engine", "ns");
+    perf_counters_header(stdout);
+    printf("\n");
+
+    for (size_t i = 0; i < sizeof(alloc_bench_engines) / sizeof(alloc_bench_engines[0]); i++){
+        double ns = alloc_bench_run(&alloc_bench_engines[i], ops, slots, &counters);
+        printf("%-13s%-10.1f", alloc_bench_engines[i].name, ns);
+        perf_counters_columns(stdout, &counters, (double)ops);
+        printf("\n");
     }
 
     printf("=====================================\n\n");
 
-    return;
+    perf_counters_close(&counters);
+    munmap(slots, ALLOC_BENCH_SLOTS * sizeof(void *));
+
+    return 0;
+
 }
 
 
 
 /**
  * main() - Main program to demonstrate the custom implementation of different memory allocation functions in C
- * ---------------------------------------------------
+ * ---------------------------------------------------  
  * A demonstration of the following functions:
  * 
  * - my_malloc()
@@ -429,8 +11016,103 @@ void my_malloc_stats(){
  * - my_free()  
  * - my_malloc_stats()    
  * 
+ * Run with "replay <trace> [fullest|naive] [frames=<prefix>] [every=<ops>] [scale=<bytes per pixel>]" to replay an
+ * allocation trace instead of the demo. Add "histogram=<path>" to also write the requested size histogram of the trace,
+ * "check=<ops>" to verify the heap with my_malloc_check() every <ops> operations, and "snapshot=<path>" to write the
+ * allocations left live at the end of the trace to a heap snapshot.
+ * 
+ * Run with "snapshot-diff <before> <after>" to print which sizes and callsites grew between two heap snapshots.
+ * 
+ * Run with "tune-classes <histogram or trace> [classes=<n>]" to print a size class table tuned for a workload.
+ * 
+ * Run with "fuzz [inputs...]" to run the fuzz harness on input files, or on random inputs when none are given. Builds made
+ * with -DMY_MALLOC_FUZZ leave main() out so libFuzzer can supply its own.
+ * 
+ * Run with "fork-stress [threads] [forks]" to fork repeatedly while worker threads allocate and report children that
+ * deadlock or find a broken heap.
+ * 
+ * Run with "guard-test" to check that guarded sampling catches an overflow, a use after free and a double free.
+ * 
+ * Run with "lock-bench [threads] [iterations]" to time the allocator's lock against a pthread mutex.
+ * 
+ * Run with "alloc-bench [operations]" to time the slab and Block list engines and glibc with hardware counters.
+ * 
  */
-int main(){
+#ifndef MY_MALLOC_FUZZ
+int main(int argc, char *argv[]){
+
+    //replay a trace when one is given, optionally with the naive slab policy and heap layout frames
+    if (argc >= 3 && strcmp(argv[1], "replay") == 0){
+        ReplayOptions options = {NULL, 10000, 64, NULL, 0, NULL};
+        for (int i = 3; i < argc; i++){
+            if (strcmp(argv[i], "naive") == 0){
+                slab_policy = SLAB_POLICY_NAIVE;
+            }
+            else if (strncmp(argv[i], "frames=", 7) == 0){
+                options.frame_prefix = argv[i] + 7;
+            }
+            else if (strncmp(argv[i], "every=", 6) == 0){
+                options.frame_interval = strtoul(argv[i] + 6, NULL, 10);
+            }
+            else if (strncmp(argv[i], "scale=", 6) == 0){
+                options.bytes_per_pixel = strtoul(argv[i] + 6, NULL, 10);
+            }
+            else if (strncmp(argv[i], "histogram=", 10) == 0){
+                options.histogram_path = argv[i] + 10;
+            }
+            else if (strncmp(argv[i], "check=", 6) == 0){
+                options.check_interval = strtoul(argv[i] + 6, NULL, 10);
+            }
+            else if (strncmp(argv[i], "snapshot=", 9) == 0){
+                options.snapshot_path = argv[i] + 9;
+            }
+        }
+        return my_malloc_replay(argv[2], &options) == 0 ? 0 : 1;
+    }
+
+    //derive a size class table from a recorded histogram or trace
+    if (argc >= 3 && strcmp(argv[1], "tune-classes") == 0){
+        unsigned int max_classes = slab_class_count;
+        if (argc >= 4 && strncmp(argv[3], "classes=", 8) == 0){
+            max_classes = (unsigned int)strtoul(argv[3] + 8, NULL, 10);
+        }
+        return my_malloc_tune_classes(argv[2], max_classes) == 0 ? 0 : 1;
+    }
+
+    //fork children while worker threads allocate, a child that hangs on a lock held at fork time is reported
+    if (argc >= 2 && strcmp(argv[1], "fork-stress") == 0){
+        int threads = (argc >= 3) ? atoi(argv[2]) : 4;
+        int forks = (argc >= 4) ? atoi(argv[3]) : 200;
+        return my_malloc_fork_stress(threads, forks) == 0 ? 0 : 1;
+    }
+
+    //make memory errors in forked children and check that guarded sampling reports them
+    if (argc >= 2 && strcmp(argv[1], "guard-test") == 0){
+        return my_malloc_guard_test() == 0 ? 0 : 1;
+    }
+
+    //time AllocLock against a pthread mutex for growing thread counts
+    if (argc >= 2 && strcmp(argv[1], "lock-bench") == 0){
+        int threads = (argc >= 3) ? atoi(argv[2]) : 16;
+        size_t iterations = (argc >= 4) ? strtoul(argv[3], NULL, 10) : 200000;
+        return my_malloc_lock_bench(threads, iterations) == 0 ? 0 : 1;
+    }
+
+    //time every allocation engine with hardware counters
+    if (argc >= 2 && strcmp(argv[1], "alloc-bench") == 0){
+        size_t ops = (argc >= 3) ? strtoul(argv[2], NULL, 10) : 1000000;
+        return my_malloc_alloc_bench(ops) == 0 ? 0 : 1;
+    }
+
+    //compare two heap snapshots
+    if (argc >= 4 && strcmp(argv[1], "snapshot-diff") == 0){
+        return my_malloc_snapshot_diff(argv[2], argv[3], stdout) == 0 ? 0 : 1;
+    }
+
+    //run the fuzz harness on the given inputs, AFL passes one file per run
+    if (argc >= 2 && strcmp(argv[1], "fuzz") == 0){
+        return my_malloc_fuzz(argc - 2, argv + 2) == 0 ? 0 : 1;
+    }
 
     printf("----- Custom malloc demo -----\n");
 
@@ -462,10 +11144,29 @@ int main(){
     }
     my_malloc_stats();
 
-    // 4. Free both
+    // 4. Allocate a large block that is too big for the slab classes
+    char *big = (char *)my_malloc(2048);
+    if (big != NULL) {
+        memset(big, 'x', 2048);
+        printf("big: %.8s... (2048 bytes)\n", big);
+    }
+    my_malloc_stats();
+
+    //with MY_MALLOC_CALLSITES or MY_MALLOC_TAGS set, show which calls and tags of the demo own the live memory
+    if (callsite_enabled){
+        my_malloc_dump_callsites(stdout);
+    }
+    if (tag_enabled){
+        my_malloc_dump_tags(stdout);
+    }
+
+    // 5. Free everything
     my_free(ptr1);
     my_free(arr);
+    my_free(big);
     my_malloc_stats();
+    my_malloc_dump_ascii(stdout, 64);
 
     return 0;
-}
\ No newline at end of file
+}
+#endif